@@ -4,6 +4,7 @@
 
 #include "formula.h"
 #include "includes.h"
+#include "memory_stats.h"
 #include "util.h"
 
 #define PARSE_LVLS 6
@@ -17,6 +18,8 @@ static const int op_lvl[] = {
         5,
         6,
         7,
+        8, 8, 8, 8, 8, 8,
+        8, 8, 8, 8, 8,
         8, 8, 8
 };
 
@@ -31,7 +34,12 @@ static const char *op_sym[] = {
         "",
         "N",
         "x",
-        "t"
+        "t",
+        "u",
+        "v",
+        "",
+        "sin8", "cos8", "beat", "noise", "rand",
+        "hue", "sat", "val"
 };
 
 static const char *findNextOperator(const char *formula, const char *end, FormulaOp op_base, FormulaOp &which) {
@@ -53,11 +61,13 @@ static const char *findNextOperator(const char *formula, const char *end, Formul
         case '|':
           formula = findNextOperator(formula + 1, end, op_abs, which);
           break;
-        case '(':
-          formula = findNextOperator(formula + 1, end, op_const, which);
+        case '(': // Skip to the matching parenthesis
+          for (int depth = 1; depth > 0 && ++formula != end;)
+            depth += *formula == '(' ? 1 : *formula == ')' ? -1 : 0;
           break;
       }
-      ++formula;
+      if (formula != end)
+        ++formula;
     }
   }
   return formula;
@@ -66,6 +76,9 @@ static const char *findNextOperator(const char *formula, const char *end, Formul
 // Parse a value between operators
 static Form *parseFormLiteral(const char *begin, const char *end);
 
+// Parse the arguments of a builtin function, begin and end being just inside the parentheses
+static Form *parseFunction(FormulaOp op, const char *begin, const char *end);
+
 static Form *parseFormula(const char *begin, const char *end, int lvl) {
   while (end != begin && *(end - 1) == ' ')
     --end;
@@ -122,8 +135,22 @@ static Form *parseFormLiteral(const char *begin, const char *end) {
   // Is it a group?
   if (*begin == '(' && *(end - 1) == ')')
     return parseFormula(begin + 1, end - 1, 0);
-  if (*begin == '|' && *(end - 1) == '|')
-    return new UnaryForm(op_abs, parseFormula(begin + 1, end - 1, 0));
+  if (*begin == '|' && *(end - 1) == '|') {
+    Form *form = parseFormula(begin + 1, end - 1, 0);
+    return form == nullptr ? nullptr : new UnaryForm(op_abs, form);
+  }
+
+  // Or a function call?
+  for (FormulaOp op = op_sin8; op != op_none; op = (FormulaOp) (op + 1)) {
+    if (!isSubstr(begin, op_sym[op]))
+      continue;
+
+    const char *args = begin + strlen(op_sym[op]);
+    while (args != end && *args == ' ')
+      ++args;
+    if (args != end && *args == '(' && *(end - 1) == ')')
+      return parseFunction(op, args + 1, end - 1);
+  }
 
   // First, is there a constant?
   const char *pos = begin;
@@ -144,33 +171,72 @@ static Form *parseFormLiteral(const char *begin, const char *end) {
                                   : isDouble ? new ConstForm(atof(copy)) : new ConstForm(atoi(copy));
   delete[] copy;
 
-  // Now check for N, x, t occurrences
+  // Now check for N, x, t, u, v and variable occurrences
   while (pos != end) {
     switch (*pos) {
       case 'N':
       case 'x':
       case 't':
+      case 'u':
+      case 'v':
         c = *pos;
-        form = new VarForm(c == 'N' ? op_n : c == 'x' ? op_x : op_t);
+        form = new VarForm(c == 'N' ? op_n : c == 'x' ? op_x : c == 't' ? op_t : c == 'u' ? op_u : op_v);
         res = res == nullptr ? form : new BinaryForm(op_times, res, form);
         break;
       case ' ':
         break;
-      default: // Invalid character
-        delete res;
-        return nullptr;
+      default:
+        if (!VarForm::isVariableName(*pos)) { // Invalid character
+          delete res;
+          return nullptr;
+        }
+        form = new VarForm(op_var, *pos);
+        res = res == nullptr ? form : new BinaryForm(op_times, res, form);
+        break;
     }
     ++pos;
   }
   return res;
 }
 
+static Form *parseFunction(FormulaOp op, const char *begin, const char *end) {
+  const char *comma = begin;
+  for (int depth = 0; comma != end && (depth > 0 || *comma != ','); ++comma)
+    depth += *comma == '(' ? 1 : *comma == ')' ? -1 : 0;
+
+  bool binary = FuncForm::getArgCount(op) == 2;
+  if ((comma != end) != binary)
+    return nullptr;
+
+  Form *a = parseFormula(begin, comma, 0), *b = binary ? parseFormula(comma + 1, end, 0) : nullptr;
+  if (a == nullptr || (binary && b == nullptr)) {
+    delete a;
+    delete b;
+    return nullptr;
+  }
+  return new FuncForm(op, a, b);
+}
+
 Form *parseFormula(const char *formula) {
   return parseFormula(formula, formula + strlen(formula), 0);
 }
 
+const char *getSymbol(FormulaOp op) {
+  return op_sym[op];
+}
+
 Form::Form(FormulaOp op) : op(op) {}
 
+void *Form::operator new(size_t size) {
+  trackMemory(memory_formula_trees, (int) size);
+  return ::operator new(size);
+}
+
+void Form::operator delete(void *pointer, size_t size) {
+  trackMemory(memory_formula_trees, -(int) size);
+  ::operator delete(pointer);
+}
+
 bool Form::isTimed() const {
   return false;
 }
@@ -179,6 +245,14 @@ bool Form::isVariable() const {
   return false;
 }
 
+bool Form::isStateful() const {
+  return false;
+}
+
+uint32_t Form::usedVariables() const {
+  return 0;
+}
+
 int Form::eval(int x, int t) const {
   return 0;
 }
@@ -187,6 +261,11 @@ double Form::eval(double x, double t) const {
   return 0;
 }
 
+void Form::evalBatch(int x, int step, int count, int t, int *out) const {
+  for (int i = 0; i < count; ++i, x += step)
+    out[i] = eval(x, t);
+}
+
 void Form::append(FormulaType type, String &s) const {}
 
 String Form::toString(FormulaType type) const {
@@ -195,24 +274,52 @@ String Form::toString(FormulaType type) const {
   return s;
 }
 
-VarForm::VarForm(FormulaOp op) : Form(op) {}
+int VarForm::ledCount = 0;
+const uint16_t *VarForm::coordinates[2] = {nullptr, nullptr};
+int VarForm::intValues[26] = {};
+double VarForm::doubleValues[26] = {};
+
+VarForm::VarForm(FormulaOp op, char name) : Form(op), name(name) {}
+
+void VarForm::setVariable(char name, int intValue, double doubleValue) {
+  intValues[name - 'a'] = intValue;
+  doubleValues[name - 'a'] = doubleValue;
+}
+
+bool VarForm::isVariableName(char name) {
+  return name >= 'a' && name <= 'z' && name != 'x' && name != 't' && name != 'u' && name != 'v';
+}
 
 bool VarForm::isTimed() const {
   return op == op_t;
 }
 
 bool VarForm::isVariable() const {
-  return op == op_x;
+  return op == op_x || op == op_u || op == op_v;
+}
+
+// Fade can make the renderer calculate a few leds past the end
+static inline int coordinate(FormulaOp op, int x) {
+  return VarForm::coordinates[op - op_u][x < VarForm::ledCount ? x : VarForm::ledCount - 1];
+}
+
+uint32_t VarForm::usedVariables() const {
+  return op == op_var ? 1 << (name - 'a') : 0;
 }
 
 int VarForm::eval(int x, int t) const {
   switch (op) {
     case op_n:
-      return NUM_LEDS;
+      return ledCount;
     case op_x:
       return x;
     case op_t:
       return t;
+    case op_u:
+    case op_v:
+      return coordinate(op, x);
+    case op_var:
+      return intValues[name - 'a'];
     default:
       return 0;
   }
@@ -221,18 +328,35 @@ int VarForm::eval(int x, int t) const {
 double VarForm::eval(double x, double t) const {
   switch (op) {
     case op_n:
-      return NUM_LEDS;
+      return ledCount;
     case op_x:
       return x;
     case op_t:
       return t;
+    case op_u:
+    case op_v:
+      return coordinate(op, (int) x);
+    case op_var:
+      return doubleValues[name - 'a'];
     default:
       return 0;
   }
 }
 
+void VarForm::evalBatch(int x, int step, int count, int t, int *out) const {
+  if (op == op_u || op == op_v) {
+    for (int i = 0; i < count; ++i, x += step)
+      out[i] = coordinate(op, x);
+    return;
+  }
+
+  int value = op == op_n ? ledCount : op == op_var ? intValues[name - 'a'] : t;
+  for (int i = 0; i < count; ++i, x += step)
+    out[i] = op == op_x ? x : value;
+}
+
 void VarForm::append(FormulaType type, String &s) const {
-  s += "Nxt"[op - op_n];
+  s += op == op_var ? name : "Nxtuv"[op - op_n];
 }
 
 ConstForm::ConstForm(double value) : Form(op_const), intValue((int) value), doubleValue(value) {}
@@ -247,6 +371,11 @@ double ConstForm::eval(double x, double t) const {
   return doubleValue;
 }
 
+void ConstForm::evalBatch(int x, int step, int count, int t, int *out) const {
+  for (int i = 0; i < count; ++i)
+    out[i] = intValue;
+}
+
 void ConstForm::append(FormulaType type, String &s) const {
   s += type == int_formula ? String(intValue) : String(doubleValue);
 }
@@ -265,6 +394,14 @@ bool UnaryForm::isVariable() const {
   return a->isVariable();
 }
 
+bool UnaryForm::isStateful() const {
+  return a->isStateful();
+}
+
+uint32_t UnaryForm::usedVariables() const {
+  return a->usedVariables();
+}
+
 int UnaryForm::eval(int x, int t) const {
   return abs(a->eval(x, t));
 }
@@ -273,10 +410,21 @@ double UnaryForm::eval(double x, double t) const {
   return abs(a->eval(x, t));
 }
 
+void UnaryForm::evalBatch(int x, int step, int count, int t, int *out) const {
+  a->evalBatch(x, step, count, t, out);
+  for (int i = 0; i < count; ++i)
+    out[i] = abs(out[i]);
+}
+
 void UnaryForm::append(FormulaType type, String &s) const {
-  s += "|";
-  a->append(type, s);
-  s += "|";
+  // ||x| + 1| can't be parsed, so that needs to be |(|x| + 1)|
+  String inner;
+  a->append(type, inner);
+  bool group = inner.startsWith("|") || inner.endsWith("|");
+
+  s += group ? "|(" : "|";
+  s += inner;
+  s += group ? ")|" : "|";
 }
 
 BinaryForm::BinaryForm(FormulaOp op, const Form *a, const Form *b) : UnaryForm(op, a), b(b) {}
@@ -293,6 +441,14 @@ bool BinaryForm::isVariable() const {
   return a->isVariable() || b->isVariable();
 }
 
+bool BinaryForm::isStateful() const {
+  return a->isStateful() || b->isStateful();
+}
+
+uint32_t BinaryForm::usedVariables() const {
+  return a->usedVariables() | b->usedVariables();
+}
+
 int BinaryForm::eval(int x, int t) const {
   switch (op) {
     case op_eq:
@@ -367,20 +523,92 @@ double BinaryForm::eval(double x, double t) const {
   }
 }
 
+void BinaryForm::evalBatch(int x, int step, int count, int t, int *out) const {
+  int other[FORMULA_BATCH];
+  a->evalBatch(x, step, count, t, out);
+  b->evalBatch(x, step, count, t, other);
+
+  // One loop per operator instead of a switch per led
+  switch (op) {
+    case op_eq:
+      for (int i = 0; i < count; ++i)
+        out[i] = out[i] == other[i] ? 1 : 0;
+      break;
+    case op_ge:
+      for (int i = 0; i < count; ++i)
+        out[i] = out[i] >= other[i] ? 1 : 0;
+      break;
+    case op_le:
+      for (int i = 0; i < count; ++i)
+        out[i] = out[i] <= other[i] ? 1 : 0;
+      break;
+    case op_gt:
+      for (int i = 0; i < count; ++i)
+        out[i] = out[i] > other[i] ? 1 : 0;
+      break;
+    case op_lt:
+      for (int i = 0; i < count; ++i)
+        out[i] = out[i] < other[i] ? 1 : 0;
+      break;
+    case op_max:
+      for (int i = 0; i < count; ++i)
+        out[i] = max(out[i], other[i]);
+      break;
+    case op_min:
+      for (int i = 0; i < count; ++i)
+        out[i] = min(out[i], other[i]);
+      break;
+    case op_plus:
+      for (int i = 0; i < count; ++i)
+        out[i] += other[i];
+      break;
+    case op_minus:
+      for (int i = 0; i < count; ++i)
+        out[i] -= other[i];
+      break;
+    case op_times:
+      for (int i = 0; i < count; ++i)
+        out[i] *= other[i];
+      break;
+    case op_over:
+      for (int i = 0; i < count; ++i)
+        out[i] /= other[i];
+      break;
+    case op_mod:
+      for (int i = 0; i < count; ++i)
+        out[i] %= other[i];
+      break;
+    case op_power:
+      for (int i = 0; i < count; ++i) {
+        int v = out[i], pow = other[i];
+        out[i] = 1;
+        while (--pow >= 0)
+          out[i] *= v;
+      }
+      break;
+    default:
+      for (int i = 0; i < count; ++i)
+        out[i] = 0;
+  }
+}
+
 void BinaryForm::append(FormulaType type, String &s) const {
-  if (op_lvl[a->op] < op)
+  // Operators of the same level are parsed from left to right, so only the right side needs parentheses for those
+  bool group_a = op_lvl[a->op] < op_lvl[op], group_b = op_lvl[b->op] <= op_lvl[op];
+
+  if (group_a)
     s += "(";
   a->append(type, s);
-  if (op_lvl[a->op] < op)
+  if (group_a)
     s += ")";
   s += " ";
   s += getOperator();
   s += " ";
 
-  if (op_lvl[b->op] > op)
+  if (group_b)
     s += "(";
   b->append(type, s);
-  if (op_lvl[b->op] > op)
+  if (group_b)
     s += ")";
 }
 
@@ -431,6 +659,14 @@ bool TernaryForm::isVariable() const {
   return a->isVariable() || b->isVariable() || c->isVariable();
 }
 
+bool TernaryForm::isStateful() const {
+  return a->isStateful() || b->isStateful() || c->isStateful();
+}
+
+uint32_t TernaryForm::usedVariables() const {
+  return a->usedVariables() | b->usedVariables() | c->usedVariables();
+}
+
 int TernaryForm::eval(int x, int t) const {
   return (a->eval(x, t) != 0 ? b : c)->eval(x, t);
 }
@@ -446,3 +682,200 @@ void TernaryForm::append(FormulaType type, String &s) const {
   s += " : ";
   c->append(type, s);
 }
+
+// 256 samples of a sine wave between 0 and 255, sin8(64) being the top
+static const struct SinTable {
+  uint8_t values[256];
+
+  SinTable() : values() {
+    for (int i = 0; i < 256; ++i)
+      values[i] = (uint8_t) lround(127.5 + 127.5 * sin(i * 2 * PI / 256));
+  }
+} sin_table;
+
+static inline uint32_t hash(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline int sin8(int a) {
+  return sin_table.values[a & 0xFF];
+}
+
+// Sawtooth from 0 to 255 that repeats bpm times per minute of ticks
+static inline int beat(int t, int bpm) {
+  return (int) ((int64_t) t * TICK_DURATION * bpm * 256 / 60000) & 0xFF;
+}
+
+static inline int gradient(uint32_t h, int dx, int dy) {
+  switch (h & 7) {
+    case 0: return dx + dy;
+    case 1: return dx - dy;
+    case 2: return dy - dx;
+    case 3: return -dx - dy;
+    case 4: return dx;
+    case 5: return -dx;
+    case 6: return dy;
+    default: return -dy;
+  }
+}
+
+// Perlin noise between 0 and 255, with 256 units between the points of the grid
+static inline int noise(int x, int y) {
+  int xi = x >> 8, yi = y >> 8, fx = x & 0xFF, fy = y & 0xFF;
+
+  uint32_t h0 = hash(xi), h1 = hash(xi + 1);
+  int n00 = gradient(hash(h0 + yi), fx, fy), n10 = gradient(hash(h1 + yi), fx - 256, fy);
+  int n01 = gradient(hash(h0 + yi + 1), fx, fy - 256), n11 = gradient(hash(h1 + yi + 1), fx - 256, fy - 256);
+
+  // Smoothstep, so the grid doesn't show
+  int u = fx * fx * (768 - 2 * fx) >> 16, v = fy * fy * (768 - 2 * fy) >> 16;
+  int n0 = n00 + ((n10 - n00) * u >> 8), n1 = n01 + ((n11 - n01) * u >> 8);
+  return clampByte(128 + ((n0 + ((n1 - n0) * v >> 8)) >> 1));
+}
+
+static inline int random8(int x) {
+  return (int) (hash(x ^ 0x5bd1e995) & 0xFF);
+}
+
+const PixelState *FuncForm::previousFrame = nullptr;
+
+// Leds outside the strip look like the one at the end
+static inline const PixelState &previous(int led) {
+  return FuncForm::previousFrame[led < 0 ? 0 : led >= VarForm::ledCount ? VarForm::ledCount - 1 : led];
+}
+
+FuncForm::FuncForm(FormulaOp op, const Form *a, const Form *b) : Form(op), a(a), b(b) {}
+
+FuncForm::~FuncForm() {
+  delete a;
+  delete b;
+}
+
+// The previous frame changes every tick, and usually depends on the led
+bool FuncForm::isTimed() const {
+  return op >= op_hue || a->isTimed() || (b != nullptr && b->isTimed());
+}
+
+bool FuncForm::isVariable() const {
+  return op >= op_hue || a->isVariable() || (b != nullptr && b->isVariable());
+}
+
+bool FuncForm::isStateful() const {
+  return op >= op_hue || a->isStateful() || (b != nullptr && b->isStateful());
+}
+
+uint32_t FuncForm::usedVariables() const {
+  return a->usedVariables() | (b != nullptr ? b->usedVariables() : 0);
+}
+
+int FuncForm::eval(int x, int t) const {
+  switch (op) {
+    case op_sin8:
+      return sin8(a->eval(x, t));
+    case op_cos8:
+      return sin8(a->eval(x, t) + 64);
+    case op_beat:
+      return beat(a->eval(x, t), b->eval(x, t));
+    case op_noise:
+      return noise(a->eval(x, t), b->eval(x, t));
+    case op_rand:
+      return random8(a->eval(x, t));
+    case op_hue:
+      return previous(a->eval(x, t)).h;
+    case op_sat:
+      return previous(a->eval(x, t)).s;
+    case op_val:
+      return previous(a->eval(x, t)).v;
+    default:
+      return 0;
+  }
+}
+
+double FuncForm::eval(double x, double t) const {
+  int av = (int) lround(a->eval(x, t)), bv = b == nullptr ? 0 : (int) lround(b->eval(x, t));
+  switch (op) {
+    case op_sin8:
+      return sin8(av);
+    case op_cos8:
+      return sin8(av + 64);
+    case op_beat:
+      return beat(av, bv);
+    case op_noise:
+      return noise(av, bv);
+    case op_rand:
+      return random8(av);
+    case op_hue:
+      return previous(av).h;
+    case op_sat:
+      return previous(av).s;
+    case op_val:
+      return previous(av).v;
+    default:
+      return 0;
+  }
+}
+
+void FuncForm::evalBatch(int x, int step, int count, int t, int *out) const {
+  int other[FORMULA_BATCH];
+  a->evalBatch(x, step, count, t, out);
+  if (b != nullptr)
+    b->evalBatch(x, step, count, t, other);
+
+  switch (op) {
+    case op_sin8:
+      for (int i = 0; i < count; ++i)
+        out[i] = sin8(out[i]);
+      break;
+    case op_cos8:
+      for (int i = 0; i < count; ++i)
+        out[i] = sin8(out[i] + 64);
+      break;
+    case op_beat:
+      for (int i = 0; i < count; ++i)
+        out[i] = beat(out[i], other[i]);
+      break;
+    case op_noise:
+      for (int i = 0; i < count; ++i)
+        out[i] = noise(out[i], other[i]);
+      break;
+    case op_rand:
+      for (int i = 0; i < count; ++i)
+        out[i] = random8(out[i]);
+      break;
+    case op_hue:
+      for (int i = 0; i < count; ++i)
+        out[i] = previous(out[i]).h;
+      break;
+    case op_sat:
+      for (int i = 0; i < count; ++i)
+        out[i] = previous(out[i]).s;
+      break;
+    case op_val:
+      for (int i = 0; i < count; ++i)
+        out[i] = previous(out[i]).v;
+      break;
+    default:
+      for (int i = 0; i < count; ++i)
+        out[i] = 0;
+  }
+}
+
+void FuncForm::append(FormulaType type, String &s) const {
+  s += op_sym[op];
+  s += "(";
+  a->append(type, s);
+  if (b != nullptr) {
+    s += ", ";
+    b->append(type, s);
+  }
+  s += ")";
+}
+
+int FuncForm::getArgCount(FormulaOp op) {
+  return op == op_beat || op == op_noise ? 2 : 1;
+}
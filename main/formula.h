@@ -7,11 +7,20 @@
 
 #include "Arduino.h"
 
+// How many leds are evaluated at once by evalBatch
+#define FORMULA_BATCH 32
+// Per-tick variables are named with a lowercase letter (except x, t, u and v)
+#define MAX_VARIABLES 4
 
 enum FormulaType {
   int_formula, double_formula
 };
 
+// What a led looked like in the previous frame
+struct PixelState {
+  uint8_t h, s, v;
+};
+
 enum FormulaOp {
   op_cond,
   op_eq, op_ge, op_le, op_gt, op_lt,
@@ -21,7 +30,9 @@ enum FormulaOp {
   op_power,
   op_abs,
   op_const,
-  op_n, op_x, op_t,
+  op_n, op_x, op_t, op_u, op_v, op_var,
+  op_sin8, op_cos8, op_beat, op_noise, op_rand,
+  op_hue, op_sat, op_val,
   op_none
 };
 
@@ -33,31 +44,64 @@ public:
 
   virtual ~Form() = default;
 
+  // Counted in the memory stats
+  static void *operator new(size_t size);
+  static void operator delete(void *pointer, size_t size);
+
   virtual bool isTimed() const;
 
   virtual bool isVariable() const;
 
+  // Whether it uses the previous frame
+  virtual bool isStateful() const;
+
+  // The per-tick variables it uses, bit 0 for a up to bit 25 for z
+  virtual uint32_t usedVariables() const;
+
   virtual int eval(int x, int t) const;
 
   virtual double eval(double x, double t) const;
 
+  // Evaluates count leds at once, starting at x and then every step leds
+  virtual void evalBatch(int x, int step, int count, int t, int *out) const;
+
   virtual void append(FormulaType type, String &s) const;
 
   String toString(FormulaType type) const;
 };
 
 class VarForm : public Form {
+private:
+  static int intValues[26];
+  static double doubleValues[26];
+
+  const char name;
+
 public:
-  explicit VarForm(FormulaOp op);
+  // The value of N
+  static int ledCount;
+  // The values of u and v for every led
+  static const uint16_t *coordinates[2];
+
+  explicit VarForm(FormulaOp op, char name = 0);
+
+  // Sets the value of a per-tick variable, until it's set again
+  static void setVariable(char name, int intValue, double doubleValue);
+
+  static bool isVariableName(char name);
 
   bool isTimed() const override;
 
   bool isVariable() const override;
 
+  uint32_t usedVariables() const override;
+
   int eval(int x, int t) const override;
 
   double eval(double x, double t) const override;
 
+  void evalBatch(int x, int step, int count, int t, int *out) const override;
+
   void append(FormulaType type, String &s) const override;
 };
 
@@ -75,6 +119,8 @@ public:
 
   double eval(double x, double t) const override;
 
+  void evalBatch(int x, int step, int count, int t, int *out) const override;
+
   void append(FormulaType type, String &s) const override;
 };
 
@@ -91,10 +137,16 @@ public:
 
   bool isVariable() const override;
 
+  bool isStateful() const override;
+
+  uint32_t usedVariables() const override;
+
   int eval(int x, int t) const override;
 
   double eval(double x, double t) const override;
 
+  void evalBatch(int x, int step, int count, int t, int *out) const override;
+
   void append(FormulaType type, String &s) const override;
 };
 
@@ -111,10 +163,16 @@ public:
 
   bool isVariable() const override;
 
+  bool isStateful() const override;
+
+  uint32_t usedVariables() const override;
+
   int eval(int x, int t) const override;
 
   double eval(double x, double t) const override;
 
+  void evalBatch(int x, int step, int count, int t, int *out) const override;
+
   void append(FormulaType type, String &s) const override;
 
   const char *getOperator() const;
@@ -133,6 +191,10 @@ public:
 
   bool isVariable() const override;
 
+  bool isStateful() const override;
+
+  uint32_t usedVariables() const override;
+
   int eval(int x, int t) const override;
 
   double eval(double x, double t) const override;
@@ -140,7 +202,42 @@ public:
   void append(FormulaType type, String &s) const override;
 };
 
+// A builtin function, like sin8(x) or noise(x, t). These work on bytes, so double formulas round their arguments
+class FuncForm : public Form {
+private:
+  const Form *a, *b;
+
+public:
+  // Set by the controller before rendering, for hue(i), sat(i) and val(i)
+  static const PixelState *previousFrame;
+
+  FuncForm(FormulaOp op, const Form *a, const Form *b);
+
+  ~FuncForm() override;
+
+  bool isTimed() const override;
+
+  bool isVariable() const override;
+
+  bool isStateful() const override;
+
+  uint32_t usedVariables() const override;
+
+  int eval(int x, int t) const override;
+
+  double eval(double x, double t) const override;
+
+  void evalBatch(int x, int step, int count, int t, int *out) const override;
+
+  void append(FormulaType type, String &s) const override;
+
+  static int getArgCount(FormulaOp op);
+};
+
 Form *parseFormula(const char *formula);
 
+// How an operator or function is written in a formula, like "+" or "sin8"
+const char *getSymbol(FormulaOp op);
+
 
 #endif //LEDS_FORMULA_H
@@ -0,0 +1,231 @@
+#include "formula_check.h"
+
+#ifdef FORMULA_SELF_CHECK
+
+#include "led_controller.h"
+#include "memory_stats.h"
+#include "util.h"
+
+#define CHECK_LEDS 300
+#define CHECK_DEPTH 4
+
+// The same seed always gives the same formulas, so a difference can be reproduced
+static uint32_t nextRandom(uint32_t &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// Bars right next to each other can't be parsed, like in ||x| + 1|
+static void appendAbs(String &s, const String &inner) {
+  bool group = inner.startsWith("|") || inner.endsWith("|");
+  s += group ? "|(" : "|";
+  s += inner;
+  s += group ? ")|" : "|";
+}
+
+// Anything the parser accepts, except that divisors can't be 0 and powers are small, like in real formulas
+static void appendRandomFormula(String &s, FormulaType type, int depth, uint32_t &state) {
+  uint32_t r = nextRandom(state);
+
+  if (depth == 0 || r % 4 == 0) {
+    switch ((r >> 2) % 8) {
+      case 0: s += "x"; break;
+      case 1: s += "t"; break;
+      case 2: s += "N"; break;
+      case 3: s += (r & 64) ? "u" : "v"; break;
+      case 4: s += (r & 64) ? "a" : "b"; break;
+      default:
+        s += String((int) (r >> 8) % 300);
+        if (type == double_formula && (r & 128))
+          s += "." + String((int) (r >> 16) % 10);
+    }
+    return;
+  }
+
+  switch ((r >> 2) % 4) {
+    case 0: { // A function
+      auto op = (FormulaOp) (op_sin8 + (r >> 4) % (op_none - op_sin8));
+      s += getSymbol(op);
+      s += "(";
+      appendRandomFormula(s, type, depth - 1, state);
+      if (FuncForm::getArgCount(op) == 2) {
+        s += ", ";
+        appendRandomFormula(s, type, depth - 1, state);
+      }
+      s += ")";
+      break;
+    }
+    case 1: {
+      String inner;
+      appendRandomFormula(inner, type, depth - 1, state);
+      appendAbs(s, inner);
+      break;
+    }
+
+    default: { // An operator, not always between parentheses so precedence is checked too
+      auto op = (FormulaOp) (op_eq + (r >> 4) % (op_abs - op_eq));
+      bool group = r & 0x10000;
+      if (group)
+        s += "(";
+      appendRandomFormula(s, type, depth - 1, state);
+      s += " ";
+      s += getSymbol(op);
+      s += " ";
+      if (op == op_over || op == op_mod) {
+        String inner;
+        appendRandomFormula(inner, type, depth - 1, state);
+        s += "(";
+        appendAbs(s, inner);
+        s += " + 1)";
+      } else if (op == op_power) {
+        s += String((int) (r >> 20) % 4);
+      } else {
+        appendRandomFormula(s, type, depth - 1, state);
+      }
+      if (group)
+        s += ")";
+    }
+  }
+}
+
+enum CheckEngine {
+  engine_tree, engine_batch, engine_faded_batch, engine_reparsed, CHECK_ENGINES
+};
+
+static const char *engine_names[] = {"tree", "batch", "batch with fade 3", "reparsed from text"};
+
+// Fills out with the value of every led, like the renderer would
+static void evaluate(CheckEngine engine, const FormulaData &data, const FormulaData &reparsed, int t, int *out) {
+  switch (engine) {
+    case engine_tree:
+    case engine_reparsed:
+      for (int x = 0; x < CHECK_LEDS; ++x)
+        out[x] = (engine == engine_tree ? data : reparsed).eval(x, t);
+      break;
+
+    case engine_batch:
+      for (int x = 0; x < CHECK_LEDS; x += FORMULA_BATCH)
+        data.evalBatch(x, 1, min(FORMULA_BATCH, CHECK_LEDS - x), t, out + x);
+      break;
+
+    case engine_faded_batch: { // Every third led, in a different order than the others
+      int values[FORMULA_BATCH];
+      for (int first = 0; first < 3; ++first) {
+        for (int x = first; x < CHECK_LEDS; x += FORMULA_BATCH * 3) {
+          int count = min(FORMULA_BATCH, (CHECK_LEDS - x + 2) / 3);
+          data.evalBatch(x, 3, count, t, values);
+          for (int i = 0; i < count; ++i)
+            out[x + i * 3] = values[i];
+        }
+      }
+      break;
+    }
+
+    default:
+      break;
+  }
+}
+
+int checkFormulas(int count, uint32_t seed) {
+  static const int times[] = {0, 1, 37, 1000, 65535, 1 << 20};
+
+  // The formulas get to see the same things they would on a strip
+  const uint16_t *saved_coordinates[2] = {VarForm::coordinates[0], VarForm::coordinates[1]};
+  const PixelState *saved_frame = FuncForm::previousFrame;
+  int saved_count = VarForm::ledCount;
+
+  uint32_t state = seed == 0 ? 1 : seed;
+  auto *coordinates = new uint16_t[CHECK_LEDS * 2];
+  auto *frame = new PixelState[CHECK_LEDS];
+  for (int i = 0; i < CHECK_LEDS; ++i) {
+    coordinates[i] = i % 16;
+    coordinates[CHECK_LEDS + i] = i / 16;
+    uint32_t r = nextRandom(state);
+    frame[i] = PixelState{(uint8_t) r, (uint8_t) (r >> 8), (uint8_t) (r >> 16)};
+  }
+  VarForm::ledCount = CHECK_LEDS;
+  VarForm::coordinates[0] = coordinates;
+  VarForm::coordinates[1] = coordinates + CHECK_LEDS;
+  FuncForm::previousFrame = frame;
+  VarForm::setVariable('a', 77, 77.5);
+  VarForm::setVariable('b', -3, 0.25);
+
+  auto *reference = new int[CHECK_LEDS], *values = new int[CHECK_LEDS];
+  unsigned long engine_us[CHECK_ENGINES] = {};
+  int failures = 0;
+  uint32_t formula_bytes = getMemoryReport().used[memory_formula_trees];
+
+  for (int i = 0; i < count; ++i) {
+    FormulaData data, reparsed;
+    data.type = reparsed.type = (nextRandom(state) & 3) == 0 ? double_formula : int_formula;
+
+    String text;
+    appendRandomFormula(text, data.type, CHECK_DEPTH, state);
+    data.form.reset(parseFormula(text.c_str()));
+    if (data.form == nullptr) {
+      Serial.printf("Formula check: couldn't parse %s\n", text.c_str());
+      ++failures;
+      continue;
+    }
+    reparsed.form.reset(parseFormula(data.form->toString(data.type).c_str()));
+    if (reparsed.form == nullptr) {
+      Serial.printf("Formula check: couldn't parse %s, the text of %s\n", data.form->toString(data.type).c_str(),
+                    text.c_str());
+      ++failures;
+      continue;
+    }
+
+    bool differs = false;
+    for (int t : times) {
+      for (int engine = engine_tree; engine < CHECK_ENGINES; ++engine) {
+        unsigned long start = micros();
+        evaluate((CheckEngine) engine, data, reparsed, t, engine == engine_tree ? reference : values);
+        engine_us[engine] += micros() - start;
+
+        // Only the bytes matter: hues wrap around, sat and val are clamped
+        for (int x = 0; engine != engine_tree && x < CHECK_LEDS && !differs; ++x) {
+          if ((values[x] & 0xFF) != (reference[x] & 0xFF) || clampByte(values[x]) != clampByte(reference[x])) {
+            Serial.printf("Formula check: %s gives %i instead of %i for %s (%s) at x = %i, t = %i\n",
+                          engine_names[engine], values[x], reference[x], text.c_str(),
+                          data.type == int_formula ? "int" : "double", x, t);
+            differs = true;
+          }
+        }
+      }
+    }
+    if (differs)
+      ++failures;
+  }
+
+  Serial.printf("Formula check with seed %u: %i of %i formulas differ\n", (unsigned) seed, failures, count);
+  for (int engine = engine_tree; engine < CHECK_ENGINES; ++engine) {
+    unsigned long evaluations = (unsigned long) count * (sizeof(times) / sizeof(times[0])) * CHECK_LEDS;
+    Serial.printf("  %s: %lu leds/ms\n", engine_names[engine], evaluations * 1000 / max(engine_us[engine], 1ul));
+  }
+
+  // Every formula was freed again, so whatever is still counted leaked
+  MemoryReport memory = getMemoryReport();
+  if (memory.used[memory_formula_trees] != formula_bytes) {
+    Serial.printf("Formula check: %i bytes of formula trees weren't freed\n",
+                  (int) (memory.used[memory_formula_trees] - formula_bytes));
+    ++failures;
+  }
+  Serial.printf("  formula trees: %u bytes at most, heap: %u bytes free, %u in the largest block\n",
+                (unsigned) memory.peak[memory_formula_trees], (unsigned) memory.free_heap,
+                (unsigned) memory.largest_block);
+
+  delete[] reference;
+  delete[] values;
+  delete[] coordinates;
+  delete[] frame;
+  VarForm::ledCount = saved_count;
+  VarForm::coordinates[0] = saved_coordinates[0];
+  VarForm::coordinates[1] = saved_coordinates[1];
+  FuncForm::previousFrame = saved_frame;
+
+  return failures;
+}
+
+#endif
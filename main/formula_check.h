@@ -0,0 +1,16 @@
+#ifndef LEDS_FORMULA_CHECK_H
+#define LEDS_FORMULA_CHECK_H
+
+#include "includes.h"
+
+#ifdef FORMULA_SELF_CHECK
+
+#include <cstdint>
+
+// Evaluates count random formulas with every engine, and compares the bytes they produce to the ones the formula
+// tree produces. Prints the differences and how fast every engine is, and returns the number of formulas that differ
+int checkFormulas(int count, uint32_t seed);
+
+#endif
+
+#endif //LEDS_FORMULA_CHECK_H
@@ -0,0 +1,60 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#include "includes.h"
+
+#include "frame_scheduler.h"
+#include "power_manager.h"
+
+#define TICK_DURATION_US ((int64_t) TICK_DURATION * 1000)
+
+FrameScheduler::FrameScheduler(FramePolicy policy, FrameLock *frame_lock) : policy(policy), frame_lock(frame_lock) {}
+
+void FrameScheduler::start() {
+  start_us = esp_timer_get_time();
+  deadline_us = start_us + TICK_DURATION_US;
+  frame = 0;
+}
+
+int FrameScheduler::getTick() const {
+  return (int) (frame & 0x7FFFFFFF);
+}
+
+void FrameScheduler::wait() {
+  int64_t now = esp_timer_get_time();
+
+  // The frame started at the previous deadline
+  int64_t busy = min((now - deadline_us + TICK_DURATION_US) * 100 / TICK_DURATION_US, (int64_t) 255);
+  load += ((int) busy * 16 - load) / 8;
+
+  if (now < deadline_us) {
+    if (frame_lock != nullptr)
+      frame_lock->release();
+    delay((deadline_us - now + 999) / 1000);
+    if (frame_lock != nullptr)
+      frame_lock->acquire();
+  } else {
+    // Number of deadlines that passed entirely while this frame was being prepared
+    int64_t behind = (now - deadline_us) / TICK_DURATION_US;
+
+    // Catching up means the next frames are rendered without waiting, but there's no point in doing that for too long
+    if (behind > 0 && (policy == frame_drop || behind > FRAME_MAX_CATCH_UP)) {
+      debugf("Dropping %lli frames\n", behind);
+
+      frame += behind;
+      deadline_us += behind * TICK_DURATION_US;
+      dropped += behind;
+    }
+  }
+
+  ++frame;
+  deadline_us += TICK_DURATION_US;
+}
+
+unsigned long FrameScheduler::getDroppedFrames() const {
+  return dropped;
+}
+
+int FrameScheduler::getLoad() const {
+  return load / 16;
+}
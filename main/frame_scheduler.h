@@ -0,0 +1,42 @@
+#ifndef LEDS_FRAME_SCHEDULER_H
+#define LEDS_FRAME_SCHEDULER_H
+
+#include <cstdint>
+
+class FrameLock;
+
+enum FramePolicy {
+  frame_drop, frame_catch_up
+};
+
+// Schedules frames against absolute deadlines, so the tick never drifts from the time since start()
+class FrameScheduler {
+private:
+  const FramePolicy policy;
+  FrameLock *const frame_lock;
+
+  int64_t start_us = 0, deadline_us = 0;
+  int64_t frame = 0;
+  unsigned long dropped = 0;
+  int load = 0; // In 1/16th of a percent, averaged over the last few frames
+
+public:
+  // The frame lock, if there is one, is released while waiting for the deadline
+  explicit FrameScheduler(FramePolicy policy, FrameLock *frame_lock = nullptr);
+
+  void start();
+
+  // The tick of the frame that is currently being prepared
+  int getTick() const;
+
+  // Sleeps until the deadline of the current frame, and moves on to the next one. This is the only time the frame
+  // lock is released while the controller is awake
+  void wait();
+
+  unsigned long getDroppedFrames() const;
+
+  // Percentage of the tick spent preparing a frame, more than 100 if frames take longer than a tick
+  int getLoad() const;
+};
+
+#endif //LEDS_FRAME_SCHEDULER_H
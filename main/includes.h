@@ -17,9 +17,8 @@
   #define debugln(str);
 #endif
 
-#define NUM_LEDS 600
+// The default strip layout, clients can change it afterwards (see led_layout.h)
 const int led_count[] = {300, 300};
-//#define NUM_LEDS 240
 //const int led_count[] = {120, 120};
 const int led_strips = 2;
 
@@ -29,8 +28,28 @@ const int led_strips = 2;
 #define STRIP_1_PIN 12
 #define STRIP_2_PIN 13
 
+const int led_pins[] = {STRIP_1_PIN, STRIP_2_PIN};
+// The first strip runs in the opposite direction of the second one
+const bool led_reversed[] = {true, false};
+
 #define TICK_DURATION 50
 
+// What to do when a tick takes too long: frame_drop skips the ticks that were missed,
+// frame_catch_up renders them back to back (but drops them after falling FRAME_MAX_CATCH_UP ticks behind)
+#define FRAME_POLICY frame_drop
+#define FRAME_MAX_CATCH_UP 5
+
+// Applied to the leds right before they're shown, along with brightness and dithering
+#define OUTPUT_GAMMA 2.2
+#define OUTPUT_CORRECTION TypicalLEDStrip
+
+// Uncomment to check the ways formulas are evaluated against each other on this many random formulas at startup,
+// see formula_check.cpp
+//#define FORMULA_SELF_CHECK 200
+
+// During a transition the outgoing formulas are evaluated for every TRANSITION_FADE * fade leds
+#define TRANSITION_FADE 4
+
 // Uncomment this line if you want to use Bluetooth connectivity rather than Wifi
 //#define USE_BLUETOOTH
 
@@ -38,6 +57,16 @@ const int led_strips = 2;
 #define WIFI_PASS "Blahblahblah"
 #define WIFI_PORT 55420
 #define WIFI_MDNS_NAME "central-led"
+// Update packets sent to this address reach every controller in the groups they're addressed to
+#define WIFI_MULTICAST_IP IPAddress(239, 255, 76, 68)
+// Multicast update packets and broadcast discovery packets are received on this port
+#define WIFI_MULTICAST_PORT 55421
+// Controllers answer discovery after a random delay of up to this many milliseconds, so the replies don't all
+// arrive at the same time
+#define DISCOVERY_BACKOFF 200
+
+// Sent to clients that discover the controller, increase it when the protocol changes
+#define FIRMWARE_VERSION 1
 
 // Comment the following line if you want to use DHCP.
 // For some reason it kept giving IP 255.255.255.255 (found similar issues online)
@@ -48,7 +77,17 @@ const int led_strips = 2;
 #define WIFI_STATIC_GATEWAY IPAddress(192, 168, 1, 1)
 #define WIFI_STATIC_MASK IPAddress(255, 255, 255, 0)
 
+// Bytes reserved for the saved config
+#define CONFIG_SIZE 2048
+
+// Number of presets that can be stored, and the bytes reserved for storing them
+#define PRESET_SLOTS 8
+#define PRESETS_SIZE 4096
+
 #define INACTIVE_DELAY (10 * 1000)
+// While asleep, the loop waits up to this long for a packet before checking on the link again. Wi-Fi packets wake it
+// up as soon as they arrive (after up to a few hundred milliseconds of modem sleep), but the Bluetooth server can't
+// wake it, so for Bluetooth this is the upper bound on how long a command takes to be handled while asleep
 #define INACTIVE_PACKET_READ_INTERVAL 3000
 #define POST_CHANGE_SAVE_DELAY 5000
 #define KEEP_ALIVE_INTERVAL (5 * 60 * 1000)
@@ -1,48 +1,290 @@
+#include <algorithm>
 
 #include "EEPROM.h"
 
 #include "util.h"
+#include "memory_stats.h"
 
 #include "led_controller.h"
 
+static EEPROMClass presetStorage("presets");
+static EEPROMClass coordinateStorage("coordinates");
+
+static const char *const DEFAULT_FORMULAS[3] = {"x+t", "255", "255"};
+
+// A buffer with an entry per led, counted in the memory stats. They're never freed, since the number of leds only
+// changes with a restart
+template<typename T>
+static T *newPixelBuffer(int count) {
+  trackMemory(memory_pixels, count * sizeof(T));
+  return new T[count]();
+}
+
+bool parseFormulaData(FormulaType type, const char *str, FormulaData &data) {
+  Form *form = parseFormula(str);
+  if (form == nullptr)
+    return false;
+
+  data.type = type;
+  data.form = std::shared_ptr<const Form>(form);
+  data.text = form->toString(type);
+  data.isVariable = form->isVariable();
+  data.isTimed = form->isTimed();
+  data.isStateful = form->isStateful();
+  data.variables = form->usedVariables();
+
+  return true;
+}
+
+static bool areDefinedIn(const FormulaSet *set, uint32_t variables) {
+  return (variables & ~(set == nullptr ? 0 : set->definedVariables(set->variable_count))) == 0;
+}
+
+// Whether setting the variable to formula, or removing it if formula has no form, keeps every variable in set after
+// the ones it uses: they're evaluated and saved in that order. queued are variables that are about to be added after
+// the ones in set
+static bool keepsOrder(const FormulaSet *set, char name, const FormulaData &formula, uint32_t queued) {
+  int count = set == nullptr ? 0 : set->variable_count, index = 0;
+  while (index < count && set->variables[index].name != name)
+    ++index;
+
+  uint32_t bit = 1 << (name - 'a');
+  if (formula.form == nullptr) // Nothing can use it anymore
+    return index == count || (set->usedVariables(index + 1) & bit) == 0;
+
+  uint32_t defined = set == nullptr ? 0 : set->definedVariables(index);
+  if (index == count) // A new one, which goes at the end
+    defined |= queued & ~bit;
+  return (formula.variables & ~defined) == 0;
+}
+
+// Sorts the zones, and checks that they fit in a set and don't overlap
+static bool arrangeZones(std::vector<Zone> &zones) {
+  if (zones.size() > MAX_ZONES)
+    return false;
+
+  std::sort(zones.begin(), zones.end(), [](const Zone &a, const Zone &b) { return a.start < b.start; });
+  for (size_t i = 0; i < zones.size(); ++i) {
+    if (zones[i].count == 0 || zones[i].fade == 0 || (i > 0 && zones[i].start < zones[i - 1].start + zones[i - 1].count))
+      return false;
+  }
+  return true;
+}
+
+// Bytes a formula takes in the config and in presets: its type and its text, 0-terminated
+static int storedSize(const FormulaData &data) {
+  return 2 + (int) data.toString().length();
+}
+
+static int storedSize(const Variable &variable) {
+  return 1 + storedSize(variable.formula);
+}
+
+static int storedSize(const Zone &zone) {
+  int size = 6;
+  for (const FormulaData &data : zone.formulas)
+    size += storedSize(data);
+  return size;
+}
+
+// Of the formulas, variables and zones, nothing if there's no set yet
+static int storedSize(const FormulaSet *set) {
+  if (set == nullptr)
+    return 0;
+
+  int size = 0;
+  for (const FormulaData &data : set->formulas)
+    size += storedSize(data);
+  for (int i = 0; i < set->variable_count; ++i)
+    size += storedSize(set->variables[i]);
+  for (int i = 0; i < set->zone_count; ++i)
+    size += storedSize(set->zones[i]);
+  return size;
+}
+
+// Bytes a preset takes in the presets after the byte that says its slot is used
+static int storedSize(const String &name, const FormulaSet *set) {
+  return (int) name.length() + 1 + 5 + 2 + storedSize(set); // With the counts of variables and zones
+}
+
+// Zones are stored the same way in the config and in presets
+static void writeZones(EEPROMClass &storage, int &addr, const FormulaSet &set) {
+  storage.write(addr++, set.zone_count);
+  for (int i = 0; i < set.zone_count; ++i) {
+    const Zone &zone = set.zones[i];
+    for (uint16_t value : {zone.start, zone.count, zone.fade}) {
+      storage.write(addr++, value >> 8);
+      storage.write(addr++, value & 0xFF);
+    }
+    for (const FormulaData &data : zone.formulas) {
+      String s = data.toString();
+      storage.write(addr++, data.type);
+      storage.writeString(addr, s);
+      addr += (int) s.length() + 1;
+    }
+  }
+}
+
+static bool readZones(EEPROMClass &storage, int &addr, std::vector<Zone> &zones) {
+  int count = storage.read(addr++);
+  if (count > MAX_ZONES) // Saved before zones existed
+    return false;
+
+  bool valid = true;
+  zones.resize(count);
+  for (Zone &zone : zones) {
+    for (uint16_t *value : {&zone.start, &zone.count, &zone.fade}) {
+      *value = storage.read(addr++) << 8;
+      *value |= storage.read(addr++);
+    }
+    for (FormulaData &data : zone.formulas) {
+      auto type = (FormulaType) storage.read(addr++);
+      String s = storage.readString(addr);
+      addr += (int) s.length() + 1;
+      valid &= parseFormulaData(type, s.c_str(), data);
+    }
+    zone.updateFlags();
+  }
+  return valid && arrangeZones(zones);
+}
+
+// Dividing by steps, or shifting by steps_shift if steps is a power of two
+template<bool shift>
+static inline uint8_t divide(int value, int steps, int steps_shift) {
+  return shift ? value >> steps_shift : value / steps;
+}
+
+// Linear blend of two colors, step ranging from 0 (all from) to steps (all to)
+template<bool shift = false>
+static inline CRGB interpolate(const CRGB &from, const CRGB &to, int step, int steps, int steps_shift = 0) {
+  return CRGB(
+          divide<shift>((steps - step) * from.r + step * to.r, steps, steps_shift),
+          divide<shift>((steps - step) * from.g + step * to.g, steps, steps_shift),
+          divide<shift>((steps - step) * from.b + step * to.b, steps, steps_shift)
+  );
+}
+
+// Same, for the h/s/v values that are kept for the next frame
+template<bool shift>
+static inline PixelState interpolate(const PixelState &from, const PixelState &to, int step, int steps, int steps_shift) {
+  return PixelState{
+          divide<shift>((steps - step) * from.h + step * to.h, steps, steps_shift),
+          divide<shift>((steps - step) * from.s + step * to.s, steps, steps_shift),
+          divide<shift>((steps - step) * from.v + step * to.v, steps, steps_shift)
+  };
+}
 
 void LedController::loadConfig() {
   debugln("Loading config");
 
   char header[10];
   EEPROM.readBytes(0, header, 10);
-  if (memcmp(header, "CentralLED", 10) == 0) {
+  bool saved = memcmp(header, "CentralLED", 10) == 0;
+  if (saved) {
     int addr = 10;
 
-    device_name = EEPROM.readString(addr);
-    addr += (int) device_name.length() + 1;
+    String name = EEPROM.readString(addr);
+    addr += (int) name.length() + 1;
+    setDeviceName(name);
 
     bright = EEPROM.read(addr++);
-    fade = EEPROM.read(addr++) << 8;
-    fade |= EEPROM.read(addr++);
+    int value = EEPROM.read(addr++) << 8;
+    fade = value | EEPROM.read(addr++);
 
+    // Set after the variables, which they can use
+    FormulaType formula_types[3];
+    String formula_texts[3];
     for (int form_index = 0; form_index < 3; ++form_index) {
+      formula_types[form_index] = (FormulaType) EEPROM.read(addr++);
+      formula_texts[form_index] = EEPROM.readString(addr);
+      addr += (int) formula_texts[form_index].length() + 1;
+    }
+
+    // Configs saved before keyframes existed have a 0 here
+    keyframe_interval = max(1, (int) EEPROM.read(addr++));
+
+    // Same for the layout, which then isn't valid and stays the default
+    uint8_t buffer[LAYOUT_SIZE];
+    const uint8_t *packet = buffer;
+    LedLayout saved_layout;
+    EEPROM.readBytes(addr, buffer, LAYOUT_SIZE);
+    addr += LAYOUT_SIZE;
+    if (saved_layout.read(packet))
+      setLayout(saved_layout);
+
+    setPaletteMode(EEPROM.read(addr++));
+    if (EEPROM.read(addr++)) {
+      Palette saved_palette;
+      EEPROM.readBytes(addr, saved_palette.colors, sizeof(saved_palette.colors));
+      addr += sizeof(saved_palette.colors);
+      setPalette(saved_palette);
+    }
+
+    int duration = EEPROM.read(addr++) << 8;
+    setTransitionDuration(duration | EEPROM.read(addr++));
+
+    int variable_count = min((int) EEPROM.read(addr++), MAX_VARIABLES);
+    for (int i = 0; i < variable_count; ++i) {
+      char name = (char) EEPROM.read(addr++);
       auto type = (FormulaType) EEPROM.read(addr++);
       String s = EEPROM.readString(addr);
       addr += (int) s.length() + 1;
-      setFormula(form_index, type, s.c_str());
+      setVariable(name, type, s.c_str());
     }
+    // One that doesn't load anymore (a variable it uses didn't) is replaced, the leds need all three
+    for (int form_index = 0; form_index < 3; ++form_index) {
+      if (!setFormula(form_index, formula_types[form_index], formula_texts[form_index].c_str()))
+        setFormula(form_index, int_formula, DEFAULT_FORMULAS[form_index]);
+    }
+
+    // The coordinates themselves are calculated or loaded once the leds are known
+    matrix_width = EEPROM.read(addr++);
+    matrix_serpentine = EEPROM.read(addr++);
+    coordinate_map = EEPROM.read(addr++);
+
+    uint32_t saved_groups = 0;
+    for (int i = 0; i < 4; ++i)
+      saved_groups = saved_groups << 8 | EEPROM.read(addr++);
+    groups = saved_groups;
+
+    std::vector<Zone> saved_zones;
+    if (readZones(EEPROM, addr, saved_zones))
+      setZones(saved_zones);
   } else {
-    device_name = "Light";
+    setDeviceName("Light");
     bright = 4;
     fade = 1;
-    setFormula(0, int_formula, "x+t");
-    setFormula(1, int_formula, "255");
-    setFormula(2, int_formula, "255");
+    keyframe_interval = 1;
+    for (int form_index = 0; form_index < 3; ++form_index)
+      setFormula(form_index, int_formula, DEFAULT_FORMULAS[form_index]);
+  }
+  applyCommands(0);
+  // Saved before layouts existed, or not valid. Checked once the saved one was applied, since setLayout() only
+  // queues it
+  if (layout == nullptr) {
+    setLayout(LedLayout());
+    applyCommands(0);
+  }
+  changed = layout_changed = false;
 
-    saveConfig();
+  loadPresets();
+
+  if (palette == nullptr) { // Until a client uploads one, palette mode looks the same as using hues
+    auto rainbow = std::make_shared<Palette>();
+    for (int i = 0; i < 256; ++i)
+      rainbow->colors[i] = CHSV(i, 255, 255);
+    palette = rainbow;
   }
-  debugf("Name: %s\n", device_name.c_str());
-  debugf("Bright: %i\n", bright);
 
-  debugln(formulas[0].toString());
-  debugln(formulas[1].toString());
-  debugln(formulas[2].toString());
+  if (!saved)
+    saveConfig();
+
+  debugf("Name: %s\n", device_name->c_str());
+  debugf("Bright: %i\n", (int) bright);
+
+  debugln(formulas->formulas[0].toString());
+  debugln(formulas->formulas[1].toString());
+  debugln(formulas->formulas[2].toString());
 }
 
 void LedController::saveConfig() {
@@ -50,117 +292,889 @@ void LedController::saveConfig() {
 
   EEPROM.writeBytes(0, "CentralLED", 10);
   int addr = 10;
-  EEPROM.writeString(addr, device_name);
-  addr += (int) device_name.length() + 1;
+  EEPROM.writeString(addr, *device_name);
+  addr += (int) device_name->length() + 1;
   EEPROM.write(addr++, bright);
   EEPROM.write(addr++, fade >> 8);
   EEPROM.write(addr++, fade & 0xFF);
-  for (FormulaData &data : formulas) {
-    String s = data.form->toString(data.type);
+  for (const FormulaData &data : formulas->formulas) {
+    String s = data.toString();
     EEPROM.write(addr++, data.type);
     EEPROM.writeString(addr, s);
     addr += (int) s.length() + 1;
   }
+  EEPROM.write(addr++, keyframe_interval);
 
+  uint8_t buffer[LAYOUT_SIZE] = {};
+  unsigned int length = 0;
+  layout->write(buffer, length);
+  EEPROM.writeBytes(addr, buffer, LAYOUT_SIZE);
+  addr += LAYOUT_SIZE;
+
+  EEPROM.write(addr++, palette_mode);
+  EEPROM.write(addr++, palette_saved);
+  if (palette_saved) {
+    EEPROM.writeBytes(addr, palette->colors, sizeof(palette->colors));
+    addr += sizeof(palette->colors);
+  }
+
+  EEPROM.write(addr++, transition_duration >> 8);
+  EEPROM.write(addr++, transition_duration & 0xFF);
+
+  EEPROM.write(addr++, formulas->variable_count);
+  for (int i = 0; i < formulas->variable_count; ++i) {
+    const Variable &variable = formulas->variables[i];
+    String s = variable.formula.toString();
+    EEPROM.write(addr++, variable.name);
+    EEPROM.write(addr++, variable.formula.type);
+    EEPROM.writeString(addr, s);
+    addr += (int) s.length() + 1;
+  }
+
+  EEPROM.write(addr++, matrix_width);
+  EEPROM.write(addr++, matrix_serpentine);
+  EEPROM.write(addr++, coordinate_map);
+
+  for (int shift = 24; shift >= 0; shift -= 8)
+    EEPROM.write(addr++, (groups >> shift) & 0xFF);
+
+  writeZones(EEPROM, addr, *formulas);
+
+  // Changes that would make it bigger are rejected, see configSize(). The coordinate map is only written with a
+  // config that says it's there, so it's left for the next save otherwise
+  if (addr > CONFIG_SIZE) {
+    Serial.println("Config doesn't fit in CONFIG_SIZE");
+    return;
+  }
   EEPROM.commit();
+
+  if (coordinates_changed) {
+    coordinates_changed = false;
+    for (int led = 0; led < num_leds; ++led) {
+      coordinateStorage.write(led * 2, coordinates[0][led]);
+      coordinateStorage.write(led * 2 + 1, coordinates[1][led]);
+    }
+    coordinateStorage.commit();
+  }
+}
+
+int LedController::configSize() const {
+  // The header, name, brightness and fade, keyframe interval, layout, palette, transition duration, variable count,
+  // matrix, coordinate map, groups and zone count, and then the formulas
+  int size = 10 + (device_name != nullptr ? (int) device_name->length() : 0) + 1 + 3 + 1 + LAYOUT_SIZE + 2 +
+             (palette_saved ? (int) sizeof(Palette) : 0) + 2 + 1 + 3 + 4 + 1;
+  return size + storedSize(pendingFormulas());
+}
+
+bool LedController::fitsConfig(int added) const {
+  return added <= 0 || configSize() + added <= CONFIG_SIZE;
 }
 
+bool LedController::presetFits(int slot, const String &name) const {
+  ++readers;
+  int size = 7 + PRESET_SLOTS + storedSize(name, published_formulas.load());
+  for (int i = 0; i < PRESET_SLOTS; ++i) {
+    const Preset *preset = published_presets[i].load();
+    if (i != slot && preset != nullptr)
+      size += storedSize(preset->name, preset->formulas.get());
+  }
+  --readers;
+
+  return size <= PRESETS_SIZE;
+}
+
+void LedController::loadPresets() {
+  presetStorage.begin(PRESETS_SIZE);
+
+  char header[7];
+  presetStorage.readBytes(0, header, 7);
+  if (memcmp(header, "Presets", 7) != 0)
+    return;
+
+  // Formulas are parsed now, so switching to a preset later only swaps pointers
+  int addr = 7;
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot) {
+    if (!presetStorage.read(addr++))
+      continue;
+
+    auto preset = std::make_shared<Preset>();
+    auto set = std::make_shared<FormulaSet>();
+
+    preset->name = presetStorage.readString(addr);
+    addr += (int) preset->name.length() + 1;
+    preset->bright = presetStorage.read(addr++);
+    preset->fade = presetStorage.read(addr++) << 8;
+    preset->fade |= presetStorage.read(addr++);
+    preset->keyframe_interval = presetStorage.read(addr++);
+    preset->palette_mode = presetStorage.read(addr++);
+
+    bool valid = true;
+    for (FormulaData &data : set->formulas) {
+      auto type = (FormulaType) presetStorage.read(addr++);
+      String str = presetStorage.readString(addr);
+      addr += (int) str.length() + 1;
+      valid &= parseFormulaData(type, str.c_str(), data);
+    }
+    set->variable_count = min((int) presetStorage.read(addr++), MAX_VARIABLES);
+    for (int i = 0; i < set->variable_count; ++i) {
+      Variable &variable = set->variables[i];
+      variable.name = (char) presetStorage.read(addr++);
+      auto type = (FormulaType) presetStorage.read(addr++);
+      String str = presetStorage.readString(addr);
+      addr += (int) str.length() + 1;
+      valid &= parseFormulaData(type, str.c_str(), variable.formula);
+    }
+    std::vector<Zone> zones;
+    valid &= readZones(presetStorage, addr, zones);
+    std::copy(zones.begin(), zones.end(), set->zones);
+    set->zone_count = (int) zones.size();
+    set->updateFlags();
+    preset->formulas = set;
+
+    if (valid) {
+      presets[slot] = preset;
+      published_presets[slot] = preset.get();
+    }
+  }
+}
+
+void LedController::savePresets() {
+  debugln("Saving presets");
+
+  presetStorage.writeBytes(0, "Presets", 7);
+  int addr = 7;
+  for (const std::shared_ptr<const Preset> &preset : presets) {
+    presetStorage.write(addr++, preset != nullptr);
+    if (preset == nullptr)
+      continue;
+
+    presetStorage.writeString(addr, preset->name);
+    addr += (int) preset->name.length() + 1;
+    presetStorage.write(addr++, preset->bright);
+    presetStorage.write(addr++, preset->fade >> 8);
+    presetStorage.write(addr++, preset->fade & 0xFF);
+    presetStorage.write(addr++, preset->keyframe_interval);
+    presetStorage.write(addr++, preset->palette_mode);
+    for (const FormulaData &data : preset->formulas->formulas) {
+      String str = data.toString();
+      presetStorage.write(addr++, data.type);
+      presetStorage.writeString(addr, str);
+      addr += (int) str.length() + 1;
+    }
+    presetStorage.write(addr++, preset->formulas->variable_count);
+    for (int i = 0; i < preset->formulas->variable_count; ++i) {
+      const Variable &variable = preset->formulas->variables[i];
+      String str = variable.formula.toString();
+      presetStorage.write(addr++, variable.name);
+      presetStorage.write(addr++, variable.formula.type);
+      presetStorage.writeString(addr, str);
+      addr += (int) str.length() + 1;
+    }
+    writeZones(presetStorage, addr, *preset->formulas);
+  }
+
+  // A preset that would make them bigger isn't saved, see presetFits()
+  if (addr > PRESETS_SIZE)
+    Serial.println("Presets don't fit in PRESETS_SIZE");
+  else
+    presetStorage.commit();
+}
 
 void LedController::init() {
   tick = 0;
+  render_task = xTaskGetCurrentTaskHandle();
 
-  for (auto &led : leds)
-    led = 0;
+  num_leds = layout->getLedCount();
+  leds = newPixelBuffer<CRGB>(num_leds);
+  output = newPixelBuffer<CRGB>(num_leds);
+  led_map = layout->createMap();
+  trackMemory(memory_pixels, num_leds * sizeof(uint16_t));
+  VarForm::ledCount = num_leds;
 
-  FastLED.addLeds<LED_TYPE, STRIP_1_PIN, COLOR_ORDER>(leds, led_count[0]).setCorrection(TypicalLEDStrip);
-  FastLED.addLeds<LED_TYPE, STRIP_2_PIN, COLOR_ORDER>(leds, led_count[0], led_count[1]).setCorrection(TypicalLEDStrip);
+  coordinates[0] = newPixelBuffer<uint16_t>(num_leds);
+  coordinates[1] = newPixelBuffer<uint16_t>(num_leds);
+  VarForm::coordinates[0] = coordinates[0];
+  VarForm::coordinates[1] = coordinates[1];
+  coordinateStorage.begin(MAX_LEDS * 2);
+  if (coordinate_map) {
+    for (int led = 0; led < num_leds; ++led) {
+      coordinates[0][led] = coordinateStorage.read(led * 2);
+      coordinates[1][led] = coordinateStorage.read(led * 2 + 1);
+    }
+  } else {
+    updateCoordinates();
+  }
+
+  layout->addLeds(output);
 
   delay(50);
 
   update();
 
   printf("Led is %i %i %i\n", leds[0].r, leds[0].g, leds[0].b);
-  printf("Brightness is %i\n", bright);
+  printf("Brightness is %i\n", (int) bright);
+
+  // Brightness and dithering are part of the output stage
+  FastLED.setBrightness(255);
+  FastLED.setDither(DISABLE_DITHER);
 
-  FastLED.setBrightness(bright);
+  for (int i = 0; i < 256; ++i)
+    gamma_table[i] = (uint16_t) lround(pow(i / 255.0, OUTPUT_GAMMA) * 255 * 256);
+  applyBrightness(bright);
+
+  writeOutput();
   FastLED.show();
 }
 
-void LedController::update() {
-  CRGB c{}, p = CRGB(0, 0, 0);
+// Applies gamma, color correction, brightness and dithering in one pass, instead of FastLED scaling every led in show().
+// Values that fall between two output levels alternate between them over the frames.
+void LedController::writeOutput() {
+  static const uint8_t dither[8] = {0, 128, 64, 192, 32, 160, 96, 224};
+
+  ++output_frame;
+  for (int led = 0; led < num_leds; ++led) {
+    const CRGB &color = leds[led];
+    uint8_t offset = dither[(output_frame + led) & 7]; // Neighbours don't flicker in sync
+    output[led] = CRGB(
+            (output_table[0][color.r] + offset) >> 8,
+            (output_table[1][color.g] + offset) >> 8,
+            (output_table[2][color.b] + offset) >> 8
+    );
+  }
+}
+
+// Calculated once, so formulas using u and v are as fast as formulas using x
+void LedController::updateCoordinates() {
+  int width = matrix_width;
+  for (int led = 0; led < num_leds; ++led) {
+    int row = width == 0 ? 0 : led / width, column = width == 0 ? led : led % width;
+    if (matrix_serpentine && row % 2 == 1)
+      column = width - 1 - column;
+
+    coordinates[0][led] = column;
+    coordinates[1][led] = row;
+  }
+}
+
+void LedController::render(CRGB *target, int t, bool all) {
+  int fade = this->fade;
+  // Once the transition is over, the leds still contain a blend
+  renderSet(target, t, *formulas, fade, all || transition_from != nullptr);
+
+  if (transition_from == nullptr)
+    return;
+
+  int elapsed = (t - transition_start) & 0x7FFFFFFF, duration = transition_duration;
+  if (elapsed > 0x3FFFFFFF) // A keyframe from before the transition started
+    elapsed = 0;
+  if (elapsed >= duration) {
+    transition_from = nullptr; // Still retired if another task could be reading it
+    return;
+  }
+
+  if (transition_leds == nullptr)
+    transition_leds = newPixelBuffer<CRGB>(num_leds);
+
+  // The outgoing formulas are evaluated for fewer leds, so rendering both still fits in a tick
+  renderSet(transition_leds, t, *transition_from, fade * TRANSITION_FADE, true);
+  for (int led = 0; led < num_leds; ++led)
+    target[led] = interpolate(transition_leds[led], target[led], elapsed, duration);
+}
+
+void LedController::renderSet(CRGB *target, int t, const FormulaSet &set, int fade, bool all) {
+  // Formulas read the previous frame from one buffer while this frame is written to the other one,
+  // the outgoing formulas of a transition only read it
+  PixelState *state = nullptr;
+  if (set.stateful) {
+    if (frame_state[0] == nullptr) {
+      frame_state[0] = newPixelBuffer<PixelState>(num_leds);
+      frame_state[1] = newPixelBuffer<PixelState>(num_leds);
+    }
+    FuncForm::previousFrame = frame_state[0];
+    if (&set == formulas.get())
+      state = frame_state[1];
+  }
+
+  set.evalVariables(t);
+
+  const RenderKernel *set_kernels = &set == formulas.get() ? kernels : transition_kernels;
+  int transition_fade = &set == formulas.get() ? 1 : TRANSITION_FADE;
 
-  static uint8_t h, s, v;
-  if (!variableFormulas) {
-    h = formulas[0].eval(0, tick) & 0xFF; // hue % 256
-    s = clampByte(formulas[1].eval(0, tick));
-    v = clampByte(formulas[2].eval(0, tick));
+  // The main formulas are rendered in between the zones
+  for (int zone_index = 0, led = 0; zone_index <= set.zone_count; ++zone_index) {
+    int start = zone_index == set.zone_count ? num_leds : min((int) set.zones[zone_index].start, num_leds);
+    if (start > led)
+      renderRange(target, t, set.formulas, fade, set_kernels[0], set.main_timed, state, led, start, all);
+    if (zone_index == set.zone_count)
+      break;
+
+    const Zone &zone = set.zones[zone_index];
+    led = min(start + zone.count, num_leds);
+    renderRange(target, t, zone.formulas, zone.fade * transition_fade, set_kernels[1 + zone_index],
+                zone.timed || set.variables_timed, state, start, led, all);
+  }
+
+  if (state != nullptr)
+    std::swap(frame_state[0], frame_state[1]);
+}
+
+void LedController::renderRange(CRGB *target, int t, const FormulaData *formulas, int fade, RenderKernel kernel,
+                                bool timed, PixelState *state, int begin, int end, bool all) {
+  if (!timed && !all) { // The leds still show what they showed last frame, but the state is in the other buffer
+    if (state != nullptr)
+      memcpy(state + begin, FuncForm::previousFrame + begin, (end - begin) * sizeof(PixelState));
+    return;
   }
 
-//  debugf("hsv = %i %i %i\n", h, s, v);
+  if (palette_mode)
+    kernel = &LedController::renderPalette;
+  (this->*kernel)(target, t, formulas, fade, state, begin, end);
+}
+
+LedController::RenderKernel LedController::selectKernel(bool variable, int fade) {
+  if (!variable)
+    return &LedController::renderConstant;
+  if (fade == 1)
+    return &LedController::renderUnfaded;
+  if ((fade & (fade - 1)) == 0)
+    return &LedController::renderFaded<true>;
+  return &LedController::renderFaded<false>;
+}
+
+void LedController::selectKernels() {
+  if (formulas == nullptr)
+    return;
 
-  for (int calc_led = 0, fade_offset = 0, led_index, strip, strip_start;
-      calc_led - fade + 1 < NUM_LEDS; calc_led += fade, fade_offset = fade - 1, p = c) {
-    if (variableFormulas) {
-      h = formulas[0].eval(calc_led, tick) & 0xFF; // hue % 256
-      s = clampByte(formulas[1].eval(calc_led, tick));
-      v = clampByte(formulas[2].eval(calc_led, tick));
+  kernels[0] = selectKernel(formulas->variable, fade);
+  for (int i = 0; i < formulas->zone_count; ++i)
+    kernels[1 + i] = selectKernel(formulas->zones[i].variable, formulas->zones[i].fade);
+
+  if (transition_from != nullptr) {
+    transition_kernels[0] = selectKernel(transition_from->variable, fade * TRANSITION_FADE);
+    for (int i = 0; i < transition_from->zone_count; ++i) {
+      const Zone &zone = transition_from->zones[i];
+      transition_kernels[1 + i] = selectKernel(zone.variable, zone.fade * TRANSITION_FADE);
     }
+  }
+}
+
+// The same color for every led, so there's nothing to fade
+void LedController::renderConstant(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state,
+                                    int begin, int end) {
+  uint8_t h = formulas[0].eval(0, t) & 0xFF, s = clampByte(formulas[1].eval(0, t)), v = clampByte(formulas[2].eval(0, t));
+
+  CRGB c = CHSV(h, s, v);
+  if (begin == 0 && end == num_leds) { // Order doesn't matter then
+    for (int led = 0; led < num_leds; ++led)
+      target[led] = c;
+  } else {
+    for (int led = begin; led < end; ++led)
+      target[led_map[led]] = c;
+  }
+
+  if (state != nullptr) {
+    for (int led = begin; led < end; ++led)
+      state[led] = PixelState{h, s, v};
+  }
+}
+
+// Every led is calculated
+void LedController::renderUnfaded(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state,
+                                   int begin, int end) {
+  int hues[FORMULA_BATCH], sats[FORMULA_BATCH], vals[FORMULA_BATCH];
+
+  for (int batch_led = begin; batch_led < end; batch_led += FORMULA_BATCH) {
+    int count = min(FORMULA_BATCH, end - batch_led);
+    formulas[0].evalBatch(batch_led, 1, count, t, hues);
+    formulas[1].evalBatch(batch_led, 1, count, t, sats);
+    formulas[2].evalBatch(batch_led, 1, count, t, vals);
+
+    for (int i = 0; i < count; ++i) {
+      uint8_t h = hues[i] & 0xFF, s = clampByte(sats[i]), v = clampByte(vals[i]); // hue % 256
+      target[led_map[batch_led + i]] = CHSV(h, s, v);
+      if (state != nullptr)
+        state[batch_led + i] = PixelState{h, s, v};
+    }
+  }
+}
+
+// Every fade leds are calculated, and the leds in between are interpolated. Fades that are a power of two shift
+// instead of dividing.
+template<bool shift>
+void LedController::renderFaded(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state,
+                                 int begin, int end) {
+  int fade_shift = 0;
+  while (shift && (1 << fade_shift) < fade)
+    ++fade_shift;
+
+  CRGB c{}, p = CRGB(0, 0, 0);
+  PixelState current{}, previous{};
+
+  // Formulas are evaluated for a batch of leds at a time
+  int hues[FORMULA_BATCH], sats[FORMULA_BATCH], vals[FORMULA_BATCH], batch_index = FORMULA_BATCH;
+
+  for (int calc_led = begin, fade_offset = 0, led_index;
+      calc_led - fade + 1 < end; calc_led += fade, fade_offset = fade - 1, p = c) {
+    if (batch_index == FORMULA_BATCH) {
+      int count = min(FORMULA_BATCH, (end + 2 * fade - 2 - calc_led) / fade);
+      formulas[0].evalBatch(calc_led, fade, count, t, hues);
+      formulas[1].evalBatch(calc_led, fade, count, t, sats);
+      formulas[2].evalBatch(calc_led, fade, count, t, vals);
+      batch_index = 0;
+    }
+    uint8_t h = hues[batch_index] & 0xFF, s = clampByte(sats[batch_index]), v = clampByte(vals[batch_index]);
+    ++batch_index;
 
     c = CHSV(h, s, v);
+    current = PixelState{h, s, v};
 
-    while (fade_offset >= 0 && (led_index = calc_led - fade_offset) < NUM_LEDS) {
-      // Do some re-calculation for multiple strips
-      strip_start = 0;
-      strip = 0;
-      // Keep adding strip counts until we're at the current strip
-      while (strip_start + led_count[strip] <= led_index)
-        strip_start += led_count[strip++];
-
-      // Reverse odd strips
-      if ((strip & 1) == 0)
-        led_index = strip_start + (led_count[strip] - 1 - (led_index - strip_start));
-
-      leds[led_index] = CRGB(
-              (fade_offset * p.r + (fade - fade_offset) * c.r) / fade,
-              (fade_offset * p.g + (fade - fade_offset) * c.g) / fade,
-              (fade_offset * p.b + (fade - fade_offset) * c.b) / fade
-      );
-//      debugf("%i is %i %i %i\n", z, leds[z].r, leds[z].g, leds[z].b);
+    while (fade_offset >= 0 && (led_index = calc_led - fade_offset) < end) {
+      target[led_map[led_index]] = interpolate<shift>(c, p, fade_offset, fade, fade_shift);
+      if (state != nullptr)
+        state[led_index] = interpolate<shift>(current, previous, fade_offset, fade, fade_shift);
       --fade_offset;
     }
+    previous = current;
   }
+}
+
+// The hue formula picks a palette color, and every led is looked up as soon as its index is known, so palette mode
+// needs no buffer of its own
+void LedController::renderPalette(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state,
+                                   int begin, int end) {
+  const FormulaData &formula = formulas[0];
+  const CRGB *colors = palette->colors;
+
+  uint8_t c = formula.eval(0, t) & 0xFF, p = 0;
+  int indices[FORMULA_BATCH], batch_index = FORMULA_BATCH;
 
-  tick = tick + 1;
+  // Only the hue formula matters here, and it's faded as a palette index
+  for (int calc_led = begin, fade_offset = 0, led_index;
+      calc_led - fade + 1 < end; calc_led += fade, fade_offset = fade - 1, p = c) {
+    if (formula.isVariable) {
+      if (batch_index == FORMULA_BATCH) {
+        formula.evalBatch(calc_led, fade, min(FORMULA_BATCH, (end + 2 * fade - 2 - calc_led) / fade), t, indices);
+        batch_index = 0;
+      }
+      c = indices[batch_index++] & 0xFF;
+    }
+
+    while (fade_offset >= 0 && (led_index = calc_led - fade_offset) < end) {
+      uint8_t index = (fade_offset * p + (fade - fade_offset) * c) / fade;
+      target[led_map[led_index]] = colors[index];
+      if (state != nullptr) // hue(i) is the palette index, there's no sat or val
+        state[led_index] = PixelState{index, 255, 255};
+      --fade_offset;
+    }
+  }
 }
 
-void LedController::mark_change(unsigned long current_ms) {
-  changed = true;
-  last_changed = current_ms;
-  update();
+void LedController::renderKeyframes() {
+  if (keyframes[0] == nullptr) {
+    keyframes[0] = newPixelBuffer<CRGB>(num_leds);
+    keyframes[1] = newPixelBuffer<CRGB>(num_leds);
+  }
+
+  int keyframe_interval = this->keyframe_interval;
+  int phase = tick % keyframe_interval, key = tick - phase;
+
+  if (key != keyframe_tick) {
+    // Moving on to the next pair of keyframes only requires rendering the new one
+    if (keyframe_tick >= 0 && key == keyframe_tick + keyframe_interval)
+      std::swap(keyframes[0], keyframes[1]);
+    else
+      render(keyframes[0], key);
+
+    render(keyframes[1], key + keyframe_interval);
+    keyframe_tick = key;
+  }
+
+  for (int led = 0; led < num_leds; ++led)
+    leds[led] = interpolate(keyframes[0][led], keyframes[1][led], phase, keyframe_interval);
 }
 
-bool LedController::update_timed(unsigned long current_ms) {
-  if (bright > 0) {
-    if (timedFormulas) {
-      update();
-    }
+void LedController::update() {
+  // Keyframes are pointless if nothing changes over time
+  // Keyframes are blended into the leds, so they'd need to be checked before parts of them could be skipped
+  if (keyframe_interval > 1 && (formulas->timed || transition_from != nullptr)) {
+    renderKeyframes();
+    rendered = false;
+  } else {
+    render(leds, tick, !rendered);
+    rendered = true;
+  }
+}
+
+bool LedController::update_timed(unsigned long current_ms, int current_tick) {
+  tick = current_tick;
+
+  // Changes need to be shown even if the formulas aren't timed
+  if (applyCommands(current_ms)) {
+    rendered = false;
+    update();
+  } else if (bright > 0 && (formulas->timed || transition_from != nullptr)) {
+    update();
   }
 
+  // Even if nothing changed, dithering needs every frame
+  if (bright > 0)
+    writeOutput();
+
   // 5 seconds after something was last changed, save, instead of saving on every change
-  if (changed && current_ms - last_changed > POST_CHANGE_SAVE_DELAY) {
+  if (changed && snapshot == nullptr && current_ms - last_changed > POST_CHANGE_SAVE_DELAY) {
     changed = false;
     saveConfig();
+
+    if (layout_changed) {
+      Serial.println("Restarting to apply the new layout");
+      ESP.restart();
+    }
   }
 
   return bright > 0;
 }
 
+void LedController::send(const LedCommand &command) {
+  while (!commands.push(command)) {
+    // The render task can make room itself (and it's the only task that can apply commands before it's started),
+    // other tasks need to wait until it does
+    if (render_task == nullptr || xTaskGetCurrentTaskHandle() == render_task)
+      applyCommands(millis());
+    else
+      delay(1);
+  }
+}
+
+bool LedController::applyCommands(unsigned long current_ms) {
+  bool applied = false;
+
+  for (LedCommand *command; (command = commands.front()) != nullptr; commands.pop()) {
+    if (apply(*command)) {
+      changed = true;
+      last_changed = current_ms;
+    }
+    *command = LedCommand(); // Don't keep the formula or name alive in the queue
+    applied = true;
+  }
+
+  applyPending();
+
+  // Whoever is reading now started after the old values were replaced, so they can't be reading those
+  if (!retired.empty() && readers == 0)
+    retired.clear();
+
+  return applied;
+}
+
+// Returns whether the config needs to be saved
+bool LedController::apply(const LedCommand &command) {
+  switch (command.type) {
+    case set_name:
+      if (device_name != nullptr && !fitsConfig((int) command.name->length() - (int) device_name->length()))
+        return false;
+
+      retired.push_back(device_name);
+      device_name = command.name;
+      published_name = device_name.get();
+      updateVersion(field_name);
+      break;
+
+    case set_brightness:
+      pending_bright = command.value;
+      pending_fields |= 1 << field_brightness;
+      break;
+
+    case set_fade:
+      fade = command.value;
+      selectKernels();
+      keyframe_tick = -1;
+      updateVersion(field_fade);
+      break;
+
+    case set_keyframe_interval:
+      keyframe_interval = command.value;
+      keyframe_tick = -1;
+      updateVersion(field_keyframe_interval);
+      break;
+
+    case set_layout:
+      if (snapshot != nullptr) // It would only be applied by restarting
+        return false;
+
+      retired.push_back(layout);
+      layout = command.layout;
+      published_layout = layout.get();
+      layout_changed = true;
+      updateVersion(field_layout);
+      break;
+
+    case set_palette:
+      if (!palette_saved && !fitsConfig(sizeof(Palette)))
+        return false;
+
+      palette = command.palette;
+      palette_saved = true;
+      keyframe_tick = -1;
+      break;
+
+    case set_palette_mode:
+      palette_mode = command.value != 0;
+      keyframe_tick = -1;
+      updateVersion(field_palette_mode);
+      break;
+
+    case set_formula: {
+      // Checked again here, a variable it uses can have been removed since it was sent
+      const FormulaSet *current = pendingFormulas();
+      if (!areDefinedIn(current, command.formula.variables))
+        return false;
+      int replaced = current != nullptr ? storedSize(current->formulas[command.value]) : 0;
+      if (!fitsConfig(storedSize(command.formula) - replaced))
+        return false;
+
+      editFormulas().formulas[command.value] = command.formula;
+      pending_fields |= 1 << (field_hue + command.value);
+      break;
+    }
+
+    case select_preset: {
+      const Preset *preset = presets[command.value].get();
+      if (preset == nullptr || !fitsConfig(storedSize(preset->formulas.get()) - storedSize(pendingFormulas())))
+        break;
+
+      pending_formulas = nullptr;
+      pending_set = preset->formulas;
+      pending_bright = preset->bright;
+      fade = preset->fade;
+      keyframe_interval = preset->keyframe_interval;
+      palette_mode = preset->palette_mode;
+      for (StateField field : {field_fade, field_keyframe_interval, field_palette_mode})
+        updateVersion(field);
+      for (StateField field : {field_brightness, field_hue, field_sat, field_val, field_variables, field_zones})
+        pending_fields |= 1 << field;
+
+      return false;
+    }
+
+    case set_variable: {
+      applied_variables |= 1 << (command.value - 'a');
+      const FormulaSet *current = pendingFormulas();
+      int count = current == nullptr ? 0 : current->variable_count, index = 0;
+      while (index < count && current->variables[index].name != command.value)
+        ++index;
+
+      // Removing one that doesn't exist, or no room for another one
+      if (command.formula.form == nullptr ? index == count : index == MAX_VARIABLES)
+        return false;
+      if (!keepsOrder(current, (char) command.value, command.formula, 0))
+        return false;
+
+      int added = command.formula.form == nullptr ? 0 : 1 + storedSize(command.formula); // With its name
+      if (!fitsConfig(index == count ? added : added - storedSize(current->variables[index])))
+        return false;
+
+      FormulaSet &set = editFormulas();
+      if (command.formula.form == nullptr) {
+        for (; index + 1 < set.variable_count; ++index)
+          set.variables[index] = set.variables[index + 1];
+        set.variables[--set.variable_count] = Variable();
+      } else {
+        if (index == set.variable_count)
+          ++set.variable_count;
+        set.variables[index].name = (char) command.value;
+        set.variables[index].formula = command.formula;
+      }
+
+      pending_fields |= 1 << field_variables;
+      break;
+    }
+
+    case set_matrix:
+      if (snapshot != nullptr)
+        return false;
+
+      matrix_width = command.value;
+      matrix_serpentine = command.flag;
+      coordinate_map = false;
+      if (coordinates[0] != nullptr) // Otherwise the leds aren't known yet
+        updateCoordinates();
+      keyframe_tick = -1;
+      updateVersion(field_matrix);
+      break;
+
+    case set_coordinates: {
+      if (coordinates[0] == nullptr || snapshot != nullptr)
+        return false;
+
+      const CoordinateChunk &chunk = *command.coordinates;
+      for (int i = 0, led = chunk.offset; i < (int) chunk.uv.size() / 2 && led < num_leds; ++i, ++led) {
+        coordinates[0][led] = chunk.uv[i * 2];
+        coordinates[1][led] = chunk.uv[i * 2 + 1];
+      }
+      coordinate_map = true;
+      coordinates_changed = true;
+      keyframe_tick = -1;
+      updateVersion(field_matrix);
+      break;
+    }
+
+    case set_transition:
+      transition_duration = command.value;
+      updateVersion(field_transition);
+      break;
+
+    case set_groups:
+      groups = (uint32_t) command.value;
+      updateVersion(field_groups);
+      break;
+
+    case set_zones: {
+      const std::vector<Zone> &zones = *command.zones;
+      const FormulaSet *current = pendingFormulas();
+      int added = 0;
+      for (const Zone &zone : zones) {
+        for (const FormulaData &formula : zone.formulas) {
+          if (!areDefinedIn(current, formula.variables))
+            return false;
+        }
+        added += storedSize(zone);
+      }
+      for (int i = 0; current != nullptr && i < current->zone_count; ++i)
+        added -= storedSize(current->zones[i]);
+      if (!fitsConfig(added))
+        return false;
+
+      FormulaSet &set = editFormulas();
+      for (int i = 0; i < MAX_ZONES; ++i)
+        set.zones[i] = i < (int) zones.size() ? zones[i] : Zone();
+      set.zone_count = (int) zones.size();
+
+      pending_fields |= 1 << field_zones;
+      break;
+    }
+
+    case save_preset: {
+      applyPending(); // Earlier changes in the same batch belong in the preset
+      if (!presetFits(command.value, *command.name)) // The slot keeps the preset it had
+        return false;
+
+      auto preset = std::make_shared<Preset>();
+      preset->name = *command.name;
+      preset->formulas = formulas;
+      preset->bright = bright;
+      preset->fade = fade;
+      preset->keyframe_interval = keyframe_interval;
+      preset->palette_mode = palette_mode;
+
+      retired.push_back(presets[command.value]);
+      presets[command.value] = preset;
+      published_presets[command.value] = preset.get();
+
+      if (snapshot == nullptr)
+        savePresets();
+      return false;
+    }
+  }
+  return true;
+}
+
+const FormulaSet *LedController::pendingFormulas() const {
+  if (pending_formulas != nullptr)
+    return pending_formulas.get();
+  return pending_set != nullptr ? pending_set.get() : formulas.get();
+}
+
+bool LedController::areDefined(uint32_t variables) const {
+  uint32_t defined = queued_variables;
+  ++readers;
+  const FormulaSet *set = published_formulas.load();
+  for (int i = 0; set != nullptr && i < set->variable_count; ++i)
+    defined |= 1 << (set->variables[i].name - 'a');
+  --readers;
+
+  return (variables & ~defined) == 0;
+}
+
+FormulaSet &LedController::editFormulas() {
+  if (pending_formulas == nullptr) {
+    const FormulaSet *current = pendingFormulas();
+    pending_formulas = current == nullptr ? std::make_shared<FormulaSet>() : std::make_shared<FormulaSet>(*current);
+    pending_set = nullptr;
+  }
+  return *pending_formulas;
+}
+
+void LedController::applyPending() {
+  if (pending_formulas != nullptr) {
+    pending_formulas->updateFlags();
+    publish(pending_formulas);
+    pending_formulas = nullptr;
+  } else if (pending_set != nullptr) {
+    publish(pending_set); // Its flags were updated when the preset was loaded or saved
+    pending_set = nullptr;
+  }
+  queued_variables &= ~applied_variables;
+  applied_variables = 0;
+
+  if (pending_bright >= 0) {
+    applyBrightness(pending_bright);
+    pending_bright = -1;
+  }
+
+  for (int field = 0; field < STATE_FIELDS; ++field) {
+    if (pending_fields & 1 << field)
+      updateVersion((StateField) field);
+  }
+  pending_fields = 0;
+}
+
+void LedController::applyBrightness(int value) {
+  bright = value;
+
+  // The output table can only be made once the gamma table exists
+  if (output == nullptr)
+    return;
+
+  const CRGB correction = CRGB(OUTPUT_CORRECTION);
+  for (int channel = 0; channel < 3; ++channel) {
+    for (int i = 0; i < 256; ++i)
+      output_table[channel][i] = (uint32_t) gamma_table[i] * correction[channel] * value / (255 * 255);
+  }
+
+  if (value == 0 && snapshot == nullptr) {
+    writeOutput();
+    FastLED.show();
+  }
+}
+
+void LedController::publish(const std::shared_ptr<const FormulaSet> &set) {
+  // Nothing is shown yet while the config is loaded
+  if (transition_duration > 0 && formulas != nullptr && leds != nullptr) {
+    transition_from = formulas;
+    transition_start = tick;
+  }
+
+  retired.push_back(formulas);
+  formulas = set;
+  published_formulas = formulas.get();
+  selectKernels();
+
+  keyframe_tick = -1;
+}
+
+void LedController::updateVersion(StateField field) {
+  field_versions[field] = ++version;
+}
+
 String LedController::getDeviceName() const {
-  return device_name;
+  return read(published_name);
 }
 
 void LedController::setDeviceName(const String &name) {
-  device_name = name;
+  LedCommand command;
+  command.type = set_name;
+  command.name = std::make_shared<const String>(name);
+  send(command);
 }
 
 int LedController::getBrightness() const {
@@ -171,45 +1185,323 @@ int LedController::getFade() const {
   return fade;
 }
 
-FormulaType LedController::getFormulaType(int index) {
-  return formulas[index].type;
+int LedController::getKeyframeInterval() const {
+  return keyframe_interval;
 }
 
-String LedController::getFormula(int index) {
-  return formulas[index].toString();
+int LedController::getTransitionDuration() const {
+  return transition_duration;
 }
 
-void LedController::setBrightness(int value) {
-  bright = value;
+int LedController::getLedCount() const {
+  return num_leds;
+}
 
-  FastLED.setBrightness(value);
+LedLayout LedController::getLayout() const {
+  return read(published_layout);
+}
 
-  if (value == 0)
-    FastLED.show();
+bool LedController::isPaletteMode() const {
+  return palette_mode;
+}
+
+uint32_t LedController::getFrameChecksum() const {
+  uint32_t checksum = 2166136261u; // FNV-1a
+  for (int led = 0; led < num_leds; ++led) {
+    for (int channel = 0; channel < 3; ++channel)
+      checksum = (checksum ^ leds[led].raw[channel]) * 16777619u;
+  }
+
+  return checksum;
+}
+
+uint32_t LedController::getVersion() const {
+  return version;
+}
+
+uint32_t LedController::getFieldVersion(StateField field) const {
+  return field_versions[field];
+}
+
+Palette LedController::getPalette() const {
+  return palette == nullptr ? Palette() : *palette;
+}
+
+String LedController::getPresetName(int slot) const {
+  ++readers;
+  const Preset *preset = published_presets[slot].load();
+  String name = preset == nullptr ? "" : preset->name;
+  --readers;
+
+  return name;
+}
+
+int LedController::getMatrixWidth() const {
+  return matrix_width;
+}
+
+bool LedController::isMatrixSerpentine() const {
+  return matrix_serpentine;
+}
+
+bool LedController::hasCoordinateMap() const {
+  return coordinate_map;
+}
+
+uint32_t LedController::getGroups() const {
+  return groups;
+}
+
+FormulaType LedController::getFormulaType(int index) const {
+  ++readers;
+  FormulaType type = published_formulas.load()->formulas[index].type;
+  --readers;
+
+  return type;
+}
+
+String LedController::getFormula(int index) const {
+  ++readers;
+  String formula = published_formulas.load()->formulas[index].toString();
+  --readers;
+
+  return formula;
+}
+
+std::vector<Variable> LedController::getVariables() const {
+  ++readers;
+  const FormulaSet *set = published_formulas.load();
+  std::vector<Variable> variables(set->variables, set->variables + set->variable_count);
+  --readers;
+
+  return variables;
+}
+
+std::vector<Zone> LedController::getZones() const {
+  ++readers;
+  const FormulaSet *set = published_formulas.load();
+  std::vector<Zone> zones(set->zones, set->zones + set->zone_count);
+  --readers;
+
+  return zones;
+}
+
+void LedController::setBrightness(int value) {
+  LedCommand command;
+  command.type = set_brightness;
+  command.value = value;
+  send(command);
 }
 
 void LedController::setFade(int value) {
-  fade = value;
+  LedCommand command;
+  command.type = set_fade;
+  command.value = value;
+  send(command);
 }
 
-void LedController::setFormula(int formula_index, FormulaType type, const char *str) {
-  Form *form = parseFormula(str);
-  if (form != nullptr) {
-    FormulaData &data = formulas[formula_index];
+void LedController::setKeyframeInterval(int value) {
+  LedCommand command;
+  command.type = set_keyframe_interval;
+  command.value = value;
+  send(command);
+}
+
+void LedController::setTransitionDuration(int value) {
+  LedCommand command;
+  command.type = set_transition;
+  command.value = value;
+  send(command);
+}
+
+void LedController::setLayout(const LedLayout &value) {
+  LedCommand command;
+  command.type = set_layout;
+  command.layout = std::make_shared<const LedLayout>(value);
+  send(command);
+}
+
+void LedController::setPalette(const Palette &value) {
+  LedCommand command;
+  command.type = set_palette;
+  command.palette = std::make_shared<const Palette>(value);
+  send(command);
+}
+
+void LedController::setPaletteMode(bool value) {
+  LedCommand command;
+  command.type = set_palette_mode;
+  command.value = value;
+  send(command);
+}
+
+void LedController::setMatrix(int width, bool serpentine) {
+  LedCommand command;
+  command.type = set_matrix;
+  command.value = width;
+  command.flag = serpentine;
+  send(command);
+}
+
+void LedController::setCoordinates(int offset, int count, const uint8_t *uv) {
+  auto chunk = std::make_shared<CoordinateChunk>();
+  chunk->offset = offset;
+  chunk->uv.assign(uv, uv + count * 2);
+
+  LedCommand command;
+  command.type = set_coordinates;
+  command.coordinates = chunk;
+  send(command);
+}
+
+void LedController::setGroups(uint32_t value) {
+  LedCommand command;
+  command.type = set_groups;
+  command.value = (int) value;
+  send(command);
+}
+
+bool LedController::setFormula(int formula_index, FormulaType type, const char *str) {
+  LedCommand command;
+  command.type = set_formula;
+  command.value = formula_index;
+
+  // Parse on the calling task, so the render task only has to swap it in
+  if (!parseFormulaData(type, str, command.formula) || !areDefined(command.formula.variables))
+    return false;
+
+  send(command);
+  return true;
+}
+
+bool LedController::setVariable(char name, FormulaType type, const char *str) {
+  if (!VarForm::isVariableName(name))
+    return false;
+
+  LedCommand command;
+  command.type = set_variable;
+  command.value = name;
 
-    delete data.form;
+  // It's calculated once for all leds, so it can't depend on x
+  if (*str != 0 && (!parseFormulaData(type, str, command.formula) || command.formula.isVariable))
+    return false;
 
-    data.type = type;
-    data.form = form;
-    data.isVariable = form->isVariable();
-    data.isTimed = form->isTimed();
+  // The render task checks this again against what was queued before it
+  ++readers;
+  bool keeps = keepsOrder(published_formulas.load(), name, command.formula, queued_variables);
+  --readers;
+  if (!keeps)
+    return false;
+
+  if (*str != 0)
+    queued_variables |= 1 << (name - 'a');
+  send(command);
+  return true;
+}
+
+bool LedController::setZones(std::vector<Zone> zones) {
+  if (!arrangeZones(zones))
+    return false;
+  for (const Zone &zone : zones) {
+    for (const FormulaData &formula : zone.formulas) {
+      if (!areDefined(formula.variables))
+        return false;
+    }
+  }
+
+  LedCommand command;
+  command.type = set_zones;
+  command.zones = std::make_shared<const std::vector<Zone>>(std::move(zones));
+  send(command);
+  return true;
+}
+
+void LedController::selectPreset(int slot) {
+  LedCommand command;
+  command.type = select_preset;
+  command.value = slot;
+  send(command);
+}
+
+bool LedController::savePreset(int slot, const String &name) {
+  // The render task checks again, with the changes that were queued before it
+  if (!presetFits(slot, name))
+    return false;
+
+  LedCommand command;
+  command.type = save_preset;
+  command.value = slot;
+  command.name = std::make_shared<const String>(name);
+  send(command);
+  return true;
+}
+
+void LedController::resetRendering() {
+  for (int led = 0; led < num_leds; ++led)
+    leds[led] = CRGB(0, 0, 0);
+  if (frame_state[0] != nullptr) {
+    memset(frame_state[0], 0, num_leds * sizeof(PixelState));
+    memset(frame_state[1], 0, num_leds * sizeof(PixelState));
   }
 
-  timedFormulas = variableFormulas = false;
-  for (const FormulaData &formula : formulas) {
-    timedFormulas |= formula.isTimed;
-    variableFormulas |= formula.isVariable;
+  transition_from = nullptr;
+  keyframe_tick = -1;
+  rendered = false;
+}
+
+void LedController::beginReplay(unsigned long current_ms) {
+  applyCommands(current_ms); // Changes that arrived before belong to the state that's brought back
+
+  snapshot = std::unique_ptr<StateSnapshot>(new StateSnapshot());
+  snapshot->name = device_name;
+  snapshot->formulas = formulas;
+  snapshot->palette = palette;
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot)
+    snapshot->presets[slot] = presets[slot];
+  snapshot->bright = bright;
+  snapshot->keyframe_interval = keyframe_interval;
+  snapshot->fade = fade;
+  snapshot->transition_duration = transition_duration;
+  snapshot->palette_mode = palette_mode;
+  snapshot->palette_saved = palette_saved;
+  snapshot->changed = changed;
+  snapshot->groups = groups;
+  snapshot->last_changed = last_changed;
+
+  resetRendering();
+}
+
+void LedController::endReplay(unsigned long current_ms) {
+  applyCommands(current_ms); // Whatever the replay left in the queue, while it still can't be saved
+
+  const StateSnapshot &state = *snapshot;
+  retired.push_back(device_name);
+  device_name = state.name;
+  published_name = device_name.get();
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot) {
+    retired.push_back(presets[slot]);
+    presets[slot] = state.presets[slot];
+    published_presets[slot] = presets[slot].get();
   }
+  palette = state.palette;
+  palette_saved = state.palette_saved;
+  palette_mode = state.palette_mode;
+  keyframe_interval = state.keyframe_interval;
+  fade = state.fade;
+  transition_duration = state.transition_duration;
+  groups = state.groups;
+  changed = state.changed;
+  last_changed = state.last_changed;
+  publish(state.formulas);
+  applyBrightness(state.bright);
+
+  for (StateField field : {field_name, field_brightness, field_fade, field_hue, field_sat, field_val,
+                           field_keyframe_interval, field_palette_mode, field_transition, field_variables,
+                           field_groups, field_zones})
+    updateVersion(field);
+
+  snapshot = nullptr;
+  resetRendering();
 }
 
-LedController::LedController() : leds(), bright(), fade(), tick() {}
+LedController::LedController() : bright(), fade(), keyframe_interval(1), tick() {}
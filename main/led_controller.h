@@ -2,41 +2,345 @@
 #ifndef LEDS_LED_CONTROLLER_H
 #define LEDS_LED_CONTROLLER_H
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
 #include <FastLED.h>
 
 #include "formula.h"
 #include "includes.h"
+#include "led_layout.h"
+#include "spsc_queue.h"
+
+#define COMMAND_QUEUE_SIZE 16
+#define MAX_ZONES 4
 
 struct FormulaData {
   FormulaType type = int_formula;
-  Form *form = nullptr;
-  bool isVariable = false, isTimed = false;
+  std::shared_ptr<const Form> form;
+  String text; // form->toString(type), so it doesn't have to be built every time a client asks
+  bool isVariable = false, isTimed = false, isStateful = false;
+  uint32_t variables = 0; // form->usedVariables()
 
   String toString() const {
-    return form->toString(type);
+    return text;
   }
 
   int eval(int x, int t) const {
     return type == int_formula ? form->eval(x, t) : (int) form->eval((double) x, (double) t);
   }
+
+  // count can't be more than FORMULA_BATCH
+  void evalBatch(int x, int step, int count, int t, int *out) const {
+    if (type == int_formula) {
+      form->evalBatch(x, step, count, t, out);
+      return;
+    }
+    for (int i = 0; i < count; ++i, x += step)
+      out[i] = (int) form->eval((double) x, (double) t);
+  }
+};
+
+// Parses str into data, returns false if it isn't a valid formula
+bool parseFormulaData(FormulaType type, const char *str, FormulaData &data);
+
+// A per-tick variable, which is the same for all leds, so it can't use x
+struct Variable {
+  char name = 0;
+  FormulaData formula;
+};
+
+// A range of leds with its own formulas and fade, which are rendered there instead of the main formulas. x is still
+// the index of the led on the whole strip.
+struct Zone {
+  uint16_t start = 0, count = 0, fade = 1;
+  FormulaData formulas[3];
+  bool timed = false, variable = false, stateful = false;
+
+  void updateFlags() {
+    timed = variable = stateful = false;
+    for (const FormulaData &formula : formulas) {
+      timed |= formula.isTimed;
+      variable |= formula.isVariable;
+      stateful |= formula.isStateful;
+    }
+  }
+};
+
+// The hue/sat/val formulas that are rendered together, and the variables they use. A set is never modified once
+// it's published, changing a formula publishes a new set that shares the other formulas with the old one.
+struct FormulaSet {
+  FormulaData formulas[3];
+  Variable variables[MAX_VARIABLES];
+  int variable_count = 0;
+  Zone zones[MAX_ZONES]; // Ordered by start, and they don't overlap
+  int zone_count = 0;
+  // timed and stateful are about everything in the set, the others only about the main formulas and the variables
+  bool timed = false, main_timed = false, variables_timed = false, variable = false, stateful = false;
+
+  void updateFlags() {
+    main_timed = variables_timed = variable = stateful = false;
+    for (const FormulaData &formula : formulas) {
+      main_timed |= formula.isTimed;
+      variable |= formula.isVariable;
+      stateful |= formula.isStateful;
+    }
+    for (int i = 0; i < variable_count; ++i)
+      variables_timed |= variables[i].formula.isTimed;
+    main_timed |= variables_timed;
+
+    timed = main_timed;
+    for (int i = 0; i < zone_count; ++i) {
+      timed |= zones[i].timed;
+      stateful |= zones[i].stateful;
+    }
+  }
+
+  // The variables before index, which the variable at index can use
+  uint32_t definedVariables(int index) const {
+    uint32_t defined = 0;
+    for (int i = 0; i < index && i < variable_count; ++i)
+      defined |= 1 << (variables[i].name - 'a');
+    return defined;
+  }
+
+  // The variables that the formulas, the zones and the variables from index on use
+  uint32_t usedVariables(int index) const {
+    uint32_t used = 0;
+    for (const FormulaData &formula : formulas)
+      used |= formula.variables;
+    for (int i = 0; i < zone_count; ++i) {
+      for (const FormulaData &formula : zones[i].formulas)
+        used |= formula.variables;
+    }
+    for (int i = index; i < variable_count; ++i)
+      used |= variables[i].formula.variables;
+    return used;
+  }
+
+  // In order, so a variable can use the ones before it
+  void evalVariables(int t) const {
+    for (int i = 0; i < variable_count; ++i) {
+      const FormulaData &formula = variables[i].formula;
+      double value = formula.type == int_formula ? formula.form->eval(0, t) : formula.form->eval(0.0, (double) t);
+      VarForm::setVariable(variables[i].name, (int) value, value);
+    }
+  }
+};
+
+// A scene that's kept ready to be switched to
+struct Preset {
+  String name;
+  std::shared_ptr<const FormulaSet> formulas;
+  uint8_t bright = 0;
+  uint16_t fade = 1;
+  uint8_t keyframe_interval = 1;
+  bool palette_mode = false;
+};
+
+// Colors for palette mode, in which the hue formula picks one of these instead of a hue
+struct Palette {
+  CRGB colors[256];
+};
+
+// What replaying a trace can change, so it can be brought back afterwards
+struct StateSnapshot {
+  std::shared_ptr<const String> name;
+  std::shared_ptr<const FormulaSet> formulas;
+  std::shared_ptr<const Palette> palette;
+  std::shared_ptr<const Preset> presets[PRESET_SLOTS];
+  uint8_t bright = 0, keyframe_interval = 1;
+  uint16_t fade = 1, transition_duration = 0;
+  bool palette_mode = false, palette_saved = false, changed = false;
+  uint32_t groups = 0;
+  unsigned long last_changed = 0;
+};
+
+// Parts of the state that clients are notified about when they change, in the order of the update packet's flags
+enum StateField {
+  field_name, field_brightness, field_fade, field_hue, field_sat, field_val, field_keyframe_interval,
+  field_layout, field_palette_mode, field_transition, field_variables, field_matrix,
+  field_groups, field_zones, STATE_FIELDS
+};
+
+enum LedCommandType {
+  set_name, set_brightness, set_fade, set_keyframe_interval, set_formula, set_layout, set_palette, set_palette_mode,
+  select_preset, save_preset, set_transition, set_variable, set_matrix, set_coordinates,
+  set_groups, set_zones
+};
+
+// Part of an uploaded coordinate map: u and v for every led starting at offset
+struct CoordinateChunk {
+  uint16_t offset = 0;
+  std::vector<uint8_t> uv;
+};
+
+struct LedCommand {
+  LedCommandType type = set_name;
+  int value = 0; // Formula index for set_formula, slot for presets, name for set_variable, width for set_matrix,
+                 // the group mask for set_groups
+  bool flag = false; // Serpentine for set_matrix
+  FormulaData formula;
+  std::shared_ptr<const String> name;
+  std::shared_ptr<const LedLayout> layout;
+  std::shared_ptr<const Palette> palette;
+  std::shared_ptr<const CoordinateChunk> coordinates;
+  std::shared_ptr<const std::vector<Zone>> zones;
 };
 
 class LedController {
 private:
+  // Changes can come from any task, but are only applied by the render task at the start of a tick
+  SpscQueue<LedCommand, COMMAND_QUEUE_SIZE> commands;
+  TaskHandle_t render_task = nullptr;
 
-  FormulaData formulas[3];
-  bool timedFormulas = false, variableFormulas = false;
+  // Owned by the render task. Other tasks read the published pointers instead, and values that are replaced
+  // are retired until no other task is reading anymore
+  std::shared_ptr<const FormulaSet> formulas;
+  std::shared_ptr<const String> device_name;
+  std::shared_ptr<const LedLayout> layout;
+
+  std::atomic<const FormulaSet *> published_formulas{nullptr};
+  std::atomic<const String *> published_name{nullptr};
+  std::atomic<const LedLayout *> published_layout{nullptr};
+
+  std::shared_ptr<const Preset> presets[PRESET_SLOTS];
+  std::atomic<const Preset *> published_presets[PRESET_SLOTS] = {};
+  mutable std::atomic<int> readers{0};
+  std::vector<std::shared_ptr<const void>> retired;
+
+  // The layout is only applied on startup, so a new one is saved and then the controller restarts
+  int num_leds = 0;
+  CRGB *leds = nullptr;
+  uint16_t *led_map = nullptr;
+  bool layout_changed = false;
 
-  CRGB leds[NUM_LEDS];
+  // u and v of every led, either calculated for a matrix or uploaded. Without either, u is x and v is 0
+  uint16_t *coordinates[2] = {nullptr, nullptr};
+  std::atomic<uint8_t> matrix_width{0};
+  std::atomic<bool> matrix_serpentine{false}, coordinate_map{false};
+  bool coordinates_changed = false;
 
-  String device_name;
-  uint8_t bright;
-  uint16_t fade;
+  // The h/s/v of every led in the previous and the current frame, only allocated once formulas use it
+  PixelState *frame_state[2] = {nullptr, nullptr};
+
+  // What FastLED shows: the leds after gamma, color correction, brightness and dithering
+  CRGB *output = nullptr;
+  uint16_t gamma_table[256];
+  uint16_t output_table[3][256]; // Per channel, with 8 extra bits for dithering
+  uint8_t output_frame = 0;
+
+  // Whether leds contain the current formulas, so the zones (or the main formulas) that don't change over time
+  // don't need to be rendered again
+  bool rendered = false;
+
+  CRGB *keyframes[2] = {nullptr, nullptr};
+  int keyframe_tick = -1;
+
+  std::shared_ptr<const Palette> palette;
+  bool palette_saved = false;
+  std::atomic<bool> palette_mode{false};
+
+  // While a transition runs, the formulas that were replaced are still rendered and blended into the new ones
+  std::shared_ptr<const FormulaSet> transition_from;
+  int transition_start = 0;
+  CRGB *transition_leds = nullptr;
+  std::atomic<uint16_t> transition_duration{0};
+
+  // Every bit is a group the controller is in, which multicast update packets are addressed to
+  std::atomic<uint32_t> groups{1};
+
+  std::atomic<uint8_t> bright;
+  std::atomic<uint16_t> fade;
+  std::atomic<uint8_t> keyframe_interval;
   int tick;
 
   bool changed = false;
   unsigned long last_changed = 0;
 
+  // Set while a trace is replayed, which doesn't save anything and leaves the layout and coordinates alone
+  std::unique_ptr<StateSnapshot> snapshot;
+
+  // Every change gets a new version, and every field remembers the version it last changed in
+  std::atomic<uint32_t> version{0};
+  std::atomic<uint32_t> field_versions[STATE_FIELDS] = {};
+
+  // Formula and brightness changes from one batch of commands are collected here and applied once, so a burst of
+  // them doesn't copy the formula set or rebuild the output table for every change, and a transition starts from
+  // the formulas that were actually shown. Their versions are only updated once the new values can be read
+  std::shared_ptr<FormulaSet> pending_formulas;
+  // A preset's set, which is published as it is unless the same batch edits it
+  std::shared_ptr<const FormulaSet> pending_set;
+
+  // Variables that were set but aren't published yet, so formulas sent right after them can already use them. The
+  // render task clears them once the set they were applied to is published
+  std::atomic<uint32_t> queued_variables{0};
+  uint32_t applied_variables = 0;
+  int pending_bright = -1;
+  uint32_t pending_fields = 0;
+
+  void send(const LedCommand &command);
+  bool applyCommands(unsigned long current_ms);
+  bool apply(const LedCommand &command);
+  const FormulaSet *pendingFormulas() const;
+  // Bytes saveConfig() writes for the pending state. A change that would make it bigger than CONFIG_SIZE is
+  // rejected, so the config can always be saved
+  int configSize() const;
+  bool fitsConfig(int added) const;
+  // Whether every variable in the mask is defined, or about to be
+  bool areDefined(uint32_t variables) const;
+  FormulaSet &editFormulas();
+  void applyPending();
+  void applyBrightness(int value);
+  void publish(const std::shared_ptr<const FormulaSet> &set);
+  void updateVersion(StateField field);
+
+  void loadPresets();
+  void savePresets();
+  // Whether the presets still fit in PRESETS_SIZE with the current formulas saved in slot as name
+  bool presetFits(int slot, const String &name) const;
+
+  void updateCoordinates();
+
+  // Starts the next frame from black, without anything kept from the frames before
+  void resetRendering();
+
+  template<typename T>
+  T read(const std::atomic<const T *> &published) const {
+    ++readers;
+    T value = *published.load();
+    --readers;
+
+    return value;
+  }
+
+  void writeOutput();
+
+  // Renders the leds from begin up to end with a set of formulas, for a specific case. Chosen for the main formulas
+  // and every zone whenever the formulas or fade change
+  typedef void (LedController::*RenderKernel)(CRGB *target, int t, const FormulaData *formulas, int fade,
+                                              PixelState *state, int begin, int end);
+  RenderKernel kernels[1 + MAX_ZONES] = {}, transition_kernels[1 + MAX_ZONES] = {};
+
+  static RenderKernel selectKernel(bool variable, int fade);
+  void selectKernels();
+
+  // Ranges that don't change over time are only rendered if all is true
+  void render(CRGB *target, int t, bool all = true);
+  void renderSet(CRGB *target, int t, const FormulaSet &set, int fade, bool all);
+  void renderRange(CRGB *target, int t, const FormulaData *formulas, int fade, RenderKernel kernel, bool timed,
+                   PixelState *state, int begin, int end, bool all);
+  void renderConstant(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state, int begin,
+                      int end);
+  void renderUnfaded(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state, int begin,
+                     int end);
+  template<bool shift>
+  void renderFaded(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state, int begin, int end);
+  void renderPalette(CRGB *target, int t, const FormulaData *formulas, int fade, PixelState *state, int begin,
+                     int end);
+  void renderKeyframes();
+
 public:
   LedController();
 
@@ -45,22 +349,71 @@ public:
 
   void init();
   void update();
-  void mark_change(unsigned long current_ms);
-  bool update_timed(unsigned long current_ms);
+  bool update_timed(unsigned long current_ms, int current_tick);
 
+  // Getters and setters can be used from any task
   String getDeviceName() const;
   void setDeviceName(const String &name);
 
   int getBrightness() const;
   int getFade() const;
+  int getKeyframeInterval() const;
+  int getTransitionDuration() const;
+  int getLedCount() const;
+  LedLayout getLayout() const;
+  bool isPaletteMode() const;
+  int getMatrixWidth() const;
+  bool isMatrixSerpentine() const;
+  bool hasCoordinateMap() const;
+  uint32_t getGroups() const;
+  uint32_t getVersion() const;
+  uint32_t getFieldVersion(StateField field) const;
+  // Of the leds as they were last rendered, before the output stage. Only for the render task
+  uint32_t getFrameChecksum() const;
+  // Empty if there's no preset in the slot
+  String getPresetName(int slot) const;
+  // Only for the render task
+  Palette getPalette() const;
 
-  FormulaType getFormulaType(int index);
-  String getFormula(int index);
+  FormulaType getFormulaType(int index) const;
+  String getFormula(int index) const;
+  // Copies, so they stay consistent with each other
+  std::vector<Variable> getVariables() const;
+  std::vector<Zone> getZones() const;
 
   void setBrightness(int value);
   void setFade(int value);
+  void setKeyframeInterval(int value);
+  // In ticks, 0 switches formulas immediately
+  void setTransitionDuration(int value);
+  void setLayout(const LedLayout &value);
+  void setPalette(const Palette &value);
+  void setPaletteMode(bool value);
+  // A width of 0 means the leds aren't a matrix. Replaces an uploaded coordinate map
+  void setMatrix(int width, bool serpentine);
+  // uv contains count pairs of u and v
+  void setCoordinates(int offset, int count, const uint8_t *uv);
+  // Bit n means the controller is in group n
+  void setGroups(uint32_t value);
+
+  // These fail if a formula doesn't parse or uses a variable that isn't defined
+  bool setFormula(int formula_index, FormulaType type, const char *str);
+  // An empty formula removes the variable
+  bool setVariable(char name, FormulaType type, const char *str);
+  // Replaces all zones. Fails if there are too many, or if they overlap
+  bool setZones(std::vector<Zone> zones);
+
+  // Switching to a preset doesn't change the saved config
+  void selectPreset(int slot);
+  // Stores the current formulas, brightness, fade, keyframe interval and palette mode in a slot. Returns false, and
+  // the slot keeps its preset, if the presets wouldn't fit in PRESETS_SIZE anymore
+  bool savePreset(int slot, const String &name);
 
-  void setFormula(int formula_index, FormulaType type, const char *str);
+  // Around replaying a trace, on the render task. Until endReplay() brings back the state from before beginReplay(),
+  // changes aren't saved, presets are only kept in memory, and the layout, matrix and coordinates don't change.
+  // Both start rendering over, so frames don't depend on what was shown before
+  void beginReplay(unsigned long current_ms);
+  void endReplay(unsigned long current_ms);
 };
 
 
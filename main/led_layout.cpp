@@ -0,0 +1,95 @@
+#include <Arduino.h>
+
+#include "includes.h"
+
+#include "led_layout.h"
+
+// FastLED needs the data pin at compile time, so every pin a strip can be connected to needs its own case
+#define STRIP_PINS(X) X(4) X(5) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(21) X(22) X(23) X(25) X(26) X(27) X(32) X(33)
+
+static bool isStripPin(uint8_t pin) {
+  switch (pin) {
+#define X(PIN) case PIN:
+    STRIP_PINS(X)
+#undef X
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void addStrip(uint8_t pin, CRGB *leds, int offset, int count) {
+  switch (pin) {
+#define X(PIN) case PIN: FastLED.addLeds<LED_TYPE, PIN, COLOR_ORDER>(leds, offset, count); break;
+    STRIP_PINS(X)
+#undef X
+    default:
+      Serial.printf("Can't use pin %i for a led strip\n", pin);
+      break;
+  }
+}
+
+LedLayout::LedLayout() : strips(led_strips), strip() {
+  for (int i = 0; i < led_strips; ++i)
+    strip[i] = {(uint8_t) led_pins[i], (uint16_t) led_count[i], led_reversed[i]};
+}
+
+int LedLayout::getLedCount() const {
+  int count = 0;
+  for (int i = 0; i < strips; ++i)
+    count += strip[i].count;
+
+  return count;
+}
+
+bool LedLayout::isValid() const {
+  if (strips < 1 || strips > MAX_STRIPS)
+    return false;
+
+  for (int i = 0; i < strips; ++i) {
+    if (strip[i].count == 0 || !isStripPin(strip[i].pin))
+      return false;
+  }
+  return getLedCount() <= MAX_LEDS;
+}
+
+uint16_t *LedLayout::createMap() const {
+  auto *map = new uint16_t[getLedCount()];
+
+  for (int i = 0, start = 0; i < strips; start += strip[i++].count) {
+    for (int led = 0; led < strip[i].count; ++led)
+      map[start + led] = start + (strip[i].reversed ? strip[i].count - 1 - led : led);
+  }
+  return map;
+}
+
+void LedLayout::addLeds(CRGB *leds) const {
+  for (int i = 0, start = 0; i < strips; start += strip[i++].count)
+    addStrip(strip[i].pin, leds, start, strip[i].count);
+}
+
+bool LedLayout::read(const uint8_t *&packet) {
+  strips = *(packet++);
+
+  for (int i = 0; i < strips && i < MAX_STRIPS; ++i) {
+    strip[i].pin = *(packet++);
+    strip[i].count = *(packet++) << 8;
+    strip[i].count |= *(packet++);
+    strip[i].reversed = *(packet++) != 0;
+  }
+  // The strips that don't fit are skipped, so whatever follows the layout is still read from the right place
+  if (strips > MAX_STRIPS)
+    packet += (strips - MAX_STRIPS) * 4;
+  return isValid();
+}
+
+void LedLayout::write(uint8_t *packet, unsigned int &index) const {
+  packet[index++] = strips;
+
+  for (int i = 0; i < strips; ++i) {
+    packet[index++] = strip[i].pin;
+    packet[index++] = strip[i].count >> 8;
+    packet[index++] = strip[i].count & 0xFF;
+    packet[index++] = strip[i].reversed;
+  }
+}
@@ -0,0 +1,42 @@
+#ifndef LEDS_LED_LAYOUT_H
+#define LEDS_LED_LAYOUT_H
+
+#include <FastLED.h>
+
+#define MAX_STRIPS 4
+#define MAX_LEDS 2048
+
+// Encoded size of a layout in packets and config
+#define LAYOUT_SIZE (1 + MAX_STRIPS * 4)
+
+struct StripConfig {
+  uint8_t pin;
+  uint16_t count;
+  bool reversed;
+};
+
+// How the leds are spread over the strips. All strips are treated as one long strip, in order.
+class LedLayout {
+public:
+  uint8_t strips;
+  StripConfig strip[MAX_STRIPS];
+
+  // The layout specified in includes.h
+  LedLayout();
+
+  int getLedCount() const;
+
+  bool isValid() const;
+
+  // Maps every led index as used by formulas to its index in the led buffer
+  uint16_t *createMap() const;
+
+  // FastLED shows these as they are, color correction is done by the controller
+  void addLeds(CRGB *leds) const;
+
+  bool read(const uint8_t *&packet);
+
+  void write(uint8_t *packet, unsigned int &index) const;
+};
+
+#endif //LEDS_LED_LAYOUT_H
@@ -5,17 +5,24 @@
 
 #include "includes.h"
 #include "led_controller.h"
+#include "frame_scheduler.h"
+#include "power_manager.h"
+#include "memory_stats.h"
+#include "formula_check.h"
 #include "bluetooth_server.h"
 #include "wifi_server.h"
 
 using namespace std;
 
 LedController *controller = new LedController();
+FrameLock frame_lock;
+FrameScheduler scheduler(FRAME_POLICY, &frame_lock);
 #if USE_BLUETOOTH
-  BluetoothServer server(controller);
+  BluetoothServer server(controller, &scheduler);
 #else
-  WifiServer server(controller);
+  WifiServer server(controller, &scheduler);
 #endif
+PowerManager power(&server, &frame_lock);
 
 void setup() {
   pinMode(LED_BUILTIN, OUTPUT);
@@ -25,33 +32,42 @@ void setup() {
 
   delay(50);
 
-  EEPROM.begin(512);
+#ifdef FORMULA_SELF_CHECK
+  checkFormulas(FORMULA_SELF_CHECK, esp_random());
+#endif
+
+  EEPROM.begin(CONFIG_SIZE);
   controller->loadConfig();
 
   // Start server
   server.setup();
+  power.setup();
 
   Serial.println();
 
   controller->init();
+
+  scheduler.start();
 }
 
 void loop() {
   unsigned long current_ms = millis();
 
   server.tick(current_ms);
+  sampleHeap(current_ms);
 
-  if (!controller->update_timed(current_ms) && !server.isActive()) { // If the light is off and there's no active connection, wait longer until further action
-    delay(INACTIVE_PACKET_READ_INTERVAL);
+  // The server renders the ticks of a replay itself, and the leds don't update until it's done
+  if (server.isReplaying())
     return;
-  }
 
-  if ((current_ms = millis() - current_ms) < TICK_DURATION) {
-    delay(TICK_DURATION - current_ms);
-  } else {
-    Serial.printf("Tick too a little long: %lu\n", current_ms);
-    delay(1);
+  bool lights_on = controller->update_timed(current_ms, scheduler.getTick());
+
+  if (power.update(lights_on, server.isActive()) == power_asleep) { // If the light is off and there's no active connection, wait for a packet
+    power.sleep(INACTIVE_PACKET_READ_INTERVAL);
+    return;
   }
 
+  scheduler.wait();
+
   FastLED.show();
 }
@@ -0,0 +1,52 @@
+#include <atomic>
+#include <esp_heap_caps.h>
+
+#include "memory_stats.h"
+
+static std::atomic<uint32_t> used[MEMORY_POOLS], peak[MEMORY_POOLS];
+
+static HeapSample samples[MEMORY_SAMPLES];
+static int sample_count = 0, next_sample = 0;
+static unsigned long sample_time = 0;
+
+void trackMemory(MemoryPool pool, int bytes) {
+  uint32_t now = used[pool].fetch_add(bytes, std::memory_order_relaxed) + bytes;
+
+  uint32_t highest = peak[pool].load(std::memory_order_relaxed);
+  while (now > highest && !peak[pool].compare_exchange_weak(highest, now, std::memory_order_relaxed));
+}
+
+static HeapSample sample() {
+  return {(uint32_t) heap_caps_get_free_size(MALLOC_CAP_8BIT),
+          (uint32_t) heap_caps_get_largest_free_block(MALLOC_CAP_8BIT)};
+}
+
+void sampleHeap(unsigned long current_ms) {
+  if (sample_count > 0 && current_ms - sample_time < MEMORY_SAMPLE_INTERVAL)
+    return;
+
+  sample_time = current_ms;
+  samples[next_sample] = sample();
+  next_sample = (next_sample + 1) % MEMORY_SAMPLES;
+  if (sample_count < MEMORY_SAMPLES)
+    ++sample_count;
+}
+
+MemoryReport getMemoryReport() {
+  MemoryReport report = {};
+  for (int pool = 0; pool < MEMORY_POOLS; ++pool) {
+    report.used[pool] = used[pool].load(std::memory_order_relaxed);
+    report.peak[pool] = peak[pool].load(std::memory_order_relaxed);
+  }
+
+  HeapSample now = sample();
+  report.free_heap = now.free;
+  report.largest_block = now.largest_block;
+  report.min_free_heap = (uint32_t) heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+
+  report.sample_count = sample_count;
+  for (int i = 0; i < sample_count; ++i)
+    report.samples[i] = samples[(next_sample - sample_count + i + MEMORY_SAMPLES) % MEMORY_SAMPLES];
+
+  return report;
+}
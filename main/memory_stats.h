@@ -0,0 +1,36 @@
+#ifndef LEDS_MEMORY_STATS_H
+#define LEDS_MEMORY_STATS_H
+
+#include <cstdint>
+
+// The heap is sampled this often, and the last few samples are kept to show whether it's shrinking or fragmenting
+#define MEMORY_SAMPLE_INTERVAL (60 * 60 * 1000)
+#define MEMORY_SAMPLES 8
+
+enum MemoryPool {
+  memory_formula_trees, // The Form nodes of parsed formulas, not their text or the sets that hold them
+  memory_pixels, // Buffers with an entry per led
+  memory_network, // Packet buffers of the server
+  MEMORY_POOLS
+};
+
+struct HeapSample {
+  uint32_t free, largest_block;
+};
+
+struct MemoryReport {
+  uint32_t used[MEMORY_POOLS], peak[MEMORY_POOLS];
+  uint32_t free_heap, min_free_heap, largest_block;
+  HeapSample samples[MEMORY_SAMPLES]; // Oldest first
+  int sample_count;
+};
+
+// Counts bytes that were allocated (or freed, if negative) for a pool, from any task
+void trackMemory(MemoryPool pool, int bytes);
+
+// Records a sample every MEMORY_SAMPLE_INTERVAL
+void sampleHeap(unsigned long current_ms);
+
+MemoryReport getMemoryReport();
+
+#endif //LEDS_MEMORY_STATS_H
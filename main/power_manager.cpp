@@ -0,0 +1,103 @@
+#include <Arduino.h>
+#include <esp_pm.h>
+
+#include "includes.h"
+#include "led_server.h"
+
+#include "power_manager.h"
+
+#ifdef CONFIG_PM_ENABLE
+static esp_pm_lock_handle_t awake_lock = nullptr;
+#endif
+
+void FrameLock::setup() {
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "frame_cpu", &cpu_lock);
+  esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "frame_sleep", &sleep_lock);
+#endif
+  acquire();
+}
+
+void FrameLock::acquire() {
+  if (held)
+    return;
+
+#ifdef CONFIG_PM_ENABLE
+  if (cpu_lock != nullptr) {
+    esp_pm_lock_acquire(cpu_lock);
+    esp_pm_lock_acquire(sleep_lock);
+  }
+#endif
+  held = true;
+}
+
+void FrameLock::release() {
+  if (!held)
+    return;
+
+#ifdef CONFIG_PM_ENABLE
+  if (cpu_lock != nullptr) {
+    esp_pm_lock_release(sleep_lock);
+    esp_pm_lock_release(cpu_lock);
+  }
+#endif
+  held = false;
+}
+
+bool FrameLock::isHeld() const {
+  return held;
+}
+
+PowerManager::PowerManager(LedServer *server, FrameLock *frame_lock) : server(server), frame_lock(frame_lock) {}
+
+void PowerManager::setup() {
+#ifdef CONFIG_PM_ENABLE
+  // Let the cpu enter light sleep automatically whenever all tasks are waiting, e.g. in delay()
+  esp_pm_config_esp32_t config = {
+          .max_freq_mhz = 240,
+          .min_freq_mhz = 80, // The led strips are driven from the APB clock, which needs at least 80 MHz
+          .light_sleep_enable = true
+  };
+  if (esp_pm_configure(&config) != ESP_OK)
+    Serial.println("Failed to enable light sleep");
+
+  esp_pm_lock_create(ESP_PM_NO_LIGHT_SLEEP, 0, "awake", &awake_lock);
+  esp_pm_lock_acquire(awake_lock);
+#endif
+  frame_lock->setup();
+
+  server->setPowerState(state);
+}
+
+PowerState PowerManager::update(bool lights_on, bool connected) {
+  PowerState next = connected ? power_awake : lights_on ? power_idle : power_asleep;
+
+  if (next != state)
+    enter(next);
+
+  return state;
+}
+
+void PowerManager::enter(PowerState next) {
+  debugf("Power state %i -> %i\n", state, next);
+
+#ifdef CONFIG_PM_ENABLE
+  if (state == power_awake)
+    esp_pm_lock_release(awake_lock);
+  else if (next == power_awake)
+    esp_pm_lock_acquire(awake_lock);
+#endif
+
+  state = next;
+  server->setPowerState(state);
+}
+
+void PowerManager::sleep(unsigned long timeout_ms) {
+  frame_lock->release();
+  server->waitForPacket(timeout_ms);
+  frame_lock->acquire();
+}
+
+PowerState PowerManager::getState() const {
+  return state;
+}
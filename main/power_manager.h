@@ -0,0 +1,55 @@
+#ifndef LEDS_POWER_MANAGER_H
+#define LEDS_POWER_MANAGER_H
+
+#include <esp_pm.h>
+
+enum PowerState {
+  power_awake,  // A client is connected, respond as fast as possible
+  power_idle,   // Nobody's connected but the leds are on, sleep between ticks
+  power_asleep  // Nobody's connected and the leds are off, only check for packets every INACTIVE_PACKET_READ_INTERVAL
+};
+
+class LedServer;
+
+// Keeps the cpu at its full clock and out of light sleep from the start of a frame until it has been shown, so
+// rendering isn't slowed down and show() isn't interrupted. Only released while waiting for the next frame or a packet
+class FrameLock {
+private:
+#ifdef CONFIG_PM_ENABLE
+  esp_pm_lock_handle_t cpu_lock = nullptr, sleep_lock = nullptr;
+#endif
+  bool held = false;
+
+public:
+  // Creates the locks and acquires them
+  void setup();
+
+  void acquire();
+
+  void release();
+
+  bool isHeld() const;
+};
+
+class PowerManager {
+private:
+  LedServer *server;
+  FrameLock *frame_lock;
+  PowerState state = power_awake;
+
+  void enter(PowerState next);
+
+public:
+  PowerManager(LedServer *server, FrameLock *frame_lock);
+
+  void setup();
+
+  PowerState update(bool lights_on, bool connected);
+
+  // Waits up to timeout_ms for a packet while asleep, with the frame lock released
+  void sleep(unsigned long timeout_ms);
+
+  PowerState getState() const;
+};
+
+#endif //LEDS_POWER_MANAGER_H
@@ -0,0 +1,95 @@
+#include <cstring>
+
+#include "ble_framing.h"
+
+void ChunkWriter::begin(const uint8_t *packet, unsigned int packetLength) {
+  data = packet;
+  length = packetLength;
+  index = 0;
+}
+
+bool ChunkWriter::hasNext() const {
+  return data != nullptr;
+}
+
+unsigned int ChunkWriter::next(uint8_t *chunk, unsigned int chunkSize) {
+  if (data == nullptr) { // Everything has been written already
+    chunk[0] = CHUNK_END;
+    return 1;
+  }
+
+  unsigned int count = chunkSize - 1;
+
+  if (index + count >= length) {
+    count = length - index;
+    chunk[0] = CHUNK_END;
+  } else {
+    chunk[0] = CHUNK_MORE;
+  }
+  memcpy(chunk + 1, data + index, count);
+
+  if ((index += count) >= length)
+    data = nullptr;
+
+  return count + 1;
+}
+
+bool ChunkReader::read(const uint8_t *chunk, unsigned int chunkLength, BlePacket &packet) {
+  if (chunkLength == 0)
+    return false;
+
+  uint8_t indicator = *(chunk++);
+  --chunkLength;
+
+  switch (indicator) {
+    case CHUNK_SINGLE:
+    case CHUNK_START:
+      if (reading) // The previous packet never ended
+        ++dropped;
+
+      reading = true;
+      overflow = false;
+      packet.length = 0;
+      break;
+
+    case CHUNK_CONTINUE:
+    case CHUNK_LAST:
+      if (!reading) // We missed the start of this packet
+        return false;
+      break;
+
+    default:
+      return false;
+  }
+
+  if (packet.length + chunkLength > BLE_PACKET_SIZE) {
+    overflow = true;
+  } else if (!overflow) {
+    memcpy(packet.data + packet.length, chunk, chunkLength);
+    packet.length += chunkLength;
+  }
+
+  if (indicator == CHUNK_SINGLE || indicator == CHUNK_LAST) {
+    reading = false;
+
+    if (overflow) {
+      ++dropped;
+      return false;
+    }
+
+    packet.data[packet.length] = 0;
+    return true;
+  }
+  return false;
+}
+
+void ChunkReader::reset() {
+  if (reading)
+    ++dropped;
+
+  reading = false;
+}
+
+unsigned long ChunkReader::getDroppedPackets() const {
+  return dropped;
+}
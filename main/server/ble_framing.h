@@ -0,0 +1,54 @@
+#ifndef LEDS_BLE_FRAMING_H
+#define LEDS_BLE_FRAMING_H
+
+#include <cstdint>
+
+// Indicator bytes that prefix every chunk sent to a client
+#define CHUNK_END 0
+#define CHUNK_MORE 1
+
+// Indicator bytes that prefix every chunk received from a client
+#define CHUNK_SINGLE 0
+#define CHUNK_START 1
+#define CHUNK_CONTINUE 2
+#define CHUNK_LAST 3
+
+#define BLE_PACKET_SIZE 1024
+
+struct BlePacket {
+  unsigned int length;
+  uint8_t data[BLE_PACKET_SIZE + 1]; // Always 0-terminated, so strings in a malformed packet can't run off the end
+};
+
+// Splits a packet into chunks that each fit in a single characteristic value
+class ChunkWriter {
+private:
+  const uint8_t *data = nullptr;
+  unsigned int length = 0, index = 0;
+
+public:
+  void begin(const uint8_t *packet, unsigned int packetLength);
+
+  bool hasNext() const;
+
+  // Writes the indicator byte and as much data as fits in chunkSize to chunk, and returns the chunk's length
+  unsigned int next(uint8_t *chunk, unsigned int chunkSize);
+};
+
+// Reassembles chunks received from a client into a packet, dropping packets that don't fit
+class ChunkReader {
+private:
+  bool reading = false, overflow = false;
+  unsigned long dropped = 0;
+
+public:
+  // Appends a chunk to packet, returns true once packet contains a complete packet
+  bool read(const uint8_t *chunk, unsigned int chunkLength, BlePacket &packet);
+
+  // Discards the packet that is being read
+  void reset();
+
+  unsigned long getDroppedPackets() const;
+};
+
+#endif //LEDS_BLE_FRAMING_H
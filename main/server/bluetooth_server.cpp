@@ -6,13 +6,17 @@
 #include "bluetooth_server.h"
 
 
-BluetoothServer::BluetoothServer(LedController *controller) : LedServer(controller), readBuffer(), writeBuffer() {}
+BluetoothServer::BluetoothServer(LedController *controller, const FrameScheduler *scheduler) :
+  LedServer(controller, scheduler), writeBuffer() {
+  trackMemory(memory_network, sizeof(writeBuffer) + sizeof(notifyBuffer) + sizeof(packets));
+}
 
 void BluetoothServer::setup() {
   Serial.println("Setting up BLE");
 
   // Create the BLE Device
   BLEDevice::init(controller->getDeviceName().c_str());
+  BLEDevice::setMTU(BLE_MAX_MTU);
 
   // Create the BLE Server
   pServer = BLEDevice::createServer();
@@ -26,6 +30,7 @@ void BluetoothServer::setup() {
           CHARACTERISTIC_UUID,
           BLECharacteristic::PROPERTY_READ   |
           BLECharacteristic::PROPERTY_WRITE  |
+          BLECharacteristic::PROPERTY_WRITE_NR |
           BLECharacteristic::PROPERTY_NOTIFY |
           BLECharacteristic::PROPERTY_INDICATE
   );
@@ -61,91 +66,149 @@ void BluetoothServer::onConnect(BLEServer *server) {
 
 void BluetoothServer::onDisconnect(BLEServer *server) {
   deviceConnected = false;
+  payloadSize = BLE_MTU;
 }
 
-void BluetoothServer::updateValue(bool askForMore) {
-  // Update info characteristic
-  unsigned int packetLen = 0;
+void BluetoothServer::onMtuChanged(BLEServer *server, esp_ble_gatts_cb_param_t *param) {
+  payloadSize = min(param->mtu.mtu, (uint16_t) BLE_MAX_MTU) - 3;
+
+  debugf("MTU changed to %i\n", param->mtu.mtu);
+}
 
-  writePacket(writeBuffer, packetLen, false); // Don't write name
+void BluetoothServer::updateValue() {
+  writeBufferLength = 0;
+  writeBuffer[writeBufferLength++] = 8;
+  subscribed_version = writeChanges(writeBuffer, writeBufferLength, sizeof(writeBuffer), subscribed_version);
 
-  pCharacteristic->setValue(writeBuffer, packetLen);
-  pCharacteristic->notify();
+  notifyWriteBuffer();
 }
 
 void BluetoothServer::onWrite(BLECharacteristic* characteristic) {
-  const uint8_t *packet = characteristic->getData();
-
-  // Packet can be split up
-  uint8_t dataIndicator = *(packet++);
-  bool endOfData = false;
-
-  switch (dataIndicator) {
-    case 0: // Single packet, so start and end of data
-      endOfData = true;
-      // fall-through
-
-    case 1: // Start of data, but more is to come
-      readBufferIndex = 0;
-      // fall-through
-
-    case 2: // More data is to come
-      memcpy(readBuffer + readBufferIndex, packet, characteristic->getLength() - 1);
-      readBufferIndex += characteristic->getLength() - 1;
-      break;
-
-    case 3: // End of data
-      memcpy(readBuffer + readBufferIndex, packet, characteristic->getLength() - 1);
-      endOfData = true;
-      break;
-
-    default:
-      // Undefined
-      return;
+  // Called on the BLE task, so only assemble the packet here and leave handling it to tick()
+  BlePacket *packet = packets.acquire();
+
+  if (packet == nullptr) { // The main loop can't keep up
+    chunkReader.reset();
+    return;
   }
 
-  if (endOfData) {
-    packet = readBuffer;
-    readBufferIndex = 0;
+  if (chunkReader.read(characteristic->getData(), characteristic->getLength(), *packet))
+    packets.publish();
+}
 
-    uint8_t flags = handlePacket(packet, millis());
+void BluetoothServer::handleBlePacket(const BlePacket &blePacket, unsigned long current_ms) {
+  const uint8_t *packet = blePacket.data;
 
-    if (flags == 0) { // If flags == 0, we're retrieving values
-      switch (*(packet++)) {
-        case 0: // Start of read
-          // We need to send packet in chunks of size BLE_MTU
-          writeBufferLength = 0;
-          writePacket(writeBuffer, writeBufferLength, false); // Don't write name
+  // After a 0 flag byte comes a request, which has the ID of the same packet over Wi-Fi, except that 1 asks for the
+  // rest of a status reply
+  if (packet[0] != 0)
+    recordPacket(1, packet, blePacket.length);
+  else if (blePacket.length >= 2 && packet[1] != 1)
+    recordPacket(packet[1], packet + 2, blePacket.length - 2);
+
+  uint8_t flags = handlePacket(packet, current_ms);
+
+  if (flags == 0) { // If flags == 0, we're retrieving values
+    uint8_t request = *(packet++);
 
-          writeBufferIndex = 0;
-          notifyBuffer[0] = 1; // Indicate that there's more data
-          // Fall-through
+    switch (request) {
+      case 0: // Start of read
+        // We need to send packet in chunks of size BLE_MTU
+        writeBufferLength = 0;
+        writePacket(writeBuffer, writeBufferLength, sizeof(writeBuffer), false); // Don't write name
 
-        case 1: { // More to read
-          unsigned int length = BLE_MTU - 1;
+        chunkWriter.begin(writeBuffer, writeBufferLength);
+        // Fall-through
 
-          if (writeBufferIndex + length >= writeBufferLength) {
-            length = writeBufferLength - writeBufferIndex;
-            notifyBuffer[0] = 0; // Indicate end of data
-          }
-          memcpy(notifyBuffer + 1, writeBuffer + writeBufferIndex, length); // Copy packet info to notify buffer
-          pCharacteristic->setValue(notifyBuffer, length + 1);
-          pCharacteristic->notify();
+      case 1: // More to read
+        pCharacteristic->setValue(notifyBuffer, chunkWriter.next(notifyBuffer, BLE_MTU));
+        pCharacteristic->notify();
 
-          writeBufferIndex += length;
+        break;
 
-          break;
+      case 2: // Read everything at once
+        writeBufferLength = 0;
+        writePacket(writeBuffer, writeBufferLength, sizeof(writeBuffer), false); // Don't write name
+        notifyWriteBuffer();
+
+        break;
+
+      case 3: // Palette upload
+        if (blePacket.length >= 2 + 256 * 3)
+          handlePalettePacket(packet);
+
+        break;
+
+      case 4: // Select preset
+      case 5: // Save preset
+        if (!handlePresetPacket(request, packet)) { // Not saved
+          writeBufferLength = 0;
+          writeBuffer[writeBufferLength++] = 0;
+          notifyWriteBuffer();
         }
-      }
+
+        break;
+
+      case 6: // List presets
+        writeBufferLength = 0;
+        writePresets(writeBuffer, writeBufferLength);
+        notifyWriteBuffer();
+
+        break;
+
+      case 7: // Coordinate map upload
+        handleCoordinatesPacket(packet, blePacket.length - 2);
+        break;
+
+      case 8: // Subscribe to changes
+        subscribed = true;
+        subscribed_version = 0;
+        if (blePacket.length >= 6)
+          subscribed_version = (uint32_t) packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3];
+        updateValue();
+
+        break;
+
+      case 11: // Trace
+        writeBufferLength = 0;
+        if (handleTracePacket(packet, writeBuffer, writeBufferLength, sizeof(writeBuffer), current_ms))
+          notifyWriteBuffer();
+
+        break;
+
+      case 13: // Memory
+        writeBufferLength = 0;
+        writeMemory(writeBuffer, writeBufferLength);
+        notifyWriteBuffer();
+
+        break;
     }
   }
 }
 
+void BluetoothServer::notifyWriteBuffer() {
+  chunkWriter.begin(writeBuffer, writeBufferLength);
+  do {
+    pCharacteristic->setValue(notifyBuffer, chunkWriter.next(notifyBuffer, payloadSize));
+    pCharacteristic->notify();
+  } while (chunkWriter.hasNext());
+}
+
 bool BluetoothServer::isOnline() const {
   return online;
 }
 
 void BluetoothServer::tick(unsigned long current_ms) {
+  if (isReplaying()) {
+    writeBufferLength = 0;
+    if (continueReplay(writeBuffer, writeBufferLength, sizeof(writeBuffer), current_ms))
+      notifyWriteBuffer();
+    return;
+  }
+
+  for (BlePacket *packet; (packet = packets.front()) != nullptr; packets.pop())
+    handleBlePacket(*packet, current_ms);
+
   // disconnecting
   if (justDisconnected && (current_ms - disconnectTime) > 500) {
     justDisconnected = false;
@@ -163,6 +226,7 @@ void BluetoothServer::tick(unsigned long current_ms) {
       disconnectTime = current_ms;
 
       has_connection = false;
+      subscribed = false;
     }
   }
 
@@ -173,6 +237,9 @@ void BluetoothServer::tick(unsigned long current_ms) {
     oldDeviceConnected = deviceConnected;
     has_connection = true;
   }
+
+  if (subscribed && deviceConnected && subscribed_version != controller->getVersion())
+    updateValue();
 }
 
 bool BluetoothServer::isActive() {
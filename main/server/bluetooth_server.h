@@ -3,6 +3,8 @@
 #define LEDS_BLUETOOTH_SERVER_H
 
 #include "led_server.h"
+#include "ble_framing.h"
+#include "spsc_queue.h"
 
 #include <BLEDevice.h>
 #include <BLEUtils.h>
@@ -13,16 +15,29 @@
 #define SERVICE_UUID        "5bf556f6-321a-4584-b473-5fda5bbfbc15"
 #define CHARACTERISTIC_UUID "15246ab5-d6b0-4539-9cd1-88676c9e7e7a"
 
+// Default MTU minus the 3-byte ATT header, used until a larger MTU has been negotiated
 #define BLE_MTU 20
+#define BLE_MAX_MTU 512
+
+// Number of received packets that can wait for the main loop
+#define BLE_PACKET_QUEUE_SIZE 4
 
 class BluetoothServer : public LedServer, public BLEServerCallbacks, public BLECharacteristicCallbacks {
 private:
   bool online = false;
 
-  unsigned char readBuffer[1024], writeBuffer[1024], notifyBuffer[BLE_MTU];
+  unsigned char writeBuffer[1024], notifyBuffer[BLE_MAX_MTU];
   unsigned long last_read_time = 0, activity_time = 0;
 
-  unsigned int readBufferIndex = 0, writeBufferIndex = 0, writeBufferLength = 0;
+  unsigned int writeBufferLength = 0;
+  ChunkWriter chunkWriter;
+
+  // Packets are assembled on the BLE task and handled on the main loop's
+  ChunkReader chunkReader;
+  SpscQueue<BlePacket, BLE_PACKET_QUEUE_SIZE> packets;
+
+  // Usable bytes per characteristic value, as negotiated with the client
+  unsigned int payloadSize = BLE_MTU;
 
   bool has_connection = false;
 
@@ -34,15 +49,26 @@ private:
   unsigned long disconnectTime = 0;
   uint32_t value = 0;
 
-  void updateValue(bool askForMore);
+  // Whether the client wants to be notified of changes, and the last version it was sent
+  bool subscribed = false;
+  uint32_t subscribed_version = 0;
+
+  // Notifies the client of what changed since subscribed_version
+  void updateValue();
+
+  void handleBlePacket(const BlePacket &blePacket, unsigned long current_ms);
+
+  // Notifies the whole write buffer in chunks as large as the negotiated MTU allows
+  void notifyWriteBuffer();
 
 public:
-  explicit BluetoothServer(LedController *controller);
+  BluetoothServer(LedController *controller, const FrameScheduler *scheduler);
 
   void setup() override;
 
   void onConnect(BLEServer* pServer) override;
   void onDisconnect(BLEServer* pServer) override;
+  void onMtuChanged(BLEServer* pServer, esp_ble_gatts_cb_param_t* param) override;
   void onWrite(BLECharacteristic* pCharacteristic) override;
 
   bool isOnline() const override;
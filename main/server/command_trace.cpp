@@ -0,0 +1,49 @@
+#include <Arduino.h>
+
+#include "includes.h"
+
+#include "command_trace.h"
+
+CommandTrace::CommandTrace() : buffer() {}
+
+void CommandTrace::begin() {
+  length = 0;
+  recording = true;
+}
+
+void CommandTrace::stop() {
+  recording = false;
+}
+
+bool CommandTrace::isRecording() const {
+  return recording;
+}
+
+void CommandTrace::record(int tick, uint8_t id, const uint8_t *packet, unsigned int packetLength) {
+  unsigned int entryLength = 7 + packetLength;
+  if (!recording)
+    return;
+
+  if (TRACE_SIZE - length < entryLength) {
+    debugln("Trace full, recording stopped");
+    recording = false;
+    return;
+  }
+
+  for (int shift = 24; shift >= 0; shift -= 8)
+    buffer[length++] = (tick >> shift) & 0xFF;
+  buffer[length++] = packetLength >> 8;
+  buffer[length++] = packetLength & 0xFF;
+  buffer[length++] = id;
+  memcpy(buffer + length, packet, packetLength);
+  length += packetLength;
+}
+
+unsigned int CommandTrace::size() const {
+  return length;
+}
+
+void CommandTrace::read(unsigned int offset, uint8_t *target, unsigned int count) const {
+  if (offset < length)
+    memcpy(target, buffer + offset, min(count, length - offset));
+}
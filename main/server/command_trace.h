@@ -0,0 +1,38 @@
+#ifndef LEDS_COMMAND_TRACE_H
+#define LEDS_COMMAND_TRACE_H
+
+#include <cstdint>
+
+// Bytes reserved for recording packets, the longest a replay waits between two of them, and the number of ticks it
+// renders per loop iteration
+#define TRACE_SIZE 4096
+#define TRACE_MAX_GAP 100
+#define TRACE_REPLAY_TICKS 4
+
+// Packets that change the state, with the tick they were handled in. Every entry is the tick (4 bytes), the length
+// of the packet after its id (2 bytes), the packet id and the rest of the packet. The first entries hold the state
+// from when recording started, which the rest only make sense after, so once the buffer is full recording stops
+class CommandTrace {
+private:
+  uint8_t buffer[TRACE_SIZE];
+  unsigned int length = 0;
+  bool recording = false;
+
+public:
+  CommandTrace();
+
+  // Clears what was recorded before
+  void begin();
+  void stop();
+  bool isRecording() const;
+
+  void record(int tick, uint8_t id, const uint8_t *packet, unsigned int packetLength);
+
+  // In bytes
+  unsigned int size() const;
+
+  // Copies count bytes starting offset bytes after the first entry
+  void read(unsigned int offset, uint8_t *target, unsigned int count) const;
+};
+
+#endif //LEDS_COMMAND_TRACE_H
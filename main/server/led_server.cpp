@@ -1,14 +1,44 @@
 
+#include <vector>
+
 #include "led_server.h"
 #include "util.h"
 
+// As 4 bytes, big endian
+static void writeInt(uint8_t *packet, unsigned int &index, uint32_t value) {
+  for (int shift = 24; shift >= 0; shift -= 8)
+    packet[index++] = (value >> shift) & 0xFF;
+}
+
+static int readTick(const uint8_t *entry) {
+  return (int) ((uint32_t) entry[0] << 24 | entry[1] << 16 | entry[2] << 8 | entry[3]);
+}
+
+// Bytes of a status reply after its formulas, with the variables and zones left out
+#define STATUS_TAIL_SIZE (13 + LAYOUT_SIZE)
+
+static bool fits(unsigned int index, unsigned int size, unsigned int maxLength) {
+  return index + size <= maxLength;
+}
+
+// Encoded, which is the same in status replies and update packets
+static unsigned int zoneSize(const Zone &zone) {
+  unsigned int size = 6;
+  for (const FormulaData &data : zone.formulas)
+    size += 2 + data.toString().length();
+  return size;
+}
+
 
 uint8_t LedServer::handlePacket(const uint8_t *&packet, unsigned long current_ms) {
-  uint8_t flags = *(packet++);
+  uint8_t flags = *(packet++), extendedFlags = 0;
 
-  if (!(flags & 0b111111)) { // Nothing has changed
+  if (flags == 0) { // Nothing has changed
     return flags;
   }
+  if (flags & 128) { // More flags than fit in a byte
+    extendedFlags = *(packet++);
+  }
 
   debugf("Updating leds, flags: %x\n", flags);
 
@@ -27,33 +57,495 @@ uint8_t LedServer::handlePacket(const uint8_t *&packet, unsigned long current_ms
     controller->setFade(fade);
   }
 
+  // Set after the variables, which they can use
+  FormulaType formula_types[3];
+  String formula_texts[3];
   for (int i = 0; i < 3; ++i) {
     if (flags & (8 << i)) {
+      formula_types[i] = *(packet++) ? double_formula : int_formula;
+      formula_texts[i] = readString(packet);
+    }
+  }
+  if (flags & 64) {
+    controller->setKeyframeInterval(max(1, (int) *(packet++)));
+  }
+
+  if (extendedFlags & 1) {
+    LedLayout layout;
+    if (layout.read(packet))
+      controller->setLayout(layout);
+  }
+  if (extendedFlags & 2) {
+    controller->setPaletteMode(*(packet++) != 0);
+  }
+  if (extendedFlags & 4) {
+    int duration = *(packet++) << 8;
+    controller->setTransitionDuration(duration | *(packet++));
+  }
+  if (extendedFlags & 8) {
+    for (int count = *(packet++); count > 0; --count) {
+      char name = (char) *(packet++);
       FormulaType type = *(packet++) ? double_formula : int_formula;
-      controller->setFormula(i, type, readString(packet).c_str());
+      controller->setVariable(name, type, readString(packet).c_str());
     }
   }
+  for (int i = 0; i < 3; ++i) {
+    if (flags & (8 << i))
+      controller->setFormula(i, formula_types[i], formula_texts[i].c_str());
+  }
+  if (extendedFlags & 16) {
+    uint8_t width = *(packet++);
+    controller->setMatrix(width, *(packet++) != 0);
+  }
+  if (extendedFlags & 32) {
+    uint32_t groups = 0;
+    for (int i = 0; i < 4; ++i)
+      groups = groups << 8 | *(packet++);
+    controller->setGroups(groups);
+  }
+  if (extendedFlags & 64) { // All zones at once, so they can be moved around without overlapping in between
+    uint8_t count = *(packet++);
+    if (count > MAX_ZONES) // It's the last section, so nothing after it is lost
+      return flags;
 
-  if (flags != 0) {
-    controller->mark_change(current_ms);
+    std::vector<Zone> zones(count);
+    bool valid = true;
+    for (Zone &zone : zones) {
+      for (uint16_t *value : {&zone.start, &zone.count, &zone.fade}) {
+        *value = *(packet++) << 8;
+        *value |= *(packet++);
+      }
+      for (FormulaData &data : zone.formulas) {
+        FormulaType type = *(packet++) ? double_formula : int_formula;
+        valid &= parseFormulaData(type, readString(packet).c_str(), data);
+      }
+      zone.updateFlags();
+    }
+    if (valid)
+      controller->setZones(zones);
   }
 
   return flags;
 }
 
-void LedServer::writePacket(uint8_t *packet, unsigned int &index, bool withName) {
+void LedServer::writePacket(uint8_t *packet, unsigned int &index, unsigned int maxLength, bool withName) {
   int fade = controller->getFade();
 
   if (withName) {
     writeString(packet, index, controller->getDeviceName());
   }
-  packet[index++] = NUM_LEDS >> 8;
-  packet[index++] = NUM_LEDS & 0xFF;
+  packet[index++] = controller->getLedCount() >> 8;
+  packet[index++] = controller->getLedCount() & 0xFF;
   packet[index++] = controller->getBrightness();
   packet[index++] = fade >> 8;
   packet[index++] = fade & 0xFF;
+
+  // Every field has its place, so formulas that don't fit are sent empty and lists are cut short, leaving room for
+  // the fields after them
   for (int form_index = 0; form_index < 3; ++form_index) {
+    String formula = controller->getFormula(form_index);
+    unsigned int rest = (2 - form_index) * 2 + STATUS_TAIL_SIZE;
+    if (!fits(index, 2 + formula.length() + rest, maxLength))
+      formula = "";
+
     packet[index++] = (uint8_t) controller->getFormulaType(form_index);
-    writeString(packet, index, controller->getFormula(form_index));
+    writeString(packet, index, formula);
+  }
+  packet[index++] = controller->getKeyframeInterval();
+  controller->getLayout().write(packet, index);
+  packet[index++] = controller->isPaletteMode();
+  packet[index++] = controller->getTransitionDuration() >> 8;
+  packet[index++] = controller->getTransitionDuration() & 0xFF;
+
+  unsigned int count = index++;
+  packet[count] = 0;
+  for (const Variable &variable : controller->getVariables()) {
+    String formula = variable.formula.toString();
+    if (!fits(index, 3 + formula.length() + 8, maxLength))
+      break;
+
+    packet[index++] = variable.name;
+    packet[index++] = (uint8_t) variable.formula.type;
+    writeString(packet, index, formula);
+    ++packet[count];
+  }
+  packet[index++] = controller->getMatrixWidth();
+  packet[index++] = controller->isMatrixSerpentine();
+  packet[index++] = controller->hasCoordinateMap();
+  writeInt(packet, index, controller->getGroups());
+
+  count = index++;
+  packet[count] = 0;
+  for (const Zone &zone : controller->getZones()) {
+    if (!fits(index, zoneSize(zone), maxLength))
+      break;
+
+    for (uint16_t value : {zone.start, zone.count, zone.fade}) {
+      packet[index++] = value >> 8;
+      packet[index++] = value & 0xFF;
+    }
+    for (const FormulaData &data : zone.formulas) {
+      packet[index++] = (uint8_t) data.type;
+      writeString(packet, index, data.toString());
+    }
+    ++packet[count];
+  }
+}
+
+
+static void writeTerminatedString(uint8_t *packet, unsigned int &index, const String &str) {
+  memcpy(packet + index, str.c_str(), str.length() + 1);
+  index += str.length() + 1;
+}
+
+void LedServer::writeDescriptor(uint8_t *packet, unsigned int &index, int load) {
+  uint32_t version = controller->getVersion();
+
+  writeString(packet, index, controller->getDeviceName());
+  packet[index++] = controller->getLedCount() >> 8;
+  packet[index++] = controller->getLedCount() & 0xFF;
+  packet[index++] = FIRMWARE_VERSION;
+  packet[index++] = version >> 24;
+  packet[index++] = (version >> 16) & 0xFF;
+  packet[index++] = (version >> 8) & 0xFF;
+  packet[index++] = version & 0xFF;
+  packet[index++] = min(load, 255);
+}
+
+void LedServer::writeMemory(uint8_t *packet, unsigned int &index) {
+  MemoryReport report = getMemoryReport();
+
+  for (int pool = 0; pool < MEMORY_POOLS; ++pool) {
+    writeInt(packet, index, report.used[pool]);
+    writeInt(packet, index, report.peak[pool]);
+  }
+  writeInt(packet, index, report.free_heap);
+  writeInt(packet, index, report.min_free_heap);
+  writeInt(packet, index, report.largest_block);
+
+  packet[index++] = report.sample_count;
+  for (int i = 0; i < report.sample_count; ++i) {
+    writeInt(packet, index, report.samples[i].free);
+    writeInt(packet, index, report.samples[i].largest_block);
+  }
+}
+
+uint32_t LedServer::writeChanges(uint8_t *packet, unsigned int &index, unsigned int maxLength, uint32_t since) {
+  uint32_t version = controller->getVersion();
+  if (since > version) // The controller restarted since the client last heard from it
+    since = 0;
+
+  packet[index++] = version >> 24;
+  packet[index++] = (version >> 16) & 0xFF;
+  packet[index++] = (version >> 8) & 0xFF;
+  packet[index++] = version & 0xFF;
+
+  unsigned int changes = 0;
+  for (int field = 0; field < STATE_FIELDS; ++field) {
+    if (since == 0 || controller->getFieldVersion((StateField) field) > since)
+      changes |= 1 << field;
+  }
+
+  // Bit 7 of the first flag byte means there's a second one. The flags are written once it's known what fits
+  unsigned int flagIndex = index;
+  bool extended = changes >> 7 != 0;
+  index += extended ? 2 : 1;
+
+  // Sections that don't fit are left out, and their flags cleared
+  auto fitsField = [&](StateField field, unsigned int size) {
+    if (!(changes & (1 << field)))
+      return false;
+    if (fits(index, size, maxLength))
+      return true;
+
+    debugf("Field %i doesn't fit in the update packet\n", field);
+    changes &= ~(1 << field);
+    return false;
+  };
+
+  String name = controller->getDeviceName();
+  if (fitsField(field_name, name.length() + 1))
+    writeTerminatedString(packet, index, name);
+  if (fitsField(field_brightness, 1))
+    packet[index++] = controller->getBrightness();
+  if (fitsField(field_fade, 2)) {
+    packet[index++] = controller->getFade() >> 8;
+    packet[index++] = controller->getFade() & 0xFF;
+  }
+  for (int form_index = 0; form_index < 3; ++form_index) {
+    String formula = controller->getFormula(form_index);
+    if (fitsField((StateField) (field_hue + form_index), 2 + formula.length())) {
+      packet[index++] = (uint8_t) controller->getFormulaType(form_index);
+      writeTerminatedString(packet, index, formula);
+    }
+  }
+  if (fitsField(field_keyframe_interval, 1))
+    packet[index++] = controller->getKeyframeInterval();
+  if (fitsField(field_layout, LAYOUT_SIZE))
+    controller->getLayout().write(packet, index);
+  if (fitsField(field_palette_mode, 1))
+    packet[index++] = controller->isPaletteMode();
+  if (fitsField(field_transition, 2)) {
+    packet[index++] = controller->getTransitionDuration() >> 8;
+    packet[index++] = controller->getTransitionDuration() & 0xFF;
+  }
+  if (changes & (1 << field_variables)) { // All of them, replacing the ones the client knows
+    std::vector<Variable> variables = controller->getVariables();
+    std::vector<String> formulas;
+    unsigned int size = 1;
+    for (const Variable &variable : variables) {
+      formulas.push_back(variable.formula.toString());
+      size += 3 + formulas.back().length();
+    }
+
+    if (fitsField(field_variables, size)) {
+      packet[index++] = variables.size();
+      for (size_t i = 0; i < variables.size(); ++i) {
+        packet[index++] = variables[i].name;
+        packet[index++] = (uint8_t) variables[i].formula.type;
+        writeTerminatedString(packet, index, formulas[i]);
+      }
+    }
+  }
+  if (fitsField(field_matrix, 2)) {
+    packet[index++] = controller->getMatrixWidth();
+    packet[index++] = controller->isMatrixSerpentine();
+  }
+  if (fitsField(field_groups, 4))
+    writeInt(packet, index, controller->getGroups());
+  if (changes & (1 << field_zones)) {
+    std::vector<Zone> zones = controller->getZones();
+    unsigned int size = 1;
+    for (const Zone &zone : zones)
+      size += zoneSize(zone);
+
+    if (fitsField(field_zones, size)) {
+      packet[index++] = zones.size();
+      for (const Zone &zone : zones) {
+        for (uint16_t value : {zone.start, zone.count, zone.fade}) {
+          packet[index++] = value >> 8;
+          packet[index++] = value & 0xFF;
+        }
+        for (const FormulaData &data : zone.formulas) {
+          packet[index++] = (uint8_t) data.type;
+          writeTerminatedString(packet, index, data.toString());
+        }
+      }
+    }
+  }
+
+  packet[flagIndex] = (changes & 0x7F) | (extended ? 128 : 0);
+  if (extended)
+    packet[flagIndex + 1] = changes >> 7;
+
+  return version;
+}
+
+void LedServer::handlePalettePacket(const uint8_t *&packet) {
+  Palette palette;
+  for (CRGB &color : palette.colors) {
+    color.r = *(packet++);
+    color.g = *(packet++);
+    color.b = *(packet++);
+  }
+  controller->setPalette(palette);
+}
+
+bool LedServer::handlePresetPacket(uint8_t id, const uint8_t *&packet) {
+  uint8_t slot = *(packet++);
+  if (slot >= PRESET_SLOTS)
+    return true;
+
+  if (id == 5)
+    return controller->savePreset(slot, readString(packet));
+
+  controller->selectPreset(slot);
+  return true;
+}
+
+void LedServer::writePresets(uint8_t *packet, unsigned int &index) {
+  packet[index++] = PRESET_SLOTS;
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot)
+    writeString(packet, index, controller->getPresetName(slot));
+}
+
+void LedServer::handleCoordinatesPacket(const uint8_t *&packet, unsigned int length) {
+  if (length < 4)
+    return;
+
+  int offset = *(packet++) << 8;
+  offset |= *(packet++);
+  int count = *(packet++) << 8;
+  count |= *(packet++);
+  if (length < 4 + count * 2u)
+    return;
+
+  controller->setCoordinates(offset, count, packet);
+  packet += count * 2;
+}
+
+void LedServer::recordPacket(uint8_t id, const uint8_t *packet, unsigned int length) {
+  // The other packets only read the state, or control the trace
+  if (id == 1 || id == 3 || id == 4 || id == 5 || id == 7)
+    trace.record(scheduler->getTick(), id, packet, length);
+}
+
+void LedServer::recordState() {
+  std::vector<uint8_t> state(TRACE_SIZE);
+  unsigned int length = 0;
+  writeChanges(state.data(), length, state.size(), 0);
+  trace.record(scheduler->getTick(), 1, state.data() + 4, length - 4); // Without the version
+
+  Palette palette = controller->getPalette();
+  length = 0;
+  for (const CRGB &color : palette.colors) {
+    state[length++] = color.r;
+    state[length++] = color.g;
+    state[length++] = color.b;
+  }
+  trace.record(scheduler->getTick(), 3, state.data(), length);
+}
+
+bool LedServer::handleTracePacket(const uint8_t *&packet, uint8_t *reply, unsigned int &index, unsigned int maxLength,
+                                  unsigned long current_ms) {
+  switch (*(packet++)) {
+    default:
+      return false;
+
+    case 0:
+      trace.begin();
+      recordState();
+      return false;
+
+    case 1:
+      trace.stop();
+      return false;
+
+    case 2: { // Download from an offset: the size of the trace, the offset, and as much of it as fits
+      unsigned int offset = *(packet++) << 8;
+      offset = min(offset | *(packet++), trace.size());
+      unsigned int count = min(trace.size() - offset, maxLength - index - 4);
+
+      reply[index++] = trace.size() >> 8;
+      reply[index++] = trace.size() & 0xFF;
+      reply[index++] = offset >> 8;
+      reply[index++] = offset & 0xFF;
+      trace.read(offset, reply + index, count);
+      index += count;
+      return true;
+    }
+
+    case 3: // Replayed by tick(), which sends the results when it's done
+      if (!replay.requested) {
+        replay.requested = true;
+        replay.applied.resize(maxLength > index + 20 ? maxLength - index - 20 : 0);
+      }
+      return false;
+  }
+}
+
+void LedServer::applyRecordedPacket(uint8_t id, const uint8_t *packet, unsigned int length, unsigned long current_ms) {
+  switch (id) {
+    case 1:
+      handlePacket(packet, current_ms);
+      break;
+
+    case 3:
+      if (length >= 256 * 3)
+        handlePalettePacket(packet);
+      break;
+
+    case 4:
+    case 5:
+      handlePresetPacket(id, packet);
+      break;
+
+    case 7:
+      handleCoordinatesPacket(packet, length);
+      break;
+
+    default:
+      break;
   }
 }
+
+bool LedServer::isReplaying() const {
+  return replay.requested;
+}
+
+bool LedServer::continueReplay(uint8_t *reply, unsigned int &index, unsigned int maxLength, unsigned long current_ms) {
+  if (!replay.running) {
+    replay.entries.resize(trace.size());
+    trace.read(0, replay.entries.data(), replay.entries.size());
+    replay.offset = 0;
+    replay.first_tick = replay.tick = replay.applied_tick = replay.entries.empty() ? 0 : readTick(replay.entries.data());
+    replay.slowest_tick = 0;
+    replay.ticks = replay.total_us = replay.slowest_us = 0;
+    replay.checksum = 2166136261u;
+    replay.applied_length = 0;
+
+    // Started here rather than when it was asked for, so the packets that came after the request were applied. The
+    // trace starts with the state from when recording started, so this doesn't depend on the state now
+    controller->beginReplay(current_ms);
+    replay.running = true;
+  }
+
+  for (int i = 0; i < TRACE_REPLAY_TICKS && replay.offset < replay.entries.size(); ++i, ++replay.tick) {
+    bool applied = false;
+    while (replay.offset < replay.entries.size() && readTick(replay.entries.data() + replay.offset) <= replay.tick) {
+      const uint8_t *entry = replay.entries.data() + replay.offset;
+      unsigned int length = entry[4] << 8 | entry[5];
+      applyRecordedPacket(entry[6], entry + 7, length, current_ms);
+      replay.offset += 7 + length;
+      applied = true;
+    }
+
+    unsigned long start = micros();
+    controller->update_timed(current_ms, replay.tick);
+    uint32_t render_us = micros() - start;
+    uint32_t frame = controller->getFrameChecksum();
+
+    ++replay.ticks;
+    replay.total_us += render_us;
+    replay.checksum = (replay.checksum ^ frame) * 16777619u;
+    if (render_us > replay.slowest_us) {
+      replay.slowest_us = render_us;
+      replay.slowest_tick = replay.tick - replay.first_tick;
+    }
+
+    if (applied) {
+      replay.applied_tick = replay.tick;
+      if (replay.applied_length + 12 <= replay.applied.size()) {
+        writeInt(replay.applied.data(), replay.applied_length, replay.tick - replay.first_tick);
+        writeInt(replay.applied.data(), replay.applied_length, render_us);
+        writeInt(replay.applied.data(), replay.applied_length, frame);
+      }
+    }
+
+    // Long pauses between packets would only make the replay take long
+    if (replay.offset < replay.entries.size() && replay.tick - replay.applied_tick >= TRACE_MAX_GAP)
+      replay.tick = max(replay.tick, readTick(replay.entries.data() + replay.offset) - 1);
+
+    yield();
+  }
+
+  if (replay.offset < replay.entries.size())
+    return false;
+
+  controller->endReplay(current_ms);
+
+  // The number of ticks rendered, the total render time in microseconds, the slowest tick and its render time, and
+  // a checksum of all frames (4 bytes each). Then, for every tick in which packets were applied (as long as they
+  // fit), the tick, its render time and the checksum of its frame. Ticks start at 0 for the first packet
+  writeInt(reply, index, replay.ticks);
+  writeInt(reply, index, replay.total_us);
+  writeInt(reply, index, replay.slowest_tick);
+  writeInt(reply, index, replay.slowest_us);
+  writeInt(reply, index, replay.checksum);
+  unsigned int count = min(replay.applied_length, maxLength > index ? (maxLength - index) / 12 * 12 : 0);
+  memcpy(reply + index, replay.applied.data(), count);
+  index += count;
+
+  replay = TraceReplay(); // Frees the copy of the trace
+  return true;
+}
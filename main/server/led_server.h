@@ -3,14 +3,38 @@
 #define LEDS_LED_SERVER_H
 
 #include "led_controller.h"
+#include "power_manager.h"
+#include "frame_scheduler.h"
+#include "command_trace.h"
+#include "memory_stats.h"
+
+// A replay of the trace, which is rendered a few ticks at a time so the loop keeps running
+struct TraceReplay {
+  bool requested = false, running = false;
+  std::vector<uint8_t> entries; // A copy of the trace
+  unsigned int offset = 0;
+  int first_tick = 0, tick = 0, applied_tick = 0, slowest_tick = 0;
+  uint32_t ticks = 0, total_us = 0, slowest_us = 0, checksum = 0;
+  // The tick, render time and checksum of the ticks in which packets were applied, as many as fit in the reply
+  std::vector<uint8_t> applied;
+  unsigned int applied_length = 0;
+};
 
 class LedServer {
 protected:
   LedController *controller;
+  const FrameScheduler *scheduler;
+
+  CommandTrace trace;
+  TraceReplay replay;
+
+  void applyRecordedPacket(uint8_t id, const uint8_t *packet, unsigned int length, unsigned long current_ms);
 
 public:
-  explicit LedServer(LedController *controller) {
+  LedServer(LedController *controller, const FrameScheduler *scheduler) {
     this->controller = controller;
+    this->scheduler = scheduler;
+    trackMemory(memory_network, sizeof(trace));
   }
 
   virtual void setup() {}
@@ -21,13 +45,62 @@ public:
 
   uint8_t handlePacket(const uint8_t *&packet, unsigned long current_ms);
 
-  void writePacket(uint8_t *packet, unsigned int &index, bool withName = true);
+  // The status, in at most maxLength bytes of packet
+  void writePacket(uint8_t *packet, unsigned int &index, unsigned int maxLength, bool withName = true);
+
+  // What a client needs to list the controller: name, led count, firmware version, state version and load
+  void writeDescriptor(uint8_t *packet, unsigned int &index, int load);
+
+  // Bytes used by every memory pool and their peaks, the heap, and the heap samples
+  void writeMemory(uint8_t *packet, unsigned int &index);
+
+  // The current version, followed by an update packet with everything that changed after version since (or
+  // everything, if since is 0 or newer than the current version), in at most maxLength bytes of packet. Fields that
+  // don't fit are left out. Returns the current version.
+  uint32_t writeChanges(uint8_t *packet, unsigned int &index, unsigned int maxLength, uint32_t since);
+
+  // A packet with 256 r,g,b colors
+  void handlePalettePacket(const uint8_t *&packet);
+
+  // Selecting (id 4) or saving (id 5) a preset. Returns false if the preset wasn't saved because it doesn't fit
+  bool handlePresetPacket(uint8_t id, const uint8_t *&packet);
+
+  void writePresets(uint8_t *packet, unsigned int &index);
+
+  // Part of a coordinate map, length being what's left of the packet
+  void handleCoordinatesPacket(const uint8_t *&packet, unsigned int length);
+
+  // Adds the packet to the trace if it's recording and the packet changes the state
+  void recordPacket(uint8_t id, const uint8_t *packet, unsigned int length);
+
+  // The whole state as an update packet and a palette packet, so a replay starts from where the recording did
+  void recordState();
+
+  // Packet 11, controlling the trace. Writes the reply to reply (at most maxLength bytes) and returns whether
+  // there is one
+  bool handleTracePacket(const uint8_t *&packet, uint8_t *reply, unsigned int &index, unsigned int maxLength,
+                         unsigned long current_ms);
+
+  // Whether a replay was asked for and hasn't finished. Until it has, the server only calls continueReplay() in
+  // tick(), so packets wait instead of changing what's replayed, and the loop doesn't render
+  bool isReplaying() const;
+
+  // Applies the recorded packets at the ticks they were recorded in, rendering up to TRACE_REPLAY_TICKS ticks.
+  // Returns true once the replay is done, with its results written to reply (at most maxLength bytes)
+  bool continueReplay(uint8_t *reply, unsigned int &index, unsigned int maxLength, unsigned long current_ms);
 
   virtual void tick(unsigned long current_ms) {}
 
+  // Waits up to timeout_ms, returning as soon as a packet arrives if the server can tell
+  virtual void waitForPacket(unsigned long timeout_ms) {
+    delay(timeout_ms);
+  }
+
   virtual bool isActive() {
     return false;
   }
+
+  virtual void setPowerState(PowerState state) {}
 };
 
 #endif //LEDS_LED_SERVER_H
@@ -0,0 +1,188 @@
+#include <Arduino.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <lwip/sockets.h>
+
+#include "includes.h"
+
+#include "link_manager.h"
+
+void LinkManager::post(LinkEvent event) {
+  if (!events.push(event))
+    debugln("Link event queue full");
+}
+
+void LinkManager::enter(LinkState next, unsigned long current_ms) {
+  state = next;
+  state_time = current_ms;
+}
+
+LinkAction LinkManager::retry(unsigned long current_ms) {
+  if (state == link_online)
+    ++disconnects;
+
+  probing = false;
+  wait = backoff;
+  backoff = backoff * 2 > LINK_BACKOFF_MAX ? LINK_BACKOFF_MAX : backoff * 2;
+  enter(link_backoff, current_ms);
+
+  debugf("Reconnecting in %lu ms\n", wait);
+  return action_stop;
+}
+
+LinkAction LinkManager::handleEvent(LinkEvent event, unsigned long current_ms) {
+  switch (event) {
+    case wifi_connected:
+      debugln("Wifi associated");
+      return action_none;
+
+    case wifi_got_ip:
+      if (state == link_backoff) // From before the controller gave up on that attempt
+        return action_none;
+
+      enter(link_online, current_ms);
+      backoff = LINK_BACKOFF_MIN;
+      failed_probes = 0;
+      probing = false;
+      probe_time = current_ms;
+      return action_start;
+
+    case wifi_bad_ip:
+      return state == link_backoff ? action_none : retry(current_ms);
+
+    case wifi_disconnected:
+      // During the backoff it's the disconnect the controller asked for
+      return state == link_backoff ? action_none : retry(current_ms);
+  }
+
+  return action_none;
+}
+
+LinkAction LinkManager::update(unsigned long current_ms) {
+  for (LinkEvent *event; (event = events.front()) != nullptr;) {
+    LinkEvent next = *event;
+    events.pop();
+
+    LinkAction action = handleEvent(next, current_ms);
+    if (action != action_none) // The other events are handled on the next tick
+      return action;
+  }
+
+  switch (state) {
+    case link_offline:
+      enter(link_connecting, current_ms);
+      return action_begin;
+
+    case link_connecting:
+      return current_ms - state_time > LINK_CONNECT_TIMEOUT ? retry(current_ms) : action_none;
+
+    case link_backoff:
+      if (current_ms - state_time < wait)
+        return action_none;
+
+      enter(link_connecting, current_ms);
+      return action_begin;
+
+    case link_online:
+      if (failed_probes >= LINK_PROBE_FAILURES)
+        return retry(current_ms);
+
+      if (probing || current_ms - probe_time < (failed_probes > 0 ? LINK_PROBE_RETRY : KEEP_ALIVE_INTERVAL))
+        return action_none;
+
+      probing = true;
+      probe_start = current_ms;
+      return action_probe;
+  }
+
+  return action_none;
+}
+
+void LinkManager::activity(unsigned long current_ms) {
+  if (!probing)
+    probe_time = current_ms;
+}
+
+void LinkManager::probeDone(bool answered, unsigned long current_ms) {
+  if (!probing)
+    return;
+
+  probing = false;
+  probe_time = current_ms;
+
+  if (answered) {
+    gateway_answers = true;
+    failed_probes = 0;
+    probe_ms = current_ms - probe_start;
+  } else if (gateway_answers) {
+    ++failed_probes;
+    debugf("Gateway didn't answer %i probe(s)\n", failed_probes);
+  }
+}
+
+bool LinkManager::isOnline() const {
+  return state == link_online;
+}
+
+LinkHealth LinkManager::getHealth(unsigned long current_ms) const {
+  return {state, disconnects, failed_probes, probe_ms, state == link_online ? current_ms - state_time : 0};
+}
+
+bool GatewayProbe::start(uint32_t ip, uint16_t port, unsigned long current_ms) {
+  cancel();
+
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = ip;
+
+  if (connect(fd, (const sockaddr *) &address, sizeof(address)) != 0 && errno != EINPROGRESS) {
+    cancel();
+    return false;
+  }
+
+  start_time = current_ms;
+  return true;
+}
+
+ProbeResult GatewayProbe::poll(unsigned long current_ms) {
+  if (fd < 0)
+    return probe_failed;
+
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(fd, &writable);
+  timeval timeout = {0, 0};
+
+  if (select(fd + 1, nullptr, &writable, nullptr, &timeout) <= 0) {
+    if (current_ms - start_time < LINK_PROBE_TIMEOUT)
+      return probe_running;
+
+    cancel();
+    return probe_failed;
+  }
+
+  int error = 0;
+  socklen_t length = sizeof(error);
+  getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length);
+  cancel();
+
+  return error == 0 || error == ECONNREFUSED ? probe_answered : probe_failed;
+}
+
+void GatewayProbe::cancel() {
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+bool GatewayProbe::isRunning() const {
+  return fd >= 0;
+}
@@ -0,0 +1,97 @@
+#ifndef LEDS_LINK_MANAGER_H
+#define LEDS_LINK_MANAGER_H
+
+#include <cstdint>
+
+#include "spsc_queue.h"
+
+// After losing the connection, the controller waits this long before reconnecting, doubling the wait after every
+// attempt that fails up to LINK_BACKOFF_MAX
+#define LINK_BACKOFF_MIN 1000
+#define LINK_BACKOFF_MAX (60 * 1000)
+// An attempt that doesn't get an IP address within this time has failed
+#define LINK_CONNECT_TIMEOUT (20 * 1000)
+// How long the gateway gets to answer a probe, how soon a probe that wasn't answered is repeated, and how many
+// probes in a row can go unanswered before the controller reconnects. Gateways that drop connections to port 80
+// instead of refusing them never answer, so probes only count once the gateway has answered one
+#define LINK_PROBE_TIMEOUT 2000
+#define LINK_PROBE_RETRY (10 * 1000)
+#define LINK_PROBE_FAILURES 3
+
+enum LinkEvent {
+  wifi_connected, wifi_got_ip, wifi_bad_ip, wifi_disconnected
+};
+
+enum LinkState {
+  link_offline, link_connecting, link_online, link_backoff
+};
+
+// What the server should do next with the radio and its sockets
+enum LinkAction {
+  action_none, action_begin, action_start, action_stop, action_probe
+};
+
+enum ProbeResult {
+  probe_running, probe_answered, probe_failed
+};
+
+struct LinkHealth {
+  LinkState state;
+  uint16_t disconnects; // Since startup
+  uint8_t failed_probes; // In a row
+  uint16_t probe_ms; // Round trip of the last probe that was answered
+  unsigned long online_ms; // 0 if it isn't online
+};
+
+// Keeps the Wi-Fi connection up without blocking the loop. Events from the Wi-Fi task are queued, and every tick
+// update() handles them and the timeouts and says what to do next, one action at a time
+class LinkManager {
+private:
+  SpscQueue<LinkEvent, 8> events;
+
+  LinkState state = link_offline;
+  unsigned long state_time = 0, backoff = LINK_BACKOFF_MIN, wait = 0;
+  unsigned long probe_time = 0, probe_start = 0;
+  bool probing = false, gateway_answers = false;
+
+  uint16_t disconnects = 0, probe_ms = 0;
+  uint8_t failed_probes = 0;
+
+  LinkAction handleEvent(LinkEvent event, unsigned long current_ms);
+  LinkAction retry(unsigned long current_ms);
+  void enter(LinkState next, unsigned long current_ms);
+
+public:
+  // Called from the Wi-Fi event task
+  void post(LinkEvent event);
+
+  LinkAction update(unsigned long current_ms);
+
+  // Packets from clients show that the link works, so the next probe isn't needed yet
+  void activity(unsigned long current_ms);
+
+  void probeDone(bool answered, unsigned long current_ms);
+
+  bool isOnline() const;
+
+  LinkHealth getHealth(unsigned long current_ms) const;
+};
+
+// A TCP connection attempt to the gateway that is checked every tick instead of waited for. A connection or a refusal
+// both mean the gateway answered
+class GatewayProbe {
+private:
+  int fd = -1;
+  unsigned long start_time = 0;
+
+public:
+  bool start(uint32_t ip, uint16_t port, unsigned long current_ms);
+
+  ProbeResult poll(unsigned long current_ms);
+
+  void cancel();
+
+  bool isRunning() const;
+};
+
+#endif //LEDS_LINK_MANAGER_H
@@ -0,0 +1,101 @@
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "includes.h"
+
+#include "udp_socket.h"
+
+UdpSocket::~UdpSocket() {
+  stop();
+}
+
+bool UdpSocket::open(uint16_t port) {
+  stop();
+
+  fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0)
+    return false;
+
+  // Like WiFiUDP, so a socket that was just closed doesn't keep the port
+  int yes = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = htonl(INADDR_ANY);
+
+  if (bind(fd, (const sockaddr *) &address, sizeof(address)) != 0) {
+    debugf("Can't bind to port %i\n", port);
+    stop();
+    return false;
+  }
+  return true;
+}
+
+bool UdpSocket::begin(uint16_t port) {
+  return open(port);
+}
+
+bool UdpSocket::beginMulticast(IPAddress group, uint16_t port, IPAddress local) {
+  if (!open(port))
+    return false;
+
+  ip_mreq membership = {};
+  membership.imr_multiaddr.s_addr = (uint32_t) group;
+  membership.imr_interface.s_addr = (uint32_t) local;
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) != 0) {
+    debugf("Can't join %s\n", group.toString().c_str());
+    stop();
+    return false;
+  }
+  return true;
+}
+
+void UdpSocket::stop() {
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+bool UdpSocket::isOpen() const {
+  return fd >= 0;
+}
+
+int UdpSocket::getDescriptor() const {
+  return fd;
+}
+
+int UdpSocket::receive(uint8_t *buffer, size_t size) {
+  if (fd < 0)
+    return 0;
+
+  socklen_t length = sizeof(remote);
+  int received = recvfrom(fd, buffer, size, MSG_DONTWAIT, (sockaddr *) &remote, &length);
+  return received < 0 ? 0 : received;
+}
+
+IPAddress UdpSocket::remoteIP() const {
+  return IPAddress((uint32_t) remote.sin_addr.s_addr);
+}
+
+uint16_t UdpSocket::remotePort() const {
+  return ntohs(remote.sin_port);
+}
+
+bool UdpSocket::send(IPAddress ip, uint16_t port, const uint8_t *data, size_t length) {
+  if (fd < 0)
+    return false;
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(port);
+  address.sin_addr.s_addr = (uint32_t) ip;
+
+  return sendto(fd, data, length, 0, (const sockaddr *) &address, sizeof(address)) == (int) length;
+}
+
+bool UdpSocket::reply(const uint8_t *data, size_t length) {
+  return send(remoteIP(), remotePort(), data, length);
+}
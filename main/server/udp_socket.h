@@ -0,0 +1,44 @@
+#ifndef LEDS_UDP_SOCKET_H
+#define LEDS_UDP_SOCKET_H
+
+#include <Arduino.h>
+#include <IPAddress.h>
+#include <lwip/sockets.h>
+
+// A UDP socket that reads whole datagrams at once. Unlike WiFiUDP it gives access to its descriptor, so the loop can
+// wait for a packet with select() and let the cpu sleep until one arrives
+class UdpSocket {
+private:
+  int fd = -1;
+  sockaddr_in remote = {}; // Of the last datagram that was received
+
+  bool open(uint16_t port);
+
+public:
+  ~UdpSocket();
+
+  bool begin(uint16_t port);
+
+  // Joins group on the interface with the address local
+  bool beginMulticast(IPAddress group, uint16_t port, IPAddress local);
+
+  void stop();
+
+  bool isOpen() const;
+
+  // -1 if it isn't open
+  int getDescriptor() const;
+
+  // Reads the next datagram without waiting. Returns its length (at most size), or 0 if there is none
+  int receive(uint8_t *buffer, size_t size);
+
+  IPAddress remoteIP() const;
+  uint16_t remotePort() const;
+
+  bool send(IPAddress ip, uint16_t port, const uint8_t *data, size_t length);
+
+  // To whoever sent the last datagram
+  bool reply(const uint8_t *data, size_t length);
+};
+
+#endif //LEDS_UDP_SOCKET_H
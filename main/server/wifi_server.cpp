@@ -17,7 +17,10 @@ void onWifiEvent(arduino_event_id_t event) {
   }
 }
 
-WifiServer::WifiServer(LedController *controller) : LedServer(controller), readBuffer(), writeBuffer() {}
+WifiServer::WifiServer(LedController *controller, const FrameScheduler *scheduler) :
+  LedServer(controller, scheduler), readBuffer(), writeBuffer(), groupBuffer() {
+  trackMemory(memory_network, sizeof(readBuffer) + sizeof(writeBuffer) + sizeof(groupBuffer));
+}
 
 void WifiServer::setup() {
   instance = this;
@@ -29,141 +32,455 @@ void WifiServer::setup() {
   WiFi.config(WIFI_STATIC_IP, WIFI_STATIC_GATEWAY, WIFI_STATIC_MASK);  // arduino-esp32 #2537
 #endif
   WiFi.setHostname("central-led");
-  WiFi.begin(WIFI_SSID, WIFI_PASS);
+  WiFi.setAutoReconnect(false); // The link manager reconnects, with a backoff
 }
 
 void WifiServer::handleWifiEvent(arduino_event_id_t event) {
+  // This runs on the Wi-Fi task, everything else happens in tick()
   switch (event) {
     case ARDUINO_EVENT_WIFI_STA_CONNECTED:
-      Serial.println("Wifi connected");
+      link.post(wifi_connected);
+      break;
 
-      digitalWrite(LED_BUILTIN, 0);
+    case ARDUINO_EVENT_WIFI_STA_GOT_IP:
+      // For some reason DHCP sometimes gives 255.255.255.255
+      link.post(WiFi.localIP() == IPAddress(255, 255, 255, 255) ? wifi_bad_ip : wifi_got_ip);
       break;
 
-    case ARDUINO_EVENT_WIFI_STA_GOT_IP: {
-      String ip = WiFi.localIP().toString();
+    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+      link.post(wifi_disconnected);
+      break;
 
-      if (strcmp(ip.c_str(), "255.255.255.255") == 0) {
-        Serial.println("Received 255.255.255.255 as IP, retrying in 10 seconds");
-        digitalWrite(LED_BUILTIN, 1);
-        delay(10000);
-        WiFi.begin(WIFI_SSID, WIFI_PASS);
-        break;
-      }
+    default:
+      break;
+  }
+}
 
-      Serial.printf("Wifi IP: %s\n", ip.c_str());
+void WifiServer::updateLink(unsigned long current_ms) {
+  if (probe.isRunning()) {
+    ProbeResult result = probe.poll(current_ms);
+    if (result != probe_running)
+      link.probeDone(result == probe_answered, current_ms);
+  }
+
+  switch (link.update(current_ms)) {
+    case action_none:
+      break;
+
+    case action_begin:
+      Serial.println("Connecting to wifi");
+      WiFi.begin(WIFI_SSID, WIFI_PASS);
+      break;
+
+    case action_start: {
+      digitalWrite(LED_BUILTIN, 0);
+      Serial.printf("Wifi IP: %s\n", WiFi.localIP().toString().c_str());
 
       if (MDNS.begin(WIFI_MDNS_NAME))
         Serial.println("MDNS responder started");
 
       server.begin(WIFI_PORT);
-      online = true;
-      server.setTimeout(10000);
+      multicast.beginMulticast(WIFI_MULTICAST_IP, WIFI_MULTICAST_PORT, WiFi.localIP());
       Serial.println("UDP server started");
       break;
     }
 
-    case ARDUINO_EVENT_WIFI_STA_DISCONNECTED:
+    case action_stop:
       digitalWrite(LED_BUILTIN, 1);
-      online = false;
+      probe.cancel();
       server.stop();
+      multicast.stop();
+      has_connection = false;
+      WiFi.disconnect();
       Serial.println("Lost wifi connection, attempting to reconnect");
-      WiFi.begin(WIFI_SSID, WIFI_PASS);
       break;
 
-    default:
+    case action_probe: // Instead of keeping the connection alive with a request, which blocked until it was answered
+      if (!probe.start(WiFi.gatewayIP(), 80, current_ms))
+        link.probeDone(false, current_ms);
       break;
   }
 }
 
 bool WifiServer::isOnline() const {
-  return online;
+  return link.isOnline();
 }
 
 void WifiServer::tick(unsigned long current_ms) {
-  int packetSize;
-  // If there's no active connection, only read a packet every second
-  if (online && (has_connection || current_ms - last_read_time >= INACTIVE_PACKET_READ_INTERVAL)) {
-    last_read_time = current_ms;
+  updateLink(current_ms);
+
+  if (isReplaying()) {
+    unsigned int replyLen = 2;
+    writeBuffer[replyLen++] = 11;
+    // Nothing else is read until it's done, so the reply goes to whoever asked for it
+    if (continueReplay(writeBuffer, replyLen, sizeof(writeBuffer), current_ms))
+      sendReply(replyLen);
+    return;
+  }
+
+  bool online = link.isOnline();
+  int datagramSize;
+  // Reading doesn't wait, so it's done every tick, and while asleep the loop waits for a datagram in waitForPacket()
+  if (online && (datagramSize = server.receive(readBuffer, sizeof(readBuffer))) > 0) {
+    uint16_t acks = 0; // Packet ids to acknowledge, once each for the whole datagram
+
+    // Every packet starts with its length, and a packet that doesn't fit in what was received is dropped
+    for (int offset = 0, packetLen = 0; offset + 3 <= datagramSize; offset += 2 + packetLen) {
+      packetLen = readBuffer[offset] << 8 | readBuffer[offset + 1];
+      if (packetLen == 0 || offset + 2 + packetLen > datagramSize)
+        break;
+
+      uint8_t id = readBuffer[offset + 2];
+      const uint8_t *packet = readBuffer + offset + 3;
+      recordPacket(id, packet, packetLen - 1);
+
+      unsigned int replyLen = 2;
+      switch (id) {
+        default:
+          continue;
+
+        case 0: // Ping
+          has_connection = true;
+          activity_time = current_ms;
 
-    if ((packetSize = server.parsePacket()) != 0) {
-      unsigned int readBytes = 0, packetLen;
+          acks |= 1 << 0; // Pong!
+          break;
 
-      do {
-        readFully(server, readBuffer, 2);
-        readFully(server, readBuffer, packetLen = readBuffer[0] << 8 | readBuffer[1]);
+        case 1:
+          handlePacket(packet, current_ms);
 
-        readBytes += 2 + packetLen;
+          has_connection = true;
+          activity_time = current_ms;
 
-        const uint8_t *packet = readBuffer;
+          acks |= 1 << 1;
 
-        switch (*(packet++)) {
-          default:
+          break;
+
+        case 2:
+          writeBuffer[replyLen++] = 2;
+          writePacket(writeBuffer, replyLen, sizeof(writeBuffer));
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          sendReply(replyLen);
+
+          break;
+
+        case 3:
+          if (packetLen < 1 + 256 * 3)
             continue;
 
-          case 0: // Ping
-            has_connection = true;
-            activity_time = current_ms;
+          handlePalettePacket(packet);
 
-            server.beginPacket();
-            server.write((const uint8_t *) "\x00\x01\x00", 3); // Pong!
-            server.endPacket();
-            break;
+          has_connection = true;
+          activity_time = current_ms;
 
-          case 1: {
-            handlePacket(packet, current_ms);
+          acks |= 1 << 3;
 
-            has_connection = true;
-            activity_time = current_ms;
+          break;
 
-            server.beginPacket();
-            server.write((const uint8_t *) "\x00\x01\x01", 3);
-            server.endPacket();
+        case 4:
+        case 5:
+          has_connection = true;
+          activity_time = current_ms;
 
-            break;
+          if (handlePresetPacket(id, packet)) {
+            acks |= 1 << id;
+          } else { // Not saved
+            writeBuffer[replyLen++] = id;
+            writeBuffer[replyLen++] = 0;
+            sendReply(replyLen);
           }
-          case 2:
-            packetLen = 2;
-            writeBuffer[packetLen++] = 2;
-            writePacket(writeBuffer, packetLen);
-
-            has_connection = true;
-            activity_time = current_ms;
-
-            server.beginPacket();
-            packetLen -= 2;
-            writeBuffer[0] = packetLen >> 8;
-            writeBuffer[1] = packetLen & 0xFF;
-            server.write(writeBuffer, packetLen + 2);
-            server.endPacket();
-
-            break;
+
+          break;
+
+        case 6:
+          writeBuffer[replyLen++] = 6;
+          writePresets(writeBuffer, replyLen);
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          sendReply(replyLen);
+
+          break;
+
+        case 7:
+          handleCoordinatesPacket(packet, packetLen - 1);
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          acks |= 1 << 7;
+
+          break;
+
+        case 8: {
+          uint32_t version = 0;
+          if (packetLen >= 5)
+            version = (uint32_t) packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3];
+          subscribe(version, current_ms);
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          break;
         }
+        case 11: {
+          writeBuffer[replyLen++] = 11;
+          bool reply = handleTracePacket(packet, writeBuffer, replyLen, sizeof(writeBuffer), current_ms);
+
+          has_connection = true;
+          activity_time = current_ms;
 
-        if (activity_time == current_ms) {
-          keep_alive_time = activity_time;
+          if (reply)
+            sendReply(replyLen);
+          else
+            acks |= 1 << 11;
+
+          break;
         }
-      } while (readBytes < packetSize);
+        case 12:
+          writeBuffer[replyLen++] = 12;
+          writeLinkHealth(replyLen, current_ms);
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          sendReply(replyLen);
+
+          break;
+
+        case 13:
+          writeBuffer[replyLen++] = 13;
+          writeMemory(writeBuffer, replyLen);
+
+          has_connection = true;
+          activity_time = current_ms;
+
+          sendReply(replyLen);
+
+          break;
+      }
+
+      if (activity_time == current_ms)
+        link.activity(current_ms);
     }
+
+    sendAcks(acks);
   }
 
+  // Multicast and broadcast packets don't count as a connection, so they're read on every tick
+  if (online)
+    readMulticastPackets(current_ms);
+  if (group_length != 0 && (long) (current_ms - group_apply_time) >= 0)
+    applyGroupPacket(current_ms);
+  if (has_discovery && (long) (current_ms - discovery_time) >= 0)
+    sendDescriptor();
+
+  notifySubscribers(current_ms);
+
   // Track if the device hasn't received any data in the last 10 seconds
   if (has_connection && current_ms - activity_time > INACTIVE_DELAY)
     has_connection = false;
 
-  // Send something random to keep the wlan connection alive every 5 minutes
-  if (online && !has_connection && current_ms - keep_alive_time > KEEP_ALIVE_INTERVAL) {
-    keep_alive_time = current_ms;
+}
+
+void WifiServer::sendAcks(uint16_t acks) {
+  if (acks == 0)
+    return;
+
+  // An empty packet for every id, all in one datagram
+  uint8_t ack[3 * 16];
+  unsigned int length = 0;
+  for (uint8_t id = 0; id < 16; ++id) {
+    if (acks & 1 << id) {
+      ack[length++] = 0;
+      ack[length++] = 1;
+      ack[length++] = id;
+    }
+  }
+
+  server.reply(ack, length);
+}
+
+void WifiServer::sendReply(unsigned int packetLen) {
+  // packetLen includes the 2 bytes at the start of writeBuffer, which the length goes in
+  packetLen -= 2;
+  writeBuffer[0] = packetLen >> 8;
+  writeBuffer[1] = packetLen & 0xFF;
+  server.reply(writeBuffer, packetLen + 2);
+}
+
+void WifiServer::waitForPacket(unsigned long timeout_ms) {
+  // A group packet or a discovery reply that's waiting for its time can't wait for the next packet
+  unsigned long current_ms = millis();
+  if (group_length != 0)
+    timeout_ms = min(timeout_ms, (long) (group_apply_time - current_ms) > 0 ? group_apply_time - current_ms : 0);
+  if (has_discovery)
+    timeout_ms = min(timeout_ms, (long) (discovery_time - current_ms) > 0 ? discovery_time - current_ms : 0);
+
+  if (!server.isOpen()) {
+    delay(timeout_ms);
+    return;
+  }
+
+  // The cpu can light sleep in here, the radio wakes it up when a datagram arrives on either socket. Group packets
+  // are applied a number of ticks after they arrive, so they need to be read as soon as they do
+  fd_set readable;
+  FD_ZERO(&readable);
+  FD_SET(server.getDescriptor(), &readable);
+  int highest = server.getDescriptor();
+  if (multicast.isOpen()) {
+    FD_SET(multicast.getDescriptor(), &readable);
+    highest = max(highest, multicast.getDescriptor());
+  }
+
+  timeval timeout = {};
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = timeout_ms % 1000 * 1000;
+  select(highest + 1, &readable, nullptr, nullptr, &timeout);
+}
+
+void WifiServer::writeLinkHealth(unsigned int &packetLen, unsigned long current_ms) {
+  LinkHealth health = link.getHealth(current_ms);
+  uint32_t online_s = health.online_ms / 1000;
+
+  writeBuffer[packetLen++] = health.state;
+  writeBuffer[packetLen++] = (uint8_t) WiFi.RSSI();
+  writeBuffer[packetLen++] = health.disconnects >> 8;
+  writeBuffer[packetLen++] = health.disconnects & 0xFF;
+  writeBuffer[packetLen++] = health.failed_probes;
+  writeBuffer[packetLen++] = health.probe_ms >> 8;
+  writeBuffer[packetLen++] = health.probe_ms & 0xFF;
+  for (int shift = 24; shift >= 0; shift -= 8)
+    writeBuffer[packetLen++] = (online_s >> shift) & 0xFF;
+}
+
+void WifiServer::readMulticastPackets(unsigned long current_ms) {
+  // Only one packet per datagram, which still starts with its length
+  for (int length; (length = multicast.receive(readBuffer, sizeof(readBuffer))) > 0;) {
+    if (length < 3)
+      continue;
+
+    switch (readBuffer[2]) {
+      default:
+        break;
+
+      case 9:
+        handleGroupPacket(readBuffer + 3, length - 3, current_ms);
+        break;
+
+      case 10: // Discovery, only the latest client that asked is answered
+        discovery_ip = multicast.remoteIP();
+        discovery_port = multicast.remotePort();
+        discovery_time = current_ms + random(DISCOVERY_BACKOFF);
+        has_discovery = true;
+        break;
+    }
+  }
+}
+
+void WifiServer::handleGroupPacket(const uint8_t *packet, unsigned int length, unsigned long current_ms) {
+  // The groups it's for (4 bytes), a sequence number (2 bytes), the delay in ticks (2 bytes), then an update packet
+  if (length < 8)
+    return;
+
+  uint32_t groups = (uint32_t) packet[0] << 24 | packet[1] << 16 | packet[2] << 8 | packet[3];
+  uint16_t sequence = packet[4] << 8 | packet[5];
+  int delay_ticks = packet[6] << 8 | packet[7];
+
+  if (!(groups & controller->getGroups()) || (has_group_sequence && sequence == group_sequence))
+    return; // Not for us, or a repeat of a packet that was already received
+
+  if (group_length != 0) // The previous one is overtaken, but shouldn't be lost
+    applyGroupPacket(current_ms);
+
+  has_group_sequence = true;
+  group_sequence = sequence;
+  group_length = length - 8;
+  memcpy(groupBuffer, packet + 8, group_length);
+  group_apply_time = current_ms + delay_ticks * TICK_DURATION;
+
+  debugf("Group packet %i for %x, applied in %i ticks\n", sequence, (unsigned) groups, delay_ticks);
+}
+
+void WifiServer::applyGroupPacket(unsigned long current_ms) {
+  const uint8_t *packet = groupBuffer;
+  recordPacket(1, groupBuffer, group_length);
+  group_length = 0;
+  handlePacket(packet, current_ms);
+}
+
+void WifiServer::sendDescriptor() {
+  has_discovery = false;
+
+  unsigned int packetLen = 2;
+  writeBuffer[packetLen++] = 10;
+  writeDescriptor(writeBuffer, packetLen, scheduler->getLoad());
+
+  packetLen -= 2;
+  writeBuffer[0] = packetLen >> 8;
+  writeBuffer[1] = packetLen & 0xFF;
+
+  // From the regular port, so the client knows where to send everything else
+  server.send(discovery_ip, discovery_port, writeBuffer, packetLen + 2);
+}
+
+void WifiServer::subscribe(uint32_t version, unsigned long current_ms) {
+  IPAddress ip = server.remoteIP();
+  uint16_t port = server.remotePort();
 
-    WiFiClient client;
-    if (client.connect("192.168.1.1", 80)) {
-      client.println("GET / HTTP/1.1\n");
+  int index = 0;
+  while (index < subscriber_count && !(subscribers[index].ip == ip && subscribers[index].port == port))
+    ++index;
+
+  if (index == MAX_SUBSCRIBERS) { // Replace whoever subscribed the longest ago
+    index = 0;
+    for (int i = 1; i < subscriber_count; ++i) {
+      if (subscribers[i].subscribe_time < subscribers[index].subscribe_time)
+        index = i;
+    }
+  } else if (index == subscriber_count) {
+    ++subscriber_count;
+  }
+
+  subscribers[index] = {ip, port, version, current_ms};
+  sendChanges(subscribers[index]);
+}
 
-      client.stop();
+void WifiServer::notifySubscribers(unsigned long current_ms) {
+  for (int i = 0; i < subscriber_count;) {
+    if (current_ms - subscribers[i].subscribe_time > INACTIVE_DELAY) {
+      subscribers[i] = subscribers[--subscriber_count];
+      continue;
     }
+
+    if (subscribers[i].version != controller->getVersion())
+      sendChanges(subscribers[i]);
+    ++i;
   }
 }
 
+void WifiServer::sendChanges(Subscriber &subscriber) {
+  unsigned int packetLen = 2;
+  writeBuffer[packetLen++] = 8;
+  subscriber.version = writeChanges(writeBuffer, packetLen, sizeof(writeBuffer), subscriber.version);
+
+  packetLen -= 2;
+  writeBuffer[0] = packetLen >> 8;
+  writeBuffer[1] = packetLen & 0xFF;
+
+  server.send(subscriber.ip, subscriber.port, writeBuffer, packetLen + 2);
+}
+
 bool WifiServer::isActive() {
   return has_connection;
 }
+
+void WifiServer::setPowerState(PowerState state) {
+  // Modem sleep (which light sleep requires) makes the router buffer packets until the radio wakes up for a beacon,
+  // which delays them by a few hundred milliseconds at most
+  WiFi.setSleep(state == power_awake ? WIFI_PS_NONE : state == power_idle ? WIFI_PS_MIN_MODEM : WIFI_PS_MAX_MODEM);
+}
@@ -4,22 +4,67 @@
 
 #include "Arduino.h"
 #include "WiFi.h"
-#include "WiFiUdp.h"
 
 #include "led_server.h"
+#include "link_manager.h"
+#include "udp_socket.h"
+
+#define MAX_SUBSCRIBERS 4
+
+// A client that's notified when the state changes, until it hasn't subscribed again for INACTIVE_DELAY
+struct Subscriber {
+  IPAddress ip;
+  uint16_t port;
+  uint32_t version; // The last version the client was sent
+  unsigned long subscribe_time;
+};
 
 class WifiServer : public LedServer {
 private:
-  WiFiUDP server;
-  bool online = false;
+  UdpSocket server;
+  LinkManager link;
+  GatewayProbe probe;
 
   unsigned char readBuffer[1024], writeBuffer[1024];
-  unsigned long last_read_time = 0, activity_time = 0, keep_alive_time = 0;
+  unsigned long activity_time = 0;
 
   bool has_connection = false;
 
+  Subscriber subscribers[MAX_SUBSCRIBERS];
+  int subscriber_count = 0;
+
+  // Update packets multicast to the groups this controller is in. They're applied after a delay, so a sender
+  // can repeat a packet (with the same sequence number and a shorter delay) and it still lands in the same frame
+  UdpSocket multicast;
+  unsigned char groupBuffer[1024];
+  unsigned int group_length = 0; // Of the update packet waiting to be applied, 0 if there's none
+  unsigned long group_apply_time = 0;
+  uint16_t group_sequence = 0;
+  bool has_group_sequence = false;
+
+  // A discovery reply that's waiting for its backoff
+  IPAddress discovery_ip;
+  uint16_t discovery_port = 0;
+  unsigned long discovery_time = 0;
+  bool has_discovery = false;
+
+  void updateLink(unsigned long current_ms);
+  void sendAcks(uint16_t acks);
+  // Sends the packet in writeBuffer to whoever sent the datagram that's being handled
+  void sendReply(unsigned int packetLen);
+  void writeLinkHealth(unsigned int &packetLen, unsigned long current_ms);
+
+  void readMulticastPackets(unsigned long current_ms);
+  void handleGroupPacket(const uint8_t *packet, unsigned int length, unsigned long current_ms);
+  void applyGroupPacket(unsigned long current_ms);
+  void sendDescriptor();
+
+  void subscribe(uint32_t version, unsigned long current_ms);
+  void notifySubscribers(unsigned long current_ms);
+  void sendChanges(Subscriber &subscriber);
+
 public:
-  explicit WifiServer(LedController *controller);
+  WifiServer(LedController *controller, const FrameScheduler *scheduler);
 
   void setup() override;
 
@@ -29,7 +74,11 @@ public:
 
   void tick(unsigned long current_ms) override;
 
+  void waitForPacket(unsigned long timeout_ms) override;
+
   bool isActive() override;
+
+  void setPowerState(PowerState state) override;
 };
 
 #endif //LEDS_WIFI_SERVER_H
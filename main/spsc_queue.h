@@ -0,0 +1,51 @@
+#ifndef LEDS_SPSC_QUEUE_H
+#define LEDS_SPSC_QUEUE_H
+
+#include <atomic>
+
+// Lock-free queue between exactly one producer task and one consumer task.
+// Slots are filled and read in place, so large items don't need to be copied.
+template<typename T, unsigned int N>
+class SpscQueue {
+  static_assert((N & (N - 1)) == 0, "Queue size must be a power of two");
+
+private:
+  T items[N];
+  // Both only ever increase, head - tail is the number of queued items
+  std::atomic<unsigned int> head{0}, tail{0};
+
+public:
+  // Producer: the slot the next item should be written to, or nullptr if the queue is full
+  T *acquire() {
+    unsigned int h = head.load(std::memory_order_relaxed);
+    return h - tail.load(std::memory_order_acquire) == N ? nullptr : &items[h & (N - 1)];
+  }
+
+  // Producer: makes the acquired slot available to the consumer
+  void publish() {
+    head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+
+  bool push(const T &item) {
+    T *slot = acquire();
+    if (slot == nullptr)
+      return false;
+
+    *slot = item;
+    publish();
+    return true;
+  }
+
+  // Consumer: the oldest item in the queue, or nullptr if it's empty
+  T *front() {
+    unsigned int t = tail.load(std::memory_order_relaxed);
+    return head.load(std::memory_order_acquire) == t ? nullptr : &items[t & (N - 1)];
+  }
+
+  // Consumer: releases the item returned by front()
+  void pop() {
+    tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+  }
+};
+
+#endif //LEDS_SPSC_QUEUE_H
@@ -17,19 +17,6 @@ bool isSubstr(const char *str, const char *sub) {
   return *sub == 0;
 }
 
-bool readFully(WiFiUDP &udp, uint8_t *buf, size_t size) {
-  // TODO timeout
-  size_t off = 0;
-  while (off < size) {
-    if (!udp.available())
-      delay(5);
-
-    off += udp.read(buf, size - off);
-  }
-
-  return true;
-}
-
 int clampByte(int i) {
   return i < 0 ? 0 : i > 255 ? 255 : i;
 }
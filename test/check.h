@@ -0,0 +1,33 @@
+#ifndef LEDS_TEST_CHECK_H
+#define LEDS_TEST_CHECK_H
+
+#include <cstdio>
+
+// Tests are plain programs that print every check that fails, and fail if any did
+
+static int check_failures = 0;
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) { \
+      printf("%s:%i: %s failed\n", __FILE__, __LINE__, #condition); \
+      ++check_failures; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    long long expected_value = (long long) (expected), actual_value = (long long) (actual); \
+    if (expected_value != actual_value) { \
+      printf("%s:%i: %s is %lli instead of %lli\n", __FILE__, __LINE__, #actual, actual_value, expected_value); \
+      ++check_failures; \
+    } \
+  } while (0)
+
+static inline int checkResult() {
+  if (check_failures > 0)
+    printf("%i check(s) failed\n", check_failures);
+  return check_failures == 0 ? 0 : 1;
+}
+
+#endif //LEDS_TEST_CHECK_H
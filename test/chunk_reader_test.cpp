@@ -0,0 +1,141 @@
+#include <vector>
+
+#include "ble_framing.h"
+
+#include "check.h"
+
+static std::vector<uint8_t> makePacket(unsigned int length, uint8_t seed) {
+  std::vector<uint8_t> packet(length);
+  for (unsigned int i = 0; i < length; ++i)
+    packet[i] = (uint8_t) (i * 13 + seed);
+  return packet;
+}
+
+// Splits a packet into chunks of at most chunkSize bytes (indicator included), like a client would
+static std::vector<std::vector<uint8_t>> split(const std::vector<uint8_t> &packet, unsigned int chunkSize) {
+  std::vector<std::vector<uint8_t>> chunks;
+  unsigned int count = chunkSize - 1;
+  if (packet.size() <= count) {
+    chunks.push_back({CHUNK_SINGLE});
+    chunks.back().insert(chunks.back().end(), packet.begin(), packet.end());
+    return chunks;
+  }
+
+  for (unsigned int index = 0; index < packet.size(); index += count) {
+    unsigned int end = std::min(index + count, (unsigned int) packet.size());
+    uint8_t indicator = index == 0 ? CHUNK_START : end == packet.size() ? CHUNK_LAST : CHUNK_CONTINUE;
+    chunks.push_back({indicator});
+    chunks.back().insert(chunks.back().end(), packet.begin() + index, packet.begin() + end);
+  }
+  return chunks;
+}
+
+// Feeds chunks to the reader, and returns the packets it completed
+static std::vector<std::vector<uint8_t>> feed(ChunkReader &reader, const std::vector<std::vector<uint8_t>> &chunks) {
+  std::vector<std::vector<uint8_t>> packets;
+  BlePacket packet;
+  for (const std::vector<uint8_t> &chunk : chunks) {
+    if (reader.read(chunk.data(), chunk.size(), packet)) {
+      CHECK(packet.length <= BLE_PACKET_SIZE);
+      CHECK_EQUAL(0, packet.data[packet.length]);
+      packets.emplace_back(packet.data, packet.data + packet.length);
+    }
+  }
+  return packets;
+}
+
+template<typename T>
+static void append(std::vector<T> &to, const std::vector<T> &from) {
+  to.insert(to.end(), from.begin(), from.end());
+}
+
+int main() {
+  // Split over chunks of every size a client could use
+  for (unsigned int chunkSize : {20u, 182u, 244u, 509u}) {
+    for (unsigned int length : {1u, chunkSize - 1, chunkSize, 3 * (chunkSize - 1), 3 * (chunkSize - 1) + 1, 600u,
+                                (unsigned) BLE_PACKET_SIZE}) {
+      if (length > BLE_PACKET_SIZE)
+        continue;
+
+      std::vector<uint8_t> packet = makePacket(length, (uint8_t) chunkSize);
+      ChunkReader reader;
+      std::vector<std::vector<uint8_t>> packets = feed(reader, split(packet, chunkSize));
+      CHECK_EQUAL(1, packets.size());
+      CHECK(packets.size() == 1 && packets[0] == packet);
+      CHECK_EQUAL(0, reader.getDroppedPackets());
+    }
+  }
+
+  // Several packets back to back come out in order, single chunks in between too
+  {
+    std::vector<std::vector<uint8_t>> chunks, expected;
+    for (unsigned int length : {50u, 3u, 700u, 19u, 20u}) {
+      expected.push_back(makePacket(length, (uint8_t) length));
+      append(chunks, split(expected.back(), 20));
+    }
+    ChunkReader reader;
+    CHECK(feed(reader, chunks) == expected);
+    CHECK_EQUAL(0, reader.getDroppedPackets());
+  }
+
+  // A packet that never ends is dropped when the next one starts, and the next one still arrives whole
+  {
+    std::vector<uint8_t> first = makePacket(100, 1), second = makePacket(100, 2);
+    std::vector<std::vector<uint8_t>> chunks = split(first, 20);
+    chunks.pop_back();
+    append(chunks, split(second, 20));
+    ChunkReader reader;
+    std::vector<std::vector<uint8_t>> packets = feed(reader, chunks);
+    CHECK(packets.size() == 1 && packets[0] == second);
+    CHECK_EQUAL(1, reader.getDroppedPackets());
+  }
+
+  // The middle and end of a packet whose start was missed are ignored
+  {
+    std::vector<uint8_t> packet = makePacket(100, 3);
+    std::vector<std::vector<uint8_t>> chunks = split(makePacket(100, 4), 20);
+    chunks.erase(chunks.begin());
+    append(chunks, split(packet, 20));
+    ChunkReader reader;
+    std::vector<std::vector<uint8_t>> packets = feed(reader, chunks);
+    CHECK(packets.size() == 1 && packets[0] == packet);
+  }
+
+  // Packets that don't fit are dropped as a whole, however they're split, and don't affect the next one
+  for (unsigned int chunkSize : {20u, 509u}) {
+    std::vector<uint8_t> packet = makePacket(40, 5);
+    std::vector<std::vector<uint8_t>> chunks = split(makePacket(BLE_PACKET_SIZE + 1, 6), chunkSize);
+    append(chunks, split(makePacket(5000, 7), chunkSize));
+    append(chunks, split(packet, chunkSize));
+    ChunkReader reader;
+    std::vector<std::vector<uint8_t>> packets = feed(reader, chunks);
+    CHECK(packets.size() == 1 && packets[0] == packet);
+    CHECK_EQUAL(2, reader.getDroppedPackets());
+  }
+  {
+    std::vector<uint8_t> oversized = {CHUNK_SINGLE};
+    append(oversized, makePacket(BLE_PACKET_SIZE + 1, 8));
+    ChunkReader reader;
+    CHECK(feed(reader, {oversized}).empty());
+    CHECK_EQUAL(1, reader.getDroppedPackets());
+  }
+
+  // Empty chunks and unknown indicators are ignored, and a reset drops the packet being read
+  {
+    std::vector<uint8_t> packet = makePacket(60, 9);
+    std::vector<std::vector<uint8_t>> chunks = split(packet, 20);
+    chunks.insert(chunks.begin() + 1, std::vector<uint8_t>());
+    chunks.insert(chunks.begin() + 2, std::vector<uint8_t>{7, 1, 2, 3});
+    ChunkReader reader;
+    std::vector<std::vector<uint8_t>> packets = feed(reader, chunks);
+    CHECK(packets.size() == 1 && packets[0] == packet);
+
+    chunks = split(packet, 20);
+    feed(reader, {chunks[0]});
+    reader.reset();
+    CHECK(feed(reader, {chunks.begin() + 1, chunks.end()}).empty());
+    CHECK_EQUAL(1, reader.getDroppedPackets());
+  }
+
+  return checkResult();
+}
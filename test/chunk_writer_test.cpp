@@ -0,0 +1,71 @@
+#include <vector>
+
+#include "bluetooth_server.h"
+
+#include "check.h"
+
+// Usable bytes per characteristic value for an MTU, as the server calculates them
+static unsigned int payloadSize(unsigned int mtu) {
+  return std::min(mtu, (unsigned int) BLE_MAX_MTU) - 3;
+}
+
+// Splits a packet like the server does for a client with this MTU, and checks the chunks it notifies
+static void checkSplit(unsigned int mtu, unsigned int length) {
+  std::vector<uint8_t> packet(length + 1); // Never empty, so even an empty packet has an address
+  for (unsigned int i = 0; i < length; ++i)
+    packet[i] = (uint8_t) (i * 7 + length);
+
+  unsigned int payload = payloadSize(mtu);
+  ChunkWriter writer;
+  writer.begin(packet.data(), length);
+
+  std::vector<uint8_t> received;
+  std::vector<uint8_t> chunk(payload);
+  int chunks = 0;
+  while (writer.hasNext()) {
+    unsigned int chunkLength = writer.next(chunk.data(), payload);
+    ++chunks;
+
+    CHECK(chunkLength >= 1 && chunkLength <= payload);
+    // Every chunk is full except the last one
+    CHECK_EQUAL(writer.hasNext() ? CHUNK_MORE : CHUNK_END, chunk[0]);
+    CHECK(!writer.hasNext() || chunkLength == payload);
+    received.insert(received.end(), chunk.begin() + 1, chunk.begin() + chunkLength);
+  }
+
+  CHECK(received == std::vector<uint8_t>(packet.begin(), packet.begin() + length));
+  CHECK_EQUAL(length == 0 ? 1 : (length + payload - 2) / (payload - 1), chunks);
+
+  // A client using the old protocol asks for another chunk after the last one
+  CHECK_EQUAL(1, writer.next(chunk.data(), payload));
+  CHECK_EQUAL(CHUNK_END, chunk[0]);
+}
+
+int main() {
+  // The default MTU, what phones usually negotiate, and the maximum
+  for (unsigned int mtu : {23u, 185u, 247u, 517u}) {
+    unsigned int payload = payloadSize(mtu);
+    for (unsigned int length : {0u, 1u, payload - 2, payload - 1, payload, 2 * (payload - 1), 2 * (payload - 1) + 1,
+                                300u, (unsigned) BLE_PACKET_SIZE})
+      checkSplit(mtu, length);
+  }
+
+  // A status reply with three formulas takes dozens of chunks at the default MTU, but one at a negotiated one
+  {
+    uint8_t packet[400] = {}, chunk[512];
+    int chunks[2] = {};
+    for (int i = 0; i < 2; ++i) {
+      ChunkWriter writer;
+      writer.begin(packet, sizeof(packet));
+      while (writer.hasNext()) {
+        writer.next(chunk, payloadSize(i == 0 ? 23 : 517));
+        ++chunks[i];
+      }
+    }
+    printf("A 400 byte reply takes %i chunks at MTU 23, %i at MTU 517\n", chunks[0], chunks[1]);
+    CHECK_EQUAL(22, chunks[0]);
+    CHECK_EQUAL(1, chunks[1]);
+  }
+
+  return checkResult();
+}
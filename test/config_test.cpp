@@ -0,0 +1,99 @@
+#include <EEPROM.h>
+
+#include "led_controller.h"
+
+#include "check.h"
+#include "host.h"
+
+static unsigned long now = 0;
+
+// Like starting up: the config is read back from flash
+static LedController *restart() {
+  EEPROM.begin(CONFIG_SIZE);
+  FastLED.controllers.clear();
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->update_timed(now, 0);
+  return controller;
+}
+
+// Long enough for the config to be saved
+static void waitForSave(LedController *controller) {
+  controller->update_timed(now += 10, 0);
+  controller->update_timed(now += POST_CHANGE_SAVE_DELAY + 10, 0);
+}
+
+static String longFormula(const char *term, int length) {
+  String formula = term;
+  while ((int) formula.length() + 3 + (int) strlen(term) <= length)
+    formula += String(" + ") + term;
+  return formula;
+}
+
+static Zone makeZone(int start, const String &hue) {
+  Zone zone;
+  zone.start = start;
+  zone.count = 10;
+  for (FormulaData &formula : zone.formulas)
+    parseFormulaData(int_formula, hue.c_str(), formula);
+  zone.updateFlags();
+  return zone;
+}
+
+int main() {
+  LedController *controller = restart();
+
+  // A palette takes 768 bytes of the config, and still fits with everything else
+  Palette palette;
+  for (int i = 0; i < 256; ++i)
+    palette.colors[i] = CRGB(i, 255 - i, i / 2);
+  controller->setPalette(palette);
+  controller->setPaletteMode(true);
+  CHECK(controller->setFormula(0, int_formula, longFormula("x", 100).c_str()));
+  CHECK(controller->setVariable('a', int_formula, "t % 100"));
+  CHECK(controller->setZones({makeZone(10, "x * 2")}));
+  int commits = host.commits;
+  waitForSave(controller);
+  CHECK_EQUAL(commits + 1, host.commits);
+
+  controller = restart();
+  Palette loaded = controller->getPalette();
+  CHECK(controller->isPaletteMode());
+  CHECK(memcmp(palette.colors, loaded.colors, sizeof(palette.colors)) == 0);
+  CHECK(controller->getFormula(0) == longFormula("x", 100));
+  CHECK_EQUAL(1, controller->getVariables().size());
+  CHECK_EQUAL(1, controller->getZones().size());
+
+  // With every formula at its longest it wouldn't fit anymore, so the changes that would make it too big are
+  // rejected, and what's left is saved and there after a restart
+  for (int i = 0; i < 3; ++i)
+    CHECK(controller->setFormula(i, int_formula, longFormula("x * 7", 250).c_str()));
+  for (char name : {'a', 'b', 'c', 'd'})
+    CHECK(controller->setVariable(name, int_formula, longFormula("t", 200).c_str()));
+  CHECK(controller->setZones({makeZone(0, longFormula("x * 3", 250)), makeZone(20, longFormula("x * 4", 250))}));
+  commits = host.commits;
+  waitForSave(controller);
+  int variables = (int) controller->getVariables().size(), zones = (int) controller->getZones().size();
+  printf("Config with every formula at its longest: %i commit(s), %i variables, %i zones\n", host.commits - commits,
+         variables, zones);
+  CHECK_EQUAL(commits + 1, host.commits);
+  CHECK(controller->getFormula(2) == longFormula("x * 7", 250));
+  CHECK(variables < 4);
+  CHECK_EQUAL(1, zones);
+
+  controller = restart();
+  CHECK(controller->getFormula(2) == longFormula("x * 7", 250));
+  CHECK_EQUAL(variables, controller->getVariables().size());
+  CHECK_EQUAL(zones, controller->getZones().size());
+  CHECK(controller->isPaletteMode());
+  CHECK(memcmp(palette.colors, controller->getPalette().colors, sizeof(palette.colors)) == 0);
+
+  // So is a name that doesn't fit anymore
+  String name = controller->getDeviceName();
+  controller->setDeviceName(longFormula("Light", CONFIG_SIZE));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getDeviceName() == name);
+
+  return checkResult();
+}
@@ -0,0 +1,149 @@
+#include <EEPROM.h>
+#include <esp_timer.h>
+#include <thread>
+#include <unistd.h>
+
+#include "wifi_server.h"
+
+#include "check.h"
+#include "host.h"
+
+#define CONTROLLERS 5
+
+struct Reply {
+  String name;
+  int leds, firmware, load;
+  uint32_t version;
+  uint16_t port;
+  long received_ms;
+};
+
+static FrameScheduler scheduler(FRAME_POLICY);
+static LedController *controllers[CONTROLLERS];
+static WifiServer *servers[CONTROLLERS];
+static int client;
+
+// Broadcasts on loopback, which reaches every socket bound to the port
+static void broadcastDiscovery() {
+  const uint8_t packet[] = {0, 1, 10};
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(WIFI_MULTICAST_PORT);
+  address.sin_addr.s_addr = inet_addr("127.255.255.255");
+  CHECK_EQUAL(3, sendto(client, packet, sizeof(packet), 0, (const sockaddr *) &address, sizeof(address)));
+}
+
+// Runs the controllers for a while, and collects the replies the client got
+static std::vector<Reply> collect(int duration_ms, unsigned long start_ms) {
+  std::vector<Reply> replies;
+  for (unsigned long start = millis(); millis() - start < (unsigned long) duration_ms;) {
+    for (WifiServer *server : servers)
+      server->tick(millis());
+
+    uint8_t packet[256];
+    sockaddr_in from = {};
+    socklen_t from_length = sizeof(from);
+    int length;
+    while ((length = recvfrom(client, packet, sizeof(packet), MSG_DONTWAIT, (sockaddr *) &from, &from_length)) > 0) {
+      CHECK(length >= 3 && (packet[0] << 8 | packet[1]) == length - 2 && packet[2] == 10);
+      if (length < 4 || length < 4 + packet[3] + 8)
+        continue;
+
+      const uint8_t *data = packet + 4;
+      Reply reply;
+      for (int c = 0; c < packet[3]; ++c)
+        reply.name += (char) *(data++);
+      reply.leds = data[0] << 8 | data[1];
+      reply.firmware = data[2];
+      reply.version = (uint32_t) data[3] << 24 | data[4] << 16 | data[5] << 8 | data[6];
+      reply.load = data[7];
+      reply.port = ntohs(from.sin_port);
+      reply.received_ms = (long) (millis() - start_ms);
+      replies.push_back(reply);
+    }
+    delay(1);
+  }
+  return replies;
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+
+  for (int i = 0; i < CONTROLLERS; ++i) {
+    controllers[i] = new LedController();
+    controllers[i]->loadConfig();
+    controllers[i]->init();
+    controllers[i]->setDeviceName("Controller " + String(i));
+    controllers[i]->update_timed(0, 0);
+
+    servers[i] = new WifiServer(controllers[i], &scheduler);
+    servers[i]->setup();
+    servers[i]->tick(millis());
+    servers[i]->handleWifiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    servers[i]->tick(millis());
+    CHECK(servers[i]->isOnline());
+  }
+
+  client = socket(AF_INET, SOCK_DGRAM, 0);
+  int yes = 1;
+  setsockopt(client, SOL_SOCKET, SO_BROADCAST, &yes, sizeof(yes));
+
+  // One round trip finds every controller, and every one of them answers once, from its regular port, within the
+  // backoff
+  unsigned long sent_ms = millis();
+  broadcastDiscovery();
+  std::vector<Reply> replies = collect(DISCOVERY_BACKOFF + 100, sent_ms);
+  CHECK_EQUAL(CONTROLLERS, replies.size());
+
+  long first = DISCOVERY_BACKOFF, last = 0;
+  for (int i = 0; i < CONTROLLERS; ++i) {
+    int found = 0;
+    for (const Reply &reply : replies) {
+      if (reply.name != "Controller " + String(i))
+        continue;
+
+      ++found;
+      CHECK_EQUAL(controllers[i]->getLedCount(), reply.leds);
+      CHECK_EQUAL(FIRMWARE_VERSION, reply.firmware);
+      CHECK_EQUAL(controllers[i]->getVersion(), reply.version);
+      CHECK_EQUAL(scheduler.getLoad(), reply.load);
+      CHECK_EQUAL(WIFI_PORT, reply.port);
+      first = min(first, reply.received_ms);
+      last = max(last, reply.received_ms);
+    }
+    CHECK_EQUAL(1, found);
+  }
+  printf("%i replies, between %li and %li ms after asking\n", (int) replies.size(), first, last);
+  CHECK(last <= DISCOVERY_BACKOFF + 20);
+  CHECK(last - first >= 5); // Spread out, not in one burst
+
+  // Asking twice in a row still gets one answer from each
+  sent_ms = millis();
+  broadcastDiscovery();
+  broadcastDiscovery();
+  CHECK_EQUAL(CONTROLLERS, collect(DISCOVERY_BACKOFF + 100, sent_ms).size());
+
+  // A controller that's asleep wakes up for it, and answers when its backoff is over instead of after its next check
+  std::thread later([] {
+    delay(100);
+    broadcastDiscovery();
+  });
+  sent_ms = millis();
+  servers[0]->waitForPacket(INACTIVE_PACKET_READ_INTERVAL);
+  servers[0]->tick(millis());
+  servers[0]->waitForPacket(INACTIVE_PACKET_READ_INTERVAL);
+  servers[0]->tick(millis());
+  long answered = (long) (millis() - sent_ms);
+  later.join();
+
+  uint8_t packet[256];
+  int replied = 0;
+  while (recv(client, packet, sizeof(packet), MSG_DONTWAIT) > 0)
+    ++replied;
+  printf("Asleep: answered %li ms after going to sleep, with the request sent after 100 ms\n", answered);
+  CHECK_EQUAL(1, replied);
+  CHECK(answered >= 90 && answered <= 100 + DISCOVERY_BACKOFF + 50);
+
+  close(client);
+  return checkResult();
+}
@@ -0,0 +1,114 @@
+#include <EEPROM.h>
+#include <functional>
+
+#include "led_controller.h"
+
+#include "check.h"
+#include "host.h"
+
+#define FRAMES 100
+
+// What a led should be in a frame, given the whole previous frame
+typedef std::function<PixelState(int x, int t, const std::vector<PixelState> &previous)> Reference;
+
+static LedController *controller;
+static int tick = 0;
+static std::vector<PixelState> state; // What the reference says the previous frame was
+
+static const PixelState &previous(const std::vector<PixelState> &frame, int led) {
+  return frame[led < 0 ? 0 : led >= (int) frame.size() ? frame.size() - 1 : led];
+}
+
+// The checksum of the leds the controller rendered, if every led had the h/s/v of the reference. The CHSV
+// conversion of the host build keeps h, s and v as they are
+static uint32_t checksum(const std::vector<PixelState> &frame, const uint16_t *map) {
+  std::vector<PixelState> leds(frame.size());
+  for (int x = 0; x < (int) frame.size(); ++x)
+    leds[map[x]] = frame[x];
+
+  uint32_t checksum = 2166136261u;
+  for (const PixelState &led : leds) {
+    for (uint8_t channel : {led.h, led.s, led.v})
+      checksum = (checksum ^ channel) * 16777619u;
+  }
+  return checksum;
+}
+
+// Renders the formulas for a number of frames, and checks that every frame matches the reference, which starts from
+// the frame the previous scene ended with
+static void checkScene(const char *name, const char *hue, const char *sat, const char *val, const Reference &reference,
+                       const std::vector<Zone> &zones = {}) {
+  CHECK(controller->setFormula(0, int_formula, hue));
+  CHECK(controller->setFormula(1, int_formula, sat));
+  CHECK(controller->setFormula(2, int_formula, val));
+  CHECK(controller->setZones(zones));
+
+  uint16_t *map = controller->getLayout().createMap();
+  int wrong = 0;
+  for (int frame = 0; frame < FRAMES; ++frame) {
+    ++tick;
+    controller->update_timed(0, tick);
+
+    std::vector<PixelState> next(state.size());
+    for (int x = 0; x < (int) state.size(); ++x)
+      next[x] = reference(x, tick, state);
+    state = next;
+
+    wrong += controller->getFrameChecksum() != checksum(state, map);
+  }
+  delete[] map;
+
+  printf("%s: %i of %i frames different from the reference\n", name, wrong, FRAMES);
+  CHECK_EQUAL(0, wrong);
+}
+
+static Zone makeZone(int start, int count, const char *hue, const char *sat, const char *val) {
+  Zone zone;
+  zone.start = start;
+  zone.count = count;
+  CHECK(parseFormulaData(int_formula, hue, zone.formulas[0]));
+  CHECK(parseFormulaData(int_formula, sat, zone.formulas[1]));
+  CHECK(parseFormulaData(int_formula, val, zone.formulas[2]));
+  zone.updateFlags();
+  return zone;
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->setBrightness(255);
+  controller->setFade(1);
+  controller->setKeyframeInterval(1);
+  controller->setTransitionDuration(0);
+
+  int leds = controller->getLedCount();
+  state.resize(leds); // The buffers start out black
+
+  // A dot that moves one led per frame and leaves a trail that fades
+  checkScene("Trail", "0", "255", "(x = t % N) * 255 max val(x) * 8 / 10",
+             [leds](int x, int t, const std::vector<PixelState> &previous) {
+               return PixelState{0, 255, (uint8_t) max(x == t % leds ? 255 : 0, previous[x].v * 8 / 10)};
+             });
+
+  // A source that spreads over the strip, starting from the trail
+  checkScene("Blur", "hue(x) + 3", "sat(x) - 1", "(x = 10) * 255 max (val(x - 1) + val(x) + val(x + 1)) / 3",
+             [](int x, int t, const std::vector<PixelState> &frame) {
+               const PixelState &led = frame[x];
+               int v = (previous(frame, x - 1).v + led.v + previous(frame, x + 1).v) / 3;
+               return PixelState{(uint8_t) (led.h + 3), (uint8_t) max(led.s - 1, 0),
+                                 (uint8_t) max(x == 10 ? 255 : 0, v)};
+             });
+
+  // Hues that move down the strip, through a zone that doesn't change and doesn't read the previous frame, so its
+  // state has to be carried over into the next frame
+  checkScene("Zone", "(x = 0) * t + (x > 0) * hue(x - 1)", "255", "val(x) + 5",
+             [](int x, int t, const std::vector<PixelState> &frame) {
+               if (x >= 20 && x < 30)
+                 return PixelState{100, 200, 50};
+               return PixelState{(uint8_t) (x == 0 ? t : frame[x - 1].h), 255, (uint8_t) min(frame[x].v + 5, 255)};
+             }, {makeZone(20, 10, "100", "200", "50")});
+
+  return checkResult();
+}
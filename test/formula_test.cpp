@@ -0,0 +1,59 @@
+#include "formula_check.h"
+#include "led_controller.h"
+
+#include "check.h"
+
+// Parses text, and checks that its text parses into a formula that gives the same values
+static void checkRoundTrip(const char *text, FormulaType type, const char *expected_text = nullptr) {
+  FormulaData data, reparsed;
+  CHECK(parseFormulaData(type, text, data));
+  if (data.form == nullptr)
+    return;
+
+  if (expected_text != nullptr && data.text != expected_text)
+    printf("%s became %s instead of %s\n", text, data.text.c_str(), expected_text);
+  CHECK(expected_text == nullptr || data.text == expected_text);
+
+  CHECK(parseFormulaData(type, data.text.c_str(), reparsed));
+  if (reparsed.form == nullptr)
+    return;
+
+  for (int t : {0, 1, 1000}) {
+    for (int x = -20; x < 20; ++x)
+      CHECK_EQUAL(data.eval(x, t), reparsed.eval(x, t));
+  }
+}
+
+int main() {
+  VarForm::setVariable('a', 7, 7.5);
+  VarForm::setVariable('b', -3, -0.25);
+
+  // Operators with a lower level on the left, and the same level on the right, keep their parentheses
+  checkRoundTrip("2 / (a + 1)", int_formula, "2 / (a + 1)");
+  checkRoundTrip("(x + 1) * 3", int_formula, "(x + 1) * 3");
+  checkRoundTrip("x - (a - 1)", int_formula, "x - (a - 1)");
+  checkRoundTrip("x / (2 * 3)", int_formula, "x / (2 * 3)");
+  checkRoundTrip("x - a - 1", int_formula, "x - a - 1");
+  checkRoundTrip("2 / (a + 1.5)", double_formula);
+
+  // Abs around abs is written with parentheses, so the bars aren't right next to each other
+  checkRoundTrip("||x||", int_formula, "|(|x|)|");
+  checkRoundTrip("||x| + 1|", int_formula, "|(|x| + 1)|");
+  checkRoundTrip("|(|x| + 1)|", int_formula, "|(|x| + 1)|");
+  CHECK(parseFormula("|x") == nullptr);
+  checkRoundTrip("|(x - |b|)|", int_formula, "|(x - |b|)|");
+  checkRoundTrip("|x - 5| * 2", int_formula);
+
+  // The variables a formula uses, wherever they are in it
+  FormulaData data;
+  CHECK(parseFormulaData(int_formula, "x + noise(a * 2, |t - z|) + a", data));
+  CHECK_EQUAL(1 << 0 | 1 << 25, data.variables);
+  CHECK(parseFormulaData(int_formula, "x * t + u - v + N", data));
+  CHECK_EQUAL(0, data.variables);
+
+  // Random formulas, with seeds that are always the same so a failure can be reproduced
+  for (uint32_t seed : {1u, 2u, 12345u, 0xDEADBEEFu})
+    CHECK_EQUAL(0, checkFormulas(300, seed));
+
+  return checkResult();
+}
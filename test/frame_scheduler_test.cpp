@@ -0,0 +1,99 @@
+#include <Arduino.h>
+#include <esp_timer.h>
+
+#include "frame_scheduler.h"
+#include "includes.h"
+
+#include "check.h"
+#include "host.h"
+
+#define TICK_US ((int64_t) TICK_DURATION * 1000)
+
+// Runs frames that take a random time of up to max_cost_us to prepare, and checks after every frame that the tick
+// is the one that belongs to the time that passed since start()
+static void checkAligned(FramePolicy policy, int64_t max_cost_us, int frames, int max_behind) {
+  FrameScheduler scheduler(policy);
+  scheduler.start();
+  int64_t start = esp_timer_get_time();
+  srand(42);
+
+  int worst = 0;
+  for (int frame = 0; frame < frames; ++frame) {
+    advanceClock(rand() % (max_cost_us + 1));
+    scheduler.wait();
+
+    // The tick being prepared now belongs to the deadline that comes next
+    int expected = (int) ((esp_timer_get_time() - start) / TICK_US);
+    int behind = expected - scheduler.getTick();
+    worst = max(worst, abs(behind));
+    CHECK(behind >= 0 && behind <= max_behind);
+  }
+
+  printf("%s, up to %lli us per frame: %i frames, %lu dropped, load %i%%, at most %i tick(s) behind\n",
+         policy == frame_drop ? "Dropping" : "Catching up", (long long) max_cost_us, frames,
+         scheduler.getDroppedFrames(), scheduler.getLoad(), worst);
+}
+
+int main() {
+  useFakeClock();
+
+  // Frames that always fit in a tick never fall behind, and nothing is dropped
+  {
+    FrameScheduler scheduler(frame_drop);
+    scheduler.start();
+    int64_t start = esp_timer_get_time();
+    for (int frame = 0; frame < 1000; ++frame) {
+      CHECK_EQUAL(frame, scheduler.getTick());
+      advanceClock(TICK_US / 2 + frame % 7 * 1000);
+      scheduler.wait();
+    }
+    CHECK_EQUAL(1000 * TICK_US, esp_timer_get_time() - start);
+    CHECK_EQUAL(0, scheduler.getDroppedFrames());
+    CHECK(abs(scheduler.getLoad() - 56) <= 2);
+  }
+
+  // A slow frame drops the ticks it missed, and the next frame is on time again
+  {
+    FrameScheduler scheduler(frame_drop);
+    scheduler.start();
+    int64_t start = esp_timer_get_time();
+    advanceClock(TICK_US * 3 + 1000);
+    scheduler.wait();
+    CHECK_EQUAL(3, scheduler.getTick());
+    CHECK_EQUAL(2, scheduler.getDroppedFrames());
+    scheduler.wait();
+    CHECK_EQUAL(4, scheduler.getTick());
+    CHECK_EQUAL(4 * TICK_US, esp_timer_get_time() - start);
+  }
+
+  // Catching up renders the missed ticks back to back instead, unless it's too far behind
+  {
+    FrameScheduler scheduler(frame_catch_up);
+    scheduler.start();
+    int64_t start = esp_timer_get_time();
+    advanceClock(TICK_US * 3 + 1000);
+    for (int frame = 1; frame <= 3; ++frame) {
+      scheduler.wait();
+      CHECK_EQUAL(frame, scheduler.getTick());
+      CHECK_EQUAL(TICK_US * 3 + 1000, esp_timer_get_time() - start);
+    }
+    scheduler.wait(); // Back on time
+    CHECK_EQUAL(4, scheduler.getTick());
+    CHECK_EQUAL(4 * TICK_US, esp_timer_get_time() - start);
+    CHECK_EQUAL(0, scheduler.getDroppedFrames());
+
+    advanceClock(TICK_US * (FRAME_MAX_CATCH_UP + 2));
+    scheduler.wait();
+    CHECK_EQUAL(FRAME_MAX_CATCH_UP + 1, scheduler.getDroppedFrames());
+    CHECK_EQUAL(FRAME_MAX_CATCH_UP + 6, scheduler.getTick());
+  }
+
+  // Whatever the frames cost, t doesn't drift from the time that passed
+  checkAligned(frame_drop, TICK_US / 2, 10000, 0);
+  checkAligned(frame_drop, TICK_US * 3 / 2, 10000, 0);
+  checkAligned(frame_drop, TICK_US * 4, 10000, 0);
+  checkAligned(frame_catch_up, TICK_US * 3 / 2, 10000, FRAME_MAX_CATCH_UP);
+  checkAligned(frame_catch_up, TICK_US * 4, 10000, FRAME_MAX_CATCH_UP);
+
+  return checkResult();
+}
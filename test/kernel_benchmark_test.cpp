@@ -0,0 +1,163 @@
+#include <EEPROM.h>
+#include <esp_timer.h>
+
+#include "led_controller.h"
+#include "util.h"
+
+#include "check.h"
+#include "host.h"
+
+#define FRAMES 500
+
+struct Scene {
+  const char *name;
+  const char *formulas[3];
+  int fade;
+};
+
+static LedController *controller;
+static int tick = 0;
+
+static uint32_t checksum(const std::vector<CRGB> &leds) {
+  uint32_t checksum = 2166136261u; // The same as the controller's
+  for (const CRGB &led : leds) {
+    for (int channel = 0; channel < 3; ++channel)
+      checksum = (checksum ^ led.raw[channel]) * 16777619u;
+  }
+  return checksum;
+}
+
+// The render loop from before there were kernels: one loop for every case, deciding per led whether the formulas
+// need to be evaluated, and interpolating with divisions
+static void renderReference(std::vector<CRGB> &target, int t, const FormulaData *formulas, bool variable, int fade,
+                            const uint16_t *map) {
+  int num_leds = (int) target.size();
+  CRGB c{}, p = CRGB(0, 0, 0);
+
+  uint8_t h = 0, s = 0, v = 0;
+  if (!variable) {
+    h = formulas[0].eval(0, t) & 0xFF;
+    s = clampByte(formulas[1].eval(0, t));
+    v = clampByte(formulas[2].eval(0, t));
+  }
+
+  int hues[FORMULA_BATCH], sats[FORMULA_BATCH], vals[FORMULA_BATCH], batch_index = FORMULA_BATCH;
+  for (int calc_led = 0, fade_offset = 0, led_index;
+       calc_led - fade + 1 < num_leds; calc_led += fade, fade_offset = fade - 1, p = c) {
+    if (variable) {
+      if (batch_index == FORMULA_BATCH) {
+        int count = min(FORMULA_BATCH, (num_leds + 2 * fade - 2 - calc_led) / fade);
+        formulas[0].evalBatch(calc_led, fade, count, t, hues);
+        formulas[1].evalBatch(calc_led, fade, count, t, sats);
+        formulas[2].evalBatch(calc_led, fade, count, t, vals);
+        batch_index = 0;
+      }
+      h = hues[batch_index] & 0xFF;
+      s = clampByte(sats[batch_index]);
+      v = clampByte(vals[batch_index]);
+      ++batch_index;
+    }
+
+    c = CHSV(h, s, v);
+    while (fade_offset >= 0 && (led_index = calc_led - fade_offset) < num_leds) {
+      int step = fade_offset;
+      target[map[led_index]] = CRGB(((fade - step) * c.r + step * p.r) / fade,
+                                    ((fade - step) * c.g + step * p.g) / fade,
+                                    ((fade - step) * c.b + step * p.b) / fade);
+      --fade_offset;
+    }
+  }
+}
+
+// Microseconds per frame that the controller spends on everything but rendering, like the output stage
+static double measureOverhead() {
+  controller->setFormula(0, int_formula, "0");
+  controller->setFormula(1, int_formula, "0");
+  controller->setFormula(2, int_formula, "0");
+  controller->update_timed(0, ++tick);
+
+  int64_t start = esp_timer_get_time();
+  for (int frame = 0; frame < FRAMES; ++frame)
+    controller->update_timed(0, ++tick);
+  return (double) (esp_timer_get_time() - start) / FRAMES;
+}
+
+// Renders the scene with the controller and with the reference loop, checks that they give the same leds, and
+// returns how much faster the controller's kernel is
+static double checkScene(const Scene &scene, double overhead) {
+  FormulaData formulas[3];
+  for (int i = 0; i < 3; ++i) {
+    CHECK(controller->setFormula(i, int_formula, scene.formulas[i]));
+    CHECK(parseFormulaData(int_formula, scene.formulas[i], formulas[i]));
+  }
+  controller->setFade(scene.fade);
+  bool variable = formulas[0].isVariable || formulas[1].isVariable || formulas[2].isVariable;
+
+  uint16_t *map = controller->getLayout().createMap();
+  std::vector<CRGB> leds(controller->getLedCount());
+
+  int different = 0;
+  int64_t kernel_time = 0, reference_time = 0;
+  for (int frame = 0; frame < FRAMES; ++frame) {
+    int64_t start = esp_timer_get_time();
+    controller->update_timed(0, ++tick);
+    kernel_time += esp_timer_get_time() - start;
+
+    start = esp_timer_get_time();
+    renderReference(leds, tick, formulas, variable, scene.fade, map);
+    reference_time += esp_timer_get_time() - start;
+
+    different += checksum(leds) != controller->getFrameChecksum();
+  }
+  delete[] map;
+
+  double kernel_us = max(0.01, (double) kernel_time / FRAMES - overhead), reference_us = (double) reference_time / FRAMES;
+  printf("%s, fade %i: %.1f us per frame with the kernel, %.1f us with the reference loop, %i frame(s) different\n",
+         scene.name, scene.fade, kernel_us, reference_us, different);
+  CHECK_EQUAL(0, different);
+  return reference_us / kernel_us;
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->setBrightness(255);
+  controller->setKeyframeInterval(1);
+  controller->setTransitionDuration(0);
+
+  double overhead = measureOverhead();
+  printf("%.1f us per frame outside of rendering\n", overhead);
+
+  static const char *waves[3] = {"x * 3 + t", "255", "sin8(x * 4 + t)"};
+  CHECK(checkScene({"Constant", {"t % 256", "255", "t % 200 + 55"}, 1}, overhead) > 1);
+  CHECK(checkScene({"Waves", {waves[0], waves[1], waves[2]}, 1}, overhead) > 1);
+  // These spend most of their time evaluating the formulas, which the reference does the same way, so they're only
+  // checked to give the same leds
+  for (int fade : {4, 3})
+    checkScene({"Waves", {waves[0], waves[1], waves[2]}, fade}, overhead);
+
+  // In palette mode the faded hue picks the color from the palette
+  Palette palette;
+  for (int i = 0; i < 256; ++i)
+    palette.colors[i] = CRGB(i, 255 - i, i / 2);
+  controller->setPalette(palette);
+  controller->setPaletteMode(true);
+  uint16_t *map = controller->getLayout().createMap();
+  std::vector<CRGB> leds(controller->getLedCount());
+  for (int fade : {1, 4, 3}) {
+    controller->setFade(fade);
+    controller->update_timed(0, ++tick);
+    int num_leds = (int) leds.size();
+    for (int calc_led = 0, p = 0, c; calc_led - fade + 1 < num_leds; calc_led += fade, p = c) {
+      c = (calc_led * 3 + tick) & 0xFF;
+      for (int step = calc_led == 0 ? 0 : fade - 1; step >= 0 && calc_led - step < num_leds; --step)
+        leds[map[calc_led - step]] = palette.colors[(step * p + (fade - step) * c) / fade];
+    }
+    CHECK_EQUAL(checksum(leds), controller->getFrameChecksum());
+  }
+  delete[] map;
+
+  return checkResult();
+}
@@ -0,0 +1,127 @@
+#include <EEPROM.h>
+
+#include "led_controller.h"
+#include "led_layout.h"
+
+#include "check.h"
+#include "host.h"
+
+static LedLayout makeLayout(std::initializer_list<StripConfig> strips) {
+  LedLayout layout;
+  layout.strips = (uint8_t) strips.size();
+  int i = 0;
+  for (const StripConfig &strip : strips)
+    layout.strip[i++] = strip;
+  return layout;
+}
+
+// The map sends every led to its own place in the buffer, within its strip and in the strip's direction
+static void checkMap(const LedLayout &layout) {
+  uint16_t *map = layout.createMap();
+  for (int i = 0, start = 0; i < layout.strips; start += layout.strip[i++].count) {
+    const StripConfig &strip = layout.strip[i];
+    for (int led = 0; led < strip.count; ++led)
+      CHECK_EQUAL(start + (strip.reversed ? strip.count - 1 - led : led), map[start + led]);
+  }
+  delete[] map;
+
+  uint8_t packet[LAYOUT_SIZE] = {};
+  unsigned int length = 0;
+  layout.write(packet, length);
+  CHECK_EQUAL(1 + layout.strips * 4, length);
+
+  LedLayout read;
+  const uint8_t *data = packet;
+  CHECK(read.read(data));
+  CHECK_EQUAL(length, data - packet);
+  CHECK_EQUAL(layout.strips, read.strips);
+  for (int i = 0; i < layout.strips; ++i) {
+    CHECK_EQUAL(layout.strip[i].pin, read.strip[i].pin);
+    CHECK_EQUAL(layout.strip[i].count, read.strip[i].count);
+    CHECK_EQUAL(layout.strip[i].reversed, read.strip[i].reversed);
+  }
+}
+
+// Saves the layout like a client would, starts a controller with it, and checks which led of the formulas every
+// strip shows where
+static void checkController(const LedLayout &layout) {
+  auto *configuring = new LedController();
+  configuring->loadConfig();
+  configuring->init();
+  configuring->setLayout(layout);
+  configuring->update_timed(0, 0);
+
+  int restarts = host.restarts;
+  configuring->update_timed(POST_CHANGE_SAVE_DELAY + 1, 1);
+  CHECK_EQUAL(restarts + 1, host.restarts);
+
+  FastLED.controllers.clear();
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  CHECK_EQUAL(layout.getLedCount(), controller->getLedCount());
+  CHECK_EQUAL(layout.strips, FastLED.controllers.size());
+  if ((int) FastLED.controllers.size() != layout.strips)
+    return;
+
+  // Full red or none at all shows one bit of x per frame, whatever dithering does
+  controller->setBrightness(255);
+  controller->setFormula(1, int_formula, "255");
+  controller->setFormula(2, int_formula, "255");
+  std::vector<int> shown(layout.getLedCount());
+  for (int bit = 0; (1 << bit) < MAX_LEDS; ++bit) {
+    String formula = "x / " + String(1 << bit) + " % 2 * 255";
+    controller->setFormula(0, int_formula, formula.c_str());
+    controller->update_timed(0, 2 + bit);
+
+    for (int i = 0, start = 0; i < layout.strips; start += layout.strip[i++].count) {
+      const CLEDController &strip = FastLED.controllers[i];
+      CHECK_EQUAL(layout.strip[i].pin, strip.pin);
+      CHECK_EQUAL(layout.strip[i].count, strip.count);
+      for (int led = 0; led < strip.count; ++led) {
+        CHECK(strip.leds[led].r == 0 || strip.leds[led].r == 255);
+        shown[start + led] |= (strip.leds[led].r != 0) << bit;
+      }
+    }
+  }
+
+  int wrong = 0;
+  for (int i = 0, start = 0; i < layout.strips; start += layout.strip[i++].count) {
+    const StripConfig &strip = layout.strip[i];
+    for (int led = 0; led < strip.count; ++led)
+      wrong += shown[start + led] != start + (strip.reversed ? strip.count - 1 - led : led);
+  }
+  CHECK_EQUAL(0, wrong);
+  printf("%i strip(s), %i leds: %i in the wrong place\n", layout.strips, layout.getLedCount(), wrong);
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+
+  std::vector<LedLayout> layouts = {
+          LedLayout(), // The one in includes.h
+          makeLayout({{12, 1, false}}),
+          makeLayout({{13, 150, true}}),
+          makeLayout({{4, 10, false}, {5, 20, true}, {18, 30, true}, {33, 40, false}}),
+          makeLayout({{12, 1024, true}, {13, 1024, false}}),
+  };
+  for (const LedLayout &layout : layouts) {
+    CHECK(layout.isValid());
+    checkMap(layout);
+    checkController(layout);
+  }
+
+  // Layouts that can't be driven
+  CHECK(!makeLayout({}).isValid());
+  CHECK(!makeLayout({{12, 0, false}}).isValid());
+  CHECK(!makeLayout({{2, 10, false}}).isValid()); // Not a pin a strip can be connected to
+  CHECK(!makeLayout({{12, 1024, false}, {13, 1025, false}}).isValid());
+  uint8_t too_many[1 + (MAX_STRIPS + 1) * 4 + 1] = {MAX_STRIPS + 1};
+  too_many[sizeof(too_many) - 1] = 42;
+  const uint8_t *packet = too_many;
+  LedLayout read;
+  CHECK(!read.read(packet));
+  CHECK_EQUAL(42, *packet); // Skipped all of it
+
+  return checkResult();
+}
@@ -0,0 +1,217 @@
+#include <Arduino.h>
+#include <unistd.h>
+#include <lwip/sockets.h>
+
+#include "includes.h"
+#include "link_manager.h"
+
+#include "check.h"
+
+#define STEP_MS 50
+
+enum Gateway {
+  gateway_answers, gateway_silent, gateway_drops // Answers the first probe, and then none
+};
+
+// A link manager with a simulated Wi-Fi and gateway, stepped like the loop does
+struct SimulatedLink {
+  LinkManager link;
+  unsigned long now = 0;
+  Gateway gateway = gateway_answers;
+  bool associated = false;
+  unsigned long connect_ms = 300; // How long an attempt takes, 0 if attempts fail
+  unsigned long begin_time = 0, probe_end = 0;
+  bool probing = false, answering = false, answered_once = false;
+  int begins = 0, starts = 0, stops = 0, probes = 0;
+
+  void step() {
+    now += STEP_MS;
+
+    if (probing && now >= probe_end) {
+      probing = false;
+      answered_once |= answering;
+      link.probeDone(answering, now);
+    }
+    if (begin_time != 0 && connect_ms != 0 && now - begin_time >= connect_ms) {
+      begin_time = 0;
+      associated = true;
+      link.post(wifi_connected);
+      link.post(wifi_got_ip);
+    }
+
+    switch (link.update(now)) {
+      case action_none:
+        break;
+      case action_begin:
+        ++begins;
+        begin_time = now;
+        break;
+      case action_start:
+        ++starts;
+        break;
+      case action_stop:
+        ++stops;
+        begin_time = 0;
+        if (associated) { // Disconnecting, which the Wi-Fi reports
+          associated = false;
+          link.post(wifi_disconnected);
+        }
+        break;
+      case action_probe:
+        ++probes;
+        probing = true;
+        answering = gateway == gateway_answers || (gateway == gateway_drops && !answered_once);
+        probe_end = now + (answering ? 20 : LINK_PROBE_TIMEOUT);
+        break;
+    }
+  }
+
+  void run(unsigned long duration_ms) {
+    for (unsigned long end = now + duration_ms; now < end;)
+      step();
+  }
+
+  // The access point drops the connection
+  void drop() {
+    associated = false;
+    link.post(wifi_disconnected);
+  }
+};
+
+int main() {
+  // Connecting
+  {
+    SimulatedLink sim;
+    sim.run(1000);
+    CHECK(sim.link.isOnline());
+    CHECK_EQUAL(1, sim.begins);
+    CHECK_EQUAL(1, sim.starts);
+  }
+
+  // A gateway that never answers is never a reason to reconnect
+  {
+    SimulatedLink sim;
+    sim.gateway = gateway_silent;
+    sim.run(2 * 60 * 60 * 1000);
+    LinkHealth health = sim.link.getHealth(sim.now);
+    printf("Silent gateway: %i probes in 2 hours, %i reconnects\n", sim.probes, sim.stops);
+    CHECK(sim.link.isOnline());
+    CHECK_EQUAL(0, sim.stops);
+    CHECK_EQUAL(0, health.disconnects);
+    CHECK_EQUAL(0, health.failed_probes);
+    // Still probed, but not more often than a gateway that answers
+    CHECK(sim.probes <= 2 * 60 * 60 * 1000 / KEEP_ALIVE_INTERVAL);
+  }
+
+  // A gateway that answered and then stops answering: the link is gone, so it reconnects after LINK_PROBE_FAILURES
+  {
+    SimulatedLink sim;
+    sim.gateway = gateway_drops;
+    sim.run(KEEP_ALIVE_INTERVAL + 1000);
+    CHECK(sim.answered_once);
+    CHECK(!sim.probing);
+    CHECK_EQUAL(0, sim.stops);
+
+    unsigned long lost = sim.now;
+    while (sim.stops == 0 && sim.now - lost < 30 * 60 * 1000)
+      sim.step();
+    printf("Gateway stopped answering: reconnecting after %lu s and %i probes\n", (sim.now - lost) / 1000, sim.probes);
+    CHECK_EQUAL(1, sim.stops);
+    CHECK_EQUAL(1 + LINK_PROBE_FAILURES, sim.probes);
+    CHECK(sim.now - lost <= KEEP_ALIVE_INTERVAL + (LINK_PROBE_FAILURES - 1) * LINK_PROBE_RETRY +
+                            LINK_PROBE_FAILURES * LINK_PROBE_TIMEOUT + 2 * STEP_MS);
+
+    sim.run(LINK_BACKOFF_MIN + 1000);
+    CHECK(sim.link.isOnline());
+    CHECK_EQUAL(1, sim.link.getHealth(sim.now).disconnects);
+  }
+
+  // Packets from clients show the link works, so there's no need to probe
+  {
+    SimulatedLink sim;
+    for (int minute = 0; minute < 60; ++minute) {
+      sim.run(60 * 1000);
+      sim.link.activity(sim.now);
+    }
+    CHECK_EQUAL(0, sim.probes);
+  }
+
+  // An access point that keeps dropping the connection: every drop reconnects once, after the shortest backoff
+  {
+    SimulatedLink sim;
+    sim.run(1000);
+    for (int drop = 0; drop < 20; ++drop) {
+      sim.drop();
+      sim.run(5000);
+      CHECK(sim.link.isOnline());
+    }
+    LinkHealth health = sim.link.getHealth(sim.now);
+    printf("Flapping access point: %i drops, %i attempts, %i disconnects\n", 20, sim.begins - 1, health.disconnects);
+    CHECK_EQUAL(20, health.disconnects);
+    CHECK_EQUAL(21, sim.begins);
+    CHECK_EQUAL(21, sim.starts);
+  }
+
+  // Attempts that fail back off, doubling up to LINK_BACKOFF_MAX, and the first one that works resets the backoff
+  {
+    SimulatedLink sim;
+    sim.connect_ms = 0;
+    sim.run(60 * 60 * 1000);
+    int attempts = sim.begins;
+    printf("No access point: %i attempts in an hour\n", attempts);
+    // 6 before the backoff reaches its maximum, and then one every LINK_BACKOFF_MAX plus the timeout
+    CHECK(attempts >= 6 + (60 * 60 * 1000 - 200 * 1000) / (LINK_BACKOFF_MAX + LINK_CONNECT_TIMEOUT));
+    CHECK(attempts <= 7 + 60 * 60 * 1000 / (LINK_BACKOFF_MAX + LINK_CONNECT_TIMEOUT));
+    CHECK(!sim.link.isOnline());
+
+    sim.connect_ms = 300;
+    sim.run(LINK_BACKOFF_MAX + LINK_CONNECT_TIMEOUT);
+    CHECK(sim.link.isOnline());
+    sim.drop();
+    sim.run(LINK_BACKOFF_MIN + 1000);
+    CHECK(sim.link.isOnline());
+  }
+
+  // Events from an attempt that was given up on don't bring the link back, and the disconnect the controller asked
+  // for doesn't count as another drop
+  {
+    SimulatedLink sim;
+    sim.connect_ms = LINK_CONNECT_TIMEOUT + 500;
+    sim.run(LINK_CONNECT_TIMEOUT + 200);
+    CHECK_EQUAL(1, sim.stops);
+    sim.link.post(wifi_got_ip);
+    sim.link.post(wifi_disconnected);
+    sim.step();
+    CHECK(!sim.link.isOnline());
+    CHECK_EQUAL(link_backoff, sim.link.getHealth(sim.now).state);
+    CHECK_EQUAL(1, sim.stops);
+  }
+
+  // Probing a real port on loopback: a connection and a refusal both mean the gateway answered
+  {
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK_EQUAL(0, bind(listener, (const sockaddr *) &address, sizeof(address)));
+    CHECK_EQUAL(0, listen(listener, 1));
+    socklen_t length = sizeof(address);
+    getsockname(listener, (sockaddr *) &address, &length);
+    uint16_t open_port = ntohs(address.sin_port);
+
+    for (bool open : {true, false}) {
+      if (!open)
+        close(listener); // Nothing listens on the port anymore
+
+      GatewayProbe probe;
+      CHECK(probe.start(htonl(INADDR_LOOPBACK), open_port, millis()));
+      ProbeResult result = probe_running;
+      for (unsigned long start = millis(); result == probe_running && millis() - start < 1000; delay(1))
+        result = probe.poll(millis());
+      CHECK_EQUAL(probe_answered, result);
+      CHECK(!probe.isRunning());
+    }
+  }
+
+  return checkResult();
+}
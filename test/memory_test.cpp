@@ -0,0 +1,105 @@
+#include <EEPROM.h>
+
+#include "formula_check.h"
+#include "led_server.h"
+
+#include "check.h"
+
+static uint32_t readInt(const uint8_t *&data) {
+  uint32_t value = (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+  data += 4;
+  return value;
+}
+
+static uint32_t treeBytes() {
+  return getMemoryReport().used[memory_formula_trees];
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->update_timed(0, 0);
+
+  // The led buffers are allocated once, so they're at their peak
+  MemoryReport report = getMemoryReport();
+  CHECK(report.used[memory_pixels] >= (uint32_t) controller->getLedCount() * sizeof(CRGB));
+  CHECK_EQUAL(report.used[memory_pixels], report.peak[memory_pixels]);
+
+  FrameScheduler scheduler(FRAME_POLICY);
+  LedServer server(controller, &scheduler);
+  CHECK_EQUAL(report.used[memory_network] + sizeof(CommandTrace), getMemoryReport().used[memory_network]);
+
+  // The formula check's corpus frees every tree it parsed
+  uint32_t loaded = treeBytes(), peak = getMemoryReport().peak[memory_formula_trees];
+  for (uint32_t seed = 1; seed <= 3; ++seed)
+    CHECK_EQUAL(0, checkFormulas(FORMULA_SELF_CHECK, seed));
+  report = getMemoryReport();
+  printf("Formula check corpus: %u bytes of formula trees at most, %u before and after\n",
+         (unsigned) report.peak[memory_formula_trees], (unsigned) loaded);
+  CHECK_EQUAL(loaded, report.used[memory_formula_trees]);
+  CHECK(report.peak[memory_formula_trees] > peak);
+
+  // Replacing a formula frees the one it replaced
+  const char *scenes[] = {"sin8(x * 4 + t)", "x % 20 * 12 + 40", "255 - |(x * 4 + t) % 256 - 128| * 2"};
+  for (const char *scene : scenes)
+    CHECK(controller->setFormula(0, int_formula, scene));
+  controller->update_timed(1, 0);
+  uint32_t one_scene = treeBytes();
+  for (int i = 0; i < 300; ++i)
+    CHECK(controller->setFormula(0, int_formula, scenes[i % 3]));
+  CHECK(controller->setFormula(0, int_formula, scenes[2]));
+  controller->update_timed(2, 0);
+  printf("Replacing a formula 300 times: %u bytes of formula trees, %u before\n", (unsigned) treeBytes(),
+         (unsigned) one_scene);
+  CHECK_EQUAL(one_scene, treeBytes());
+
+  // Presets keep their trees, but switching between them doesn't allocate any more
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot) {
+    CHECK(controller->setFormula(0, int_formula, scenes[slot % 3]));
+    CHECK(controller->setFormula(1, int_formula, slot % 2 == 0 ? "255" : "sin8(t)"));
+    controller->savePreset(slot, "Preset " + String(slot));
+    controller->update_timed(3, 0);
+  }
+  for (int slot = 0; slot < PRESET_SLOTS; ++slot) {
+    controller->selectPreset(slot);
+    controller->update_timed(4, 0);
+  }
+  uint32_t presets = treeBytes();
+  for (int i = 0; i < 100; ++i) {
+    controller->selectPreset(i % PRESET_SLOTS);
+    controller->update_timed(5 + i, 0);
+  }
+  printf("%i presets: %u bytes of formula trees, the same after 100 switches: %u\n", PRESET_SLOTS,
+         (unsigned) presets, (unsigned) treeBytes());
+  CHECK_EQUAL(presets, treeBytes());
+
+  // The heap is sampled once per interval, and only the last samples are kept
+  for (unsigned long ms = 0; ms < (unsigned long) MEMORY_SAMPLE_INTERVAL * 12; ms += MEMORY_SAMPLE_INTERVAL / 4)
+    sampleHeap(ms);
+  CHECK_EQUAL(MEMORY_SAMPLES, getMemoryReport().sample_count);
+
+  // Packet 13 has the same numbers
+  uint8_t packet[256];
+  unsigned int length = 0;
+  report = getMemoryReport();
+  server.writeMemory(packet, length);
+  CHECK_EQUAL(MEMORY_POOLS * 8 + 12 + 1 + MEMORY_SAMPLES * 8, length);
+
+  const uint8_t *data = packet;
+  for (int pool = 0; pool < MEMORY_POOLS; ++pool) {
+    CHECK_EQUAL(report.used[pool], readInt(data));
+    CHECK_EQUAL(report.peak[pool], readInt(data));
+  }
+  CHECK_EQUAL(report.free_heap, readInt(data));
+  CHECK_EQUAL(report.min_free_heap, readInt(data));
+  CHECK_EQUAL(report.largest_block, readInt(data));
+  CHECK_EQUAL(MEMORY_SAMPLES, *(data++));
+  for (int i = 0; i < MEMORY_SAMPLES; ++i) {
+    CHECK_EQUAL(report.samples[i].free, readInt(data));
+    CHECK_EQUAL(report.samples[i].largest_block, readInt(data));
+  }
+
+  return checkResult();
+}
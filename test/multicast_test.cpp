@@ -0,0 +1,152 @@
+#include <EEPROM.h>
+#include <esp_timer.h>
+#include <thread>
+#include <unistd.h>
+
+#include "wifi_server.h"
+
+#include "check.h"
+#include "host.h"
+
+#define CONTROLLERS 4
+
+// A controller with its own Wi-Fi server, all of them on loopback
+struct Emulated {
+  LedController *controller;
+  WifiServer *server;
+  long applied_ms = -1; // When the last group packet was seen to change the brightness
+};
+
+static FrameScheduler scheduler(FRAME_POLICY);
+static Emulated controllers[CONTROLLERS];
+static int sender;
+
+// Sends multicast through loopback, where the controllers joined the group since WiFi.localIP() is 127.0.0.1 here
+static int openSender() {
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  in_addr local = {};
+  local.s_addr = htonl(INADDR_LOOPBACK);
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &local, sizeof(local));
+  return fd;
+}
+
+// A group packet that sets the brightness, applied delay_ticks after it arrives
+static void sendGroupPacket(uint32_t groups, uint16_t sequence, uint16_t delay_ticks, uint8_t brightness) {
+  uint8_t packet[] = {0, 11, 9,
+                      (uint8_t) (groups >> 24), (uint8_t) (groups >> 16), (uint8_t) (groups >> 8), (uint8_t) groups,
+                      (uint8_t) (sequence >> 8), (uint8_t) sequence,
+                      (uint8_t) (delay_ticks >> 8), (uint8_t) delay_ticks,
+                      2, brightness};
+
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(WIFI_MULTICAST_PORT);
+  address.sin_addr.s_addr = (uint32_t) WIFI_MULTICAST_IP;
+  CHECK_EQUAL((int) sizeof(packet), sendto(sender, packet, sizeof(packet), 0, (const sockaddr *) &address,
+                                           sizeof(address)));
+}
+
+// Runs every controller's loop for a while, and remembers when each one's brightness changed
+static void run(int duration_ms) {
+  for (Emulated &emulated : controllers)
+    emulated.applied_ms = -1;
+
+  int brightness[CONTROLLERS];
+  for (int i = 0; i < CONTROLLERS; ++i)
+    brightness[i] = controllers[i].controller->getBrightness();
+
+  for (unsigned long start = millis(); millis() - start < (unsigned long) duration_ms;) {
+    for (int i = 0; i < CONTROLLERS; ++i) {
+      Emulated &emulated = controllers[i];
+      emulated.server->tick(millis());
+      emulated.controller->update_timed(millis(), 0);
+      if (emulated.applied_ms < 0 && emulated.controller->getBrightness() != brightness[i])
+        emulated.applied_ms = (long) millis();
+    }
+    delay(1);
+  }
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  sender = openSender();
+
+  // Controller i is in group i, and the last one is in all groups
+  for (int i = 0; i < CONTROLLERS; ++i) {
+    Emulated &emulated = controllers[i];
+    emulated.controller = new LedController();
+    emulated.controller->loadConfig();
+    emulated.controller->init();
+    emulated.controller->setBrightness(10);
+    emulated.controller->setGroups(i == CONTROLLERS - 1 ? 0xFFFFFFFF : 1 << i);
+    emulated.controller->update_timed(0, 0);
+
+    emulated.server = new WifiServer(emulated.controller, &scheduler);
+    emulated.server->setup();
+    emulated.server->tick(millis());
+    emulated.server->handleWifiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+    emulated.server->tick(millis());
+    CHECK(emulated.server->isOnline());
+  }
+
+  // Only the controllers in the groups change, all in the same tick, and not before the delay
+  unsigned long sent_ms = millis();
+  sendGroupPacket(1 << 0 | 1 << 2, 1, 4, 77);
+  run(TICK_DURATION * 8);
+  long first = -1, last = -1;
+  for (int i = 0; i < CONTROLLERS; ++i) {
+    bool addressed = i == 0 || i == 2 || i == CONTROLLERS - 1;
+    CHECK_EQUAL(addressed ? 77 : 10, controllers[i].controller->getBrightness());
+    if (!addressed)
+      continue;
+
+    long applied = controllers[i].applied_ms;
+    CHECK(applied >= 0);
+    first = first < 0 ? applied : min(first, applied);
+    last = max(last, applied);
+  }
+  printf("Applied by the addressed controllers between %li and %li ms after sending\n", first - (long) sent_ms,
+         last - (long) sent_ms);
+  CHECK(first - (long) sent_ms >= TICK_DURATION * 4 - 2);
+  CHECK(last - first < TICK_DURATION);
+
+  // A repeat of the packet, sent in case the first one was lost, isn't applied again
+  controllers[0].controller->setBrightness(10);
+  sendGroupPacket(1 << 0, 1, 2, 77);
+  run(TICK_DURATION * 6);
+  CHECK_EQUAL(10, controllers[0].controller->getBrightness());
+
+  // The next one is
+  sendGroupPacket(1 << 0 | 1 << 1, 2, 0, 120);
+  run(TICK_DURATION * 2);
+  CHECK_EQUAL(120, controllers[0].controller->getBrightness());
+  CHECK_EQUAL(120, controllers[1].controller->getBrightness());
+  CHECK_EQUAL(77, controllers[2].controller->getBrightness());
+  CHECK_EQUAL(120, controllers[CONTROLLERS - 1].controller->getBrightness());
+
+  // A controller that's asleep wakes up for a group packet, and doesn't sleep past the tick it's applied in
+  WifiServer *asleep = controllers[1].server;
+  std::thread later([] {
+    delay(200);
+    sendGroupPacket(1 << 1, 3, 4, 30);
+  });
+  int64_t start = esp_timer_get_time();
+  asleep->waitForPacket(INACTIVE_PACKET_READ_INTERVAL);
+  int64_t woken = esp_timer_get_time() - start;
+  later.join();
+  asleep->tick(millis());
+
+  start = esp_timer_get_time();
+  asleep->waitForPacket(INACTIVE_PACKET_READ_INTERVAL);
+  int64_t until_applied = esp_timer_get_time() - start;
+  asleep->tick(millis());
+  controllers[1].controller->update_timed(millis(), 0);
+  printf("Asleep: woke up after %lli ms, then waited %lli ms to apply the packet\n", (long long) woken / 1000,
+         (long long) until_applied / 1000);
+  CHECK(woken < 1000 * 1000);
+  CHECK(until_applied <= (TICK_DURATION * 4 + 20) * 1000);
+  CHECK_EQUAL(30, controllers[1].controller->getBrightness());
+
+  close(sender);
+  return checkResult();
+}
@@ -0,0 +1,99 @@
+#include <EEPROM.h>
+#include <cmath>
+
+#include "led_controller.h"
+
+#include "check.h"
+#include "host.h"
+
+#define DITHER_FRAMES 8
+
+static LedController *controller;
+static int tick = 0;
+
+// The color of a led before the output stage, with the formulas in main(). The host CHSV conversion keeps h, s and v
+static int input(int x, int channel) {
+  return channel == 0 ? x % 256 : channel == 1 ? x * 7 % 256 : (x * 13 + 5) % 256;
+}
+
+// What a channel should be on the strip, in levels with fractions, computed the slow way
+static double reference(int value, int channel, int brightness) {
+  const CRGB correction = CRGB(OUTPUT_CORRECTION);
+  return pow(value / 255.0, OUTPUT_GAMMA) * 255 * (correction[channel] / 255.0) * (brightness / 255.0);
+}
+
+// What FastLED was given, in the order of the buffer
+static std::vector<CRGB> shown() {
+  std::vector<CRGB> leds;
+  for (const CLEDController &strip : FastLED.controllers)
+    leds.insert(leds.end(), strip.leds, strip.leds + strip.count);
+  return leds;
+}
+
+// Renders DITHER_FRAMES frames with the brightness, and checks that every channel only alternates between the levels
+// around the reference, and averages out to it. Returns the largest difference of an average from the reference
+static double checkBrightness(int brightness, const uint16_t *map) {
+  controller->setBrightness(brightness);
+
+  int leds = controller->getLedCount();
+  std::vector<int> sums(leds * 3);
+  int outside = 0;
+  for (int frame = 0; frame < DITHER_FRAMES; ++frame) {
+    controller->update_timed(0, ++tick);
+
+    std::vector<CRGB> output = shown();
+    for (int x = 0; x < leds; ++x) {
+      for (int channel = 0; channel < 3; ++channel) {
+        double expected = reference(input(x, channel), channel, brightness);
+        int level = output[map[x]][channel];
+        outside += level < floor(expected) - 0.01 || level > ceil(expected) + 0.01;
+        sums[x * 3 + channel] += level;
+      }
+    }
+  }
+
+  double worst = 0;
+  for (int x = 0; x < leds; ++x) {
+    for (int channel = 0; channel < 3; ++channel) {
+      double average = (double) sums[x * 3 + channel] / DITHER_FRAMES;
+      worst = max(worst, fabs(average - reference(input(x, channel), channel, brightness)));
+    }
+  }
+
+  printf("Brightness %i: %i levels outside of the reference, averages within %.3f of it\n", brightness, outside, worst);
+  CHECK_EQUAL(0, outside);
+  return worst;
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  FastLED.controllers.clear();
+  controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->setFade(1);
+  controller->setTransitionDuration(0);
+
+  // Every channel goes through all its values
+  CHECK(controller->setFormula(0, int_formula, "x % 256"));
+  CHECK(controller->setFormula(1, int_formula, "x * 7 % 256"));
+  CHECK(controller->setFormula(2, int_formula, "(x * 13 + 5) % 256"));
+  CHECK(controller->getLedCount() >= 256);
+
+  uint16_t *map = controller->getLayout().createMap();
+  for (int brightness : {255, 200, 128, 40, 1}) {
+    // Up to the fraction that 8 frames of dithering can't show, and the rounding of the tables
+    CHECK(checkBrightness(brightness, map) <= 1.0 / DITHER_FRAMES + 2.0 / 256);
+  }
+  delete[] map;
+
+  // Off is completely dark, not dithered
+  controller->setBrightness(0);
+  controller->update_timed(0, ++tick);
+  int lit = 0;
+  for (const CRGB &led : shown())
+    lit += led.r != 0 || led.g != 0 || led.b != 0;
+  CHECK_EQUAL(0, lit);
+
+  return checkResult();
+}
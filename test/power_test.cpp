@@ -0,0 +1,207 @@
+#include <EEPROM.h>
+#include <FastLED.h>
+#include <esp_timer.h>
+#include <thread>
+#include <unistd.h>
+
+#include "frame_scheduler.h"
+#include "led_server.h"
+#include "power_manager.h"
+#include "wifi_server.h"
+
+#include "check.h"
+#include "host.h"
+
+// How long preparing a frame takes in the model
+#define FRAME_COST_US 10000
+
+// A server that receives a packet at a set time, and can either wake the loop up for it or not
+class ModelServer : public LedServer {
+public:
+  bool wakes = true;
+  bool connected = false;
+  int64_t arrival_us = -1; // Of the packet that hasn't been handled yet, -1 if there's none
+  int64_t latency_us = 0; // From the arrival of the last packet until it was handled
+  PowerState power_state = power_awake;
+
+  using LedServer::LedServer;
+
+  void tick(unsigned long current_ms) override {
+    if (arrival_us >= 0 && esp_timer_get_time() >= arrival_us) {
+      latency_us = esp_timer_get_time() - arrival_us;
+      arrival_us = -1;
+    }
+  }
+
+  void waitForPacket(unsigned long timeout_ms) override {
+    int64_t now = esp_timer_get_time();
+    if (wakes && arrival_us >= now && arrival_us - now < (int64_t) timeout_ms * 1000)
+      delay((arrival_us - now + 999) / 1000);
+    else
+      delay(timeout_ms);
+  }
+
+  bool isActive() override {
+    return connected;
+  }
+
+  void setPowerState(PowerState state) override {
+    power_state = state;
+  }
+};
+
+static LedController *controller;
+static FrameLock frame_lock;
+static FrameScheduler scheduler(FRAME_POLICY, &frame_lock);
+static ModelServer *server;
+static PowerManager *power;
+
+// The same as loop() in leds.cpp
+static void loop() {
+  unsigned long current_ms = millis();
+
+  server->tick(current_ms);
+
+  bool lights_on = controller->update_timed(current_ms, scheduler.getTick());
+  advanceClock(FRAME_COST_US);
+
+  if (power->update(lights_on, server->isActive()) == power_asleep) {
+    power->sleep(INACTIVE_PACKET_READ_INTERVAL);
+    return;
+  }
+
+  scheduler.wait();
+
+  FastLED.show();
+}
+
+// Runs the loop for a while, and returns the share of that time the cpu could spend in light sleep
+static double run(int64_t duration_us) {
+  int64_t start = esp_timer_get_time(), sleepable = host.sleepable_us;
+  while (esp_timer_get_time() - start < duration_us)
+    loop();
+  return (double) (host.sleepable_us - sleepable) / (double) (esp_timer_get_time() - start);
+}
+
+// Runs the loop in a state, and checks that frames were only shown with the frame lock held
+static void checkState(const char *name, bool connected, int brightness, PowerState expected, double min_sleep,
+                       double max_sleep) {
+  server->connected = connected;
+  controller->setBrightness(brightness);
+  loop();
+  CHECK_EQUAL(expected, power->getState());
+  CHECK_EQUAL(expected, server->power_state);
+
+  int shows = host.shows;
+  double sleep = run(10 * 1000 * 1000);
+  printf("%s: light sleep %.0f%% of the time, %i frame(s) shown\n", name, sleep * 100, host.shows - shows);
+  CHECK(sleep >= min_sleep && sleep <= max_sleep);
+  CHECK_EQUAL(0, host.unlocked_shows);
+  CHECK(frame_lock.isHeld());
+  CHECK_EQUAL(1, heldPowerLocks(ESP_PM_CPU_FREQ_MAX));
+}
+
+// Sends packets at random times while asleep, and returns the longest it took to handle one
+static int64_t checkLatency(bool wakes) {
+  server->wakes = wakes;
+  int64_t worst = 0;
+  srand(7);
+  for (int packet = 0; packet < 50; ++packet) {
+    server->arrival_us = esp_timer_get_time() + rand() % (10 * 1000 * 1000);
+    while (server->arrival_us >= 0)
+      loop();
+    CHECK_EQUAL(power_asleep, power->getState());
+    worst = max(worst, server->latency_us);
+  }
+  return worst;
+}
+
+// A real Wi-Fi server on loopback: waiting for a packet while asleep returns when one arrives, not after the timeout
+static void checkWifiWakeUp() {
+  WifiServer wifi(controller, &scheduler);
+  wifi.setup();
+  wifi.tick(millis()); // Connects
+  wifi.handleWifiEvent(ARDUINO_EVENT_WIFI_STA_GOT_IP);
+  wifi.tick(millis()); // Opens the sockets
+  CHECK(wifi.isOnline());
+  CHECK(!wifi.isActive());
+
+  int client = socket(AF_INET, SOCK_DGRAM, 0);
+  sockaddr_in address = {};
+  address.sin_family = AF_INET;
+  address.sin_port = htons(WIFI_PORT);
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  // Nothing arrives, so it waits the whole time
+  int64_t start = esp_timer_get_time();
+  wifi.waitForPacket(100);
+  CHECK(esp_timer_get_time() - start >= 90 * 1000);
+
+  std::thread sender([&] {
+    delay(200);
+    const uint8_t ping[] = {0, 1, 0};
+    sendto(client, ping, sizeof(ping), 0, (const sockaddr *) &address, sizeof(address));
+  });
+  start = esp_timer_get_time();
+  wifi.waitForPacket(INACTIVE_PACKET_READ_INTERVAL);
+  int64_t waited = esp_timer_get_time() - start;
+  sender.join();
+  printf("Woke up %lli ms after waiting for a packet, which was sent after 200 ms\n", (long long) waited / 1000);
+  CHECK(waited >= 150 * 1000 && waited < 1000 * 1000);
+
+  // The packet is handled on the next tick, and answered
+  wifi.tick(millis());
+  CHECK(wifi.isActive());
+  uint8_t pong[16];
+  timeval timeout = {1, 0};
+  setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  CHECK_EQUAL(3, recv(client, pong, sizeof(pong), 0));
+  CHECK_EQUAL(0, pong[2]);
+  close(client);
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  controller = new LedController();
+  controller->loadConfig();
+  server = new ModelServer(controller, &scheduler);
+  power = new PowerManager(server, &frame_lock);
+
+  power->setup();
+  controller->init();
+  CHECK_EQUAL(0, host.unlocked_shows);
+  CHECK_EQUAL(1, heldPowerLocks(ESP_PM_CPU_FREQ_MAX));
+  CHECK_EQUAL(2, heldPowerLocks(ESP_PM_NO_LIGHT_SLEEP)); // Awake, and preparing the first frame
+
+  checkWifiWakeUp();
+
+  useFakeClock();
+  scheduler.start();
+  CHECK(controller->setFormula(2, int_formula, "sin8(x * 4 + t)")); // So every frame is rendered
+
+  // Only waiting for the next frame can be spent in light sleep, and only while nobody's connected
+  double frame_share = (double) (TICK_DURATION * 1000 - FRAME_COST_US) / (TICK_DURATION * 1000);
+  checkState("Awake", true, 100, power_awake, 0, 0);
+  checkState("Idle", false, 100, power_idle, frame_share - 0.02, frame_share + 0.02);
+  checkState("Asleep", false, 0, power_asleep, 0.99, 1);
+  checkState("Awake with the leds off", true, 0, power_awake, 0, 0);
+  checkState("Asleep again", false, 0, power_asleep, 0.99, 1);
+
+  // Waking up on a packet handles it right away, otherwise it can take until the next check
+  int64_t woken = checkLatency(true), polled = checkLatency(false);
+  printf("Latency while asleep: at most %lli ms when woken up by the packet, %lli ms without\n",
+         (long long) woken / 1000, (long long) polled / 1000);
+  CHECK(woken <= 1000);
+  CHECK(polled <= INACTIVE_PACKET_READ_INTERVAL * 1000 + FRAME_COST_US);
+  CHECK(polled > woken);
+
+  // A packet that connects a client wakes the controller up completely
+  server->connected = true;
+  int shows = host.shows;
+  run(TICK_DURATION * 1000 * 10);
+  CHECK_EQUAL(power_awake, power->getState());
+  CHECK(host.shows > shows);
+  CHECK_EQUAL(0, host.unlocked_shows);
+
+  return checkResult();
+}
@@ -0,0 +1,180 @@
+#include <EEPROM.h>
+#include <algorithm>
+#include <esp_timer.h>
+#include <tuple>
+
+#include "led_server.h"
+
+#include "check.h"
+#include "host.h"
+
+#define SWITCHES 2000
+
+// Allocations that could hold a copy of a formula set
+static int set_allocations = 0;
+
+void *operator new(size_t size) {
+  if (size >= sizeof(FormulaSet))
+    ++set_allocations;
+  void *memory = malloc(size);
+  if (memory == nullptr)
+    throw std::bad_alloc();
+  return memory;
+}
+
+__attribute__((noinline)) void operator delete(void *memory) noexcept {
+  free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void *memory, size_t) noexcept {
+  free(memory);
+}
+
+static const char *scenes[2][3] = {
+        {"x * 3 + t * 2", "sin8(x * 4 + t) / 2 + 128", "beat(t, 30) / 2 + 64"},
+        {"noise(x * 8, t * 3)", "255", "x % 20 * 12 + 40"},
+};
+
+// An update packet with brightness, fade and the three formulas, like a client sends to change scenes without presets
+static unsigned int writeScene(uint8_t *packet, int scene) {
+  unsigned int index = 0;
+  packet[index++] = 2 | 4 | 8 | 16 | 32;
+  packet[index++] = 100 + scene;
+  packet[index++] = 0;
+  packet[index++] = 1;
+  for (const char *formula : scenes[scene]) {
+    packet[index++] = int_formula;
+    memcpy(packet + index, formula, strlen(formula) + 1);
+    index += strlen(formula) + 1;
+  }
+  return index;
+}
+
+// Changes scenes back and forth, alternating between update packets and presets so both are measured under the same
+// conditions. Returns the microseconds from receiving the packet until the first frame with the new scene was
+// rendered, for update packets and for presets. Medians, so a switch that was interrupted doesn't count
+static std::pair<double, double> measure(LedServer &server, LedController *controller, int &tick) {
+  uint8_t updates[2][256], presets[2][2];
+  for (int scene = 0; scene < 2; ++scene) {
+    writeScene(updates[scene], scene);
+    presets[scene][0] = scene;
+    presets[scene][1] = 0;
+  }
+
+  std::vector<int64_t> times[2];
+  for (int i = 0; i < SWITCHES * 2; ++i) {
+    // Every switch changes the scene, and both ways of switching go to both scenes equally often
+    int scene = i % 2, preset = (i + 1) / 2 % 2;
+    const uint8_t *packet = preset ? presets[scene] : updates[scene];
+
+    int64_t start = esp_timer_get_time();
+    if (preset)
+      server.handlePresetPacket(4, packet);
+    else
+      server.handlePacket(packet, 0);
+    controller->update_timed(0, ++tick);
+    times[preset].push_back(esp_timer_get_time() - start);
+  }
+
+  for (std::vector<int64_t> &method : times)
+    std::nth_element(method.begin(), method.begin() + SWITCHES / 2, method.end());
+  return {(double) times[0][SWITCHES / 2], (double) times[1][SWITCHES / 2]};
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  LedServer server(controller, nullptr);
+
+  // Both scenes as presets
+  int tick = 0;
+  for (int scene = 0; scene < 2; ++scene) {
+    uint8_t packet[256];
+    writeScene(packet, scene);
+    const uint8_t *data = packet;
+    server.handlePacket(data, 0);
+    controller->savePreset(scene, scene == 0 ? "Waves" : "Noise");
+    controller->update_timed(0, ++tick);
+  }
+  CHECK(controller->getPresetName(0) == "Waves");
+  CHECK(controller->getPresetName(1) == "Noise");
+  controller->update_timed(POST_CHANGE_SAVE_DELAY + 1, ++tick); // Saves the config the scenes changed
+
+  // A switch is a pointer swap: nothing is parsed, and nothing is written to flash, not even after a while
+  FormulaData expected;
+  parseFormulaData(int_formula, scenes[1][2], expected);
+  uint32_t formula_bytes = getMemoryReport().used[memory_formula_trees];
+  int commits = host.commits, allocations = set_allocations;
+  controller->selectPreset(0);
+  controller->update_timed(0, ++tick);
+  CHECK_EQUAL(100, controller->getBrightness());
+  controller->selectPreset(1);
+  controller->update_timed(0, ++tick);
+  CHECK(controller->getFormula(2) == expected.text);
+  CHECK_EQUAL(101, controller->getBrightness());
+  CHECK_EQUAL(formula_bytes, getMemoryReport().used[memory_formula_trees]);
+  CHECK_EQUAL(allocations, set_allocations);
+  controller->update_timed(POST_CHANGE_SAVE_DELAY * 3, ++tick);
+  CHECK_EQUAL(commits, host.commits);
+
+  // A formula changed in the same batch edits a copy, so the preset itself stays as it was saved
+  FormulaData first, second;
+  parseFormulaData(int_formula, scenes[0][0], first);
+  parseFormulaData(int_formula, scenes[0][1], second);
+  allocations = set_allocations;
+  controller->selectPreset(0);
+  CHECK(controller->setFormula(1, int_formula, "x * 5"));
+  controller->update_timed(0, ++tick);
+  CHECK_EQUAL(allocations + 1, set_allocations);
+  CHECK(controller->getFormula(0) == first.text);
+  CHECK(controller->getFormula(1) == "x * 5");
+  controller->selectPreset(1);
+  controller->update_timed(0, ++tick);
+  controller->selectPreset(0);
+  controller->update_timed(0, ++tick);
+  CHECK(controller->getFormula(1) == second.text);
+
+  double parsed_us, preset_us;
+  std::tie(parsed_us, preset_us) = measure(server, controller, tick);
+  printf("Switching scenes until the first frame, %i leds: %.1f us with an update packet, %.1f us with a preset\n",
+         controller->getLedCount(), parsed_us, preset_us);
+  CHECK(preset_us < parsed_us);
+
+  // A preset that would make the presets bigger than PRESETS_SIZE isn't saved, the slot keeps the preset it had, and
+  // the server tells the client
+  String text = "x";
+  while (text.length() < 250)
+    text += " + x";
+  for (int i = 0; i < 3; ++i)
+    CHECK(controller->setFormula(i, int_formula, text.c_str()));
+  controller->update_timed(0, ++tick);
+  int slot = 0;
+  for (; slot < PRESET_SLOTS && controller->savePreset(slot, "Long"); ++slot)
+    controller->update_timed(0, ++tick);
+  printf("Presets with the longest formulas: %i of %i slots\n", slot, PRESET_SLOTS);
+  CHECK(slot > 0 && slot < PRESET_SLOTS);
+  String name = controller->getPresetName(slot);
+  CHECK(name != "Long");
+  controller->update_timed(POST_CHANGE_SAVE_DELAY * 3, ++tick);
+  commits = host.commits;
+  uint8_t packet[] = {(uint8_t) slot, 'N', 'e', 'w', 0};
+  const uint8_t *data = packet;
+  CHECK(!server.handlePresetPacket(5, data));
+  controller->update_timed(POST_CHANGE_SAVE_DELAY * 3, ++tick);
+  CHECK(controller->getPresetName(slot) == name);
+  CHECK_EQUAL(commits, host.commits);
+
+  // The render task checks again, with the formulas that were changed right before it
+  for (int i = 0; i < 3; ++i)
+    CHECK(controller->setFormula(i, int_formula, "x"));
+  controller->update_timed(0, ++tick);
+  for (int i = 0; i < 3; ++i)
+    CHECK(controller->setFormula(i, int_formula, (text + " + x + x").c_str()));
+  CHECK(controller->savePreset(slot, "Late"));
+  controller->update_timed(POST_CHANGE_SAVE_DELAY * 3, ++tick);
+  CHECK(controller->getPresetName(slot) == name);
+
+  return checkResult();
+}
@@ -0,0 +1,119 @@
+#include <atomic>
+#include <thread>
+
+#include <EEPROM.h>
+
+#include "led_controller.h"
+#include "spsc_queue.h"
+
+#include "check.h"
+
+// Large enough that a torn read would show, like a packet in the BLE queue
+struct Item {
+  unsigned int sequence;
+  unsigned int data[63];
+};
+
+// One thread writes items in place while the other reads them in place
+static void stressQueue() {
+  static SpscQueue<Item, 4> queue;
+  const unsigned int count = 200000;
+
+  std::thread producer([] {
+    for (unsigned int sequence = 0; sequence < count;) {
+      Item *item = queue.acquire();
+      if (item == nullptr) {
+        std::this_thread::yield();
+        continue;
+      }
+      item->sequence = sequence;
+      for (unsigned int &value : item->data)
+        value = sequence * 31;
+      queue.publish();
+      ++sequence;
+    }
+  });
+
+  unsigned int expected = 0, torn = 0;
+  while (expected < count) {
+    Item *item = queue.front();
+    if (item == nullptr) {
+      std::this_thread::yield();
+      continue;
+    }
+    CHECK_EQUAL(expected, item->sequence);
+    for (unsigned int value : item->data)
+      torn += value != item->sequence * 31;
+    queue.pop();
+    ++expected;
+  }
+  producer.join();
+
+  CHECK_EQUAL(0, torn);
+  CHECK(queue.front() == nullptr);
+}
+
+// A network task changes and reads the controller while the render task renders, like with BLE on the other core
+static void stressController() {
+  EEPROM.begin(CONFIG_SIZE);
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->setTransitionDuration(3);
+
+  std::atomic<bool> done{false};
+  std::thread network([&] {
+    char formula[32];
+    for (int i = 0; i < 3000; ++i) {
+      snprintf(formula, sizeof(formula), "x * %i + t", i % 17);
+      controller->setFormula(i % 3, int_formula, formula);
+      controller->setBrightness(i % 5 == 0 ? 0 : 100);
+      controller->setFade(1 + i % 3 * 40);
+      controller->setKeyframeInterval(1 + i % 4);
+      controller->setVariable('a', int_formula, i % 7 == 0 ? "" : "t / 2");
+
+      Zone zone;
+      zone.start = (uint16_t) (i % 100);
+      zone.count = 20;
+      parseFormulaData(int_formula, "x", zone.formulas[0]);
+      parseFormulaData(int_formula, "255", zone.formulas[1]);
+      parseFormulaData(int_formula, "a", zone.formulas[2]);
+      zone.updateFlags();
+      controller->setZones(i % 4 == 0 ? std::vector<Zone>() : std::vector<Zone>{zone});
+
+      if (i % 100 == 0)
+        controller->setDeviceName(i % 200 == 0 ? "Controller" : "Renamed controller");
+      if (i % 50 == 0)
+        controller->savePreset(i / 50 % PRESET_SLOTS, "Preset");
+      if (i % 50 == 25)
+        controller->selectPreset(i / 50 % PRESET_SLOTS);
+
+      // Whatever is read belongs together
+      CHECK(controller->getFormula(i % 3).length() > 0);
+      CHECK(controller->getDeviceName().length() > 0);
+      for (const Variable &variable : controller->getVariables())
+        CHECK(variable.name == 'a' && variable.formula.form != nullptr);
+      for (const Zone &read : controller->getZones())
+        CHECK(read.count == 20 && read.formulas[2].form != nullptr);
+      controller->getPresetName(i % PRESET_SLOTS);
+      controller->getVersion();
+    }
+    done = true;
+  });
+
+  int tick = 0;
+  while (!done)
+    controller->update_timed(0, tick++);
+  network.join();
+  controller->update_timed(0, tick);
+
+  printf("Rendered %i ticks while the controller was changed\n", tick);
+  CHECK(controller->getFormula(2999 % 3) == "x * 7 + t"); // The last change
+}
+
+int main() {
+  stressQueue();
+  stressController();
+
+  return checkResult();
+}
@@ -0,0 +1,98 @@
+#ifndef LEDS_TEST_ARDUINO_H
+#define LEDS_TEST_ARDUINO_H
+
+// Just enough of the Arduino core to build the firmware on a host, see stubs.cpp
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+using std::min;
+using std::max;
+
+#define OUTPUT 1
+#define PI 3.1415926535897932384626433832795
+
+class String {
+private:
+  std::string s;
+
+public:
+  String() = default;
+  String(const char *str) : s(str == nullptr ? "" : str) {}
+  String(const std::string &str) : s(str) {}
+  explicit String(char c) : s(1, c) {}
+  explicit String(int value) : s(std::to_string(value)) {}
+  explicit String(unsigned int value) : s(std::to_string(value)) {}
+  explicit String(long value) : s(std::to_string(value)) {}
+  explicit String(unsigned long value) : s(std::to_string(value)) {}
+  explicit String(double value, unsigned int decimals = 2) {
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+    s = buffer;
+  }
+
+  unsigned int length() const { return (unsigned int) s.size(); }
+  const char *c_str() const { return s.c_str(); }
+  char operator[](unsigned int index) const { return s[index]; }
+
+  String &operator+=(const String &other) { s += other.s; return *this; }
+  String &operator+=(const char *other) { s += other; return *this; }
+  String &operator+=(char other) { s += other; return *this; }
+  bool operator==(const String &other) const { return s == other.s; }
+  bool operator!=(const String &other) const { return s != other.s; }
+
+  bool startsWith(const String &prefix) const { return s.compare(0, prefix.s.size(), prefix.s) == 0; }
+  bool endsWith(const String &suffix) const {
+    return s.size() >= suffix.s.size() && s.compare(s.size() - suffix.s.size(), suffix.s.size(), suffix.s) == 0;
+  }
+  int indexOf(char c) const {
+    size_t index = s.find(c);
+    return index == std::string::npos ? -1 : (int) index;
+  }
+  String substring(unsigned int begin) const { return s.substr(begin); }
+  String substring(unsigned int begin, unsigned int end) const { return s.substr(begin, end - begin); }
+};
+
+inline String operator+(const String &a, const String &b) {
+  String result = a;
+  result += b;
+  return result;
+}
+
+struct HardwareSerial {
+  void begin(int) {}
+  int printf(const char *format, ...) __attribute__((format(printf, 2, 3)));
+  void print(const char *str) { fputs(str, stdout); }
+  void println(const char *str = "") { puts(str); }
+  void println(const String &str) { puts(str.c_str()); }
+};
+
+extern HardwareSerial Serial;
+
+struct EspClass {
+  void restart();
+};
+
+extern EspClass ESP;
+
+typedef void *TaskHandle_t;
+
+TaskHandle_t xTaskGetCurrentTaskHandle();
+
+unsigned long millis();
+unsigned long micros();
+void delay(uint32_t ms);
+void yield();
+
+void pinMode(int pin, int mode);
+void digitalWrite(int pin, int value);
+
+uint32_t esp_random();
+long random(long max);
+
+#endif //LEDS_TEST_ARDUINO_H
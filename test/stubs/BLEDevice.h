@@ -0,0 +1,93 @@
+#ifndef LEDS_TEST_BLEDEVICE_H
+#define LEDS_TEST_BLEDEVICE_H
+
+#include <vector>
+
+#include "Arduino.h"
+
+// The BLE classes the server uses, without a radio. A characteristic keeps the last value that was set, and every
+// value it notified
+
+union esp_ble_gatts_cb_param_t {
+  struct {
+    uint16_t conn_id, mtu;
+  } mtu;
+};
+
+class BLECharacteristic;
+class BLEServer;
+
+class BLECharacteristicCallbacks {
+public:
+  virtual ~BLECharacteristicCallbacks() = default;
+  virtual void onWrite(BLECharacteristic *characteristic) {}
+};
+
+class BLEServerCallbacks {
+public:
+  virtual ~BLEServerCallbacks() = default;
+  virtual void onConnect(BLEServer *server) {}
+  virtual void onDisconnect(BLEServer *server) {}
+  virtual void onMtuChanged(BLEServer *server, esp_ble_gatts_cb_param_t *param) {}
+};
+
+class BLEDescriptor {
+public:
+  void setValue(const char *) {}
+};
+
+class BLE2902 : public BLEDescriptor {};
+
+class BLECharacteristic {
+private:
+  std::vector<uint8_t> value;
+
+public:
+  static const uint32_t PROPERTY_READ = 1 << 0, PROPERTY_WRITE = 1 << 1, PROPERTY_NOTIFY = 1 << 2,
+          PROPERTY_INDICATE = 1 << 3, PROPERTY_WRITE_NR = 1 << 4;
+
+  void setCallbacks(BLECharacteristicCallbacks *) {}
+  void addDescriptor(BLEDescriptor *) {}
+
+  uint8_t *getData() { return value.data(); }
+  size_t getLength() const { return value.size(); }
+  std::vector<std::vector<uint8_t>> notified;
+
+  void setValue(const uint8_t *data, size_t length) { value.assign(data, data + length); }
+  void notify() { notified.push_back(value); }
+};
+
+class BLEService {
+public:
+  // The characteristic that was created last, so tests can write to it
+  static inline BLECharacteristic *created = nullptr;
+
+  BLECharacteristic *createCharacteristic(const char *, uint32_t) { return created = new BLECharacteristic(); }
+  void addCharacteristic(BLECharacteristic *) {}
+  void start() {}
+};
+
+class BLEServer {
+public:
+  void setCallbacks(BLEServerCallbacks *) {}
+  BLEService *createService(const char *) { return new BLEService(); }
+  void startAdvertising() {}
+};
+
+class BLEAdvertising {
+public:
+  void addServiceUUID(const char *) {}
+  void start() {}
+};
+
+struct BLEDevice {
+  static void init(const char *) {}
+  static int setMTU(uint16_t) { return 0; }
+  static BLEServer *createServer() { return new BLEServer(); }
+  static BLEAdvertising *getAdvertising() {
+    static BLEAdvertising advertising;
+    return &advertising;
+  }
+};
+
+#endif //LEDS_TEST_BLEDEVICE_H
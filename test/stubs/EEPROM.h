@@ -0,0 +1,43 @@
+#ifndef LEDS_TEST_EEPROM_H
+#define LEDS_TEST_EEPROM_H
+
+#include <vector>
+
+#include "Arduino.h"
+
+// Like arduino-esp32's, reads and writes go to a copy that begin() loads from flash and commit() stores, and the ones
+// outside of the size given to begin() are ignored
+class EEPROMClass {
+private:
+  std::vector<uint8_t> data, flash;
+
+public:
+  EEPROMClass() = default;
+  explicit EEPROMClass(const char *) {}
+
+  bool begin(size_t size) {
+    data = flash;
+    data.resize(size);
+    return true;
+  }
+
+  size_t length() const { return data.size(); }
+
+  uint8_t read(int address) const { return address >= 0 && address < (int) data.size() ? data[address] : 0; }
+  void write(int address, uint8_t value) {
+    if (address >= 0 && address < (int) data.size())
+      data[address] = value;
+  }
+
+  size_t readBytes(int address, void *value, size_t length) const;
+  size_t writeBytes(int address, const void *value, size_t length);
+  String readString(int address) const;
+  size_t writeString(int address, const String &value);
+
+  // Counted in host.commits, see host.h
+  bool commit();
+};
+
+extern EEPROMClass EEPROM;
+
+#endif //LEDS_TEST_EEPROM_H
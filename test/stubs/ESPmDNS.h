@@ -0,0 +1,10 @@
+#ifndef LEDS_TEST_ESPMDNS_H
+#define LEDS_TEST_ESPMDNS_H
+
+struct MDNSResponder {
+  bool begin(const char *) { return true; }
+};
+
+extern MDNSResponder MDNS;
+
+#endif //LEDS_TEST_ESPMDNS_H
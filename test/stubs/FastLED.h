@@ -0,0 +1,74 @@
+#ifndef LEDS_TEST_FASTLED_H
+#define LEDS_TEST_FASTLED_H
+
+#include <cstdint>
+#include <deque>
+
+#define DISABLE_DITHER 0
+#define BINARY_DITHER 1
+
+enum EOrder {
+  RGB, GRB
+};
+
+enum LEDColorCorrection : uint32_t {
+  TypicalLEDStrip = 0xFFB0F0, UncorrectedColor = 0xFFFFFF
+};
+
+struct CHSV {
+  uint8_t h = 0, s = 0, v = 0;
+
+  CHSV() = default;
+  CHSV(uint8_t h, uint8_t s, uint8_t v) : h(h), s(s), v(v) {}
+};
+
+struct CRGB {
+  union {
+    struct {
+      uint8_t r, g, b;
+    };
+    uint8_t raw[3];
+  };
+
+  CRGB() : r(0), g(0), b(0) {}
+  CRGB(uint8_t r, uint8_t g, uint8_t b) : r(r), g(g), b(b) {}
+  CRGB(uint32_t color) : r(color >> 16), g(color >> 8), b(color) {}
+  // Not FastLED's conversion, tests only compare the firmware with itself or with a reference using the same one
+  CRGB(const CHSV &hsv) : r(hsv.h), g(hsv.s), b(hsv.v) {}
+
+  uint8_t &operator[](int index) { return raw[index]; }
+  const uint8_t &operator[](int index) const { return raw[index]; }
+  bool operator==(const CRGB &other) const { return r == other.r && g == other.g && b == other.b; }
+  bool operator!=(const CRGB &other) const { return !(*this == other); }
+};
+
+template<uint8_t PIN>
+struct WS2812B {};
+
+// A strip that was added, with the leds that are shown on it
+struct CLEDController {
+  uint8_t pin;
+  const CRGB *leds;
+  int count;
+
+  CLEDController &setCorrection(uint32_t) { return *this; }
+};
+
+struct CFastLED {
+  std::deque<CLEDController> controllers;
+
+  template<template<uint8_t> class CHIPSET, uint8_t PIN, EOrder ORDER>
+  CLEDController &addLeds(CRGB *leds, int offset, int count) {
+    controllers.push_back({PIN, leds + offset, count});
+    return controllers.back();
+  }
+
+  void setBrightness(uint8_t) {}
+  void setDither(uint8_t) {}
+  // Counted in host.shows, see host.h
+  void show();
+};
+
+extern CFastLED FastLED;
+
+#endif //LEDS_TEST_FASTLED_H
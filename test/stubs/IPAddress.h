@@ -0,0 +1,32 @@
+#ifndef LEDS_TEST_IPADDRESS_H
+#define LEDS_TEST_IPADDRESS_H
+
+#include "Arduino.h"
+
+// Stored in network order, like on the controller
+class IPAddress {
+private:
+  uint8_t bytes[4] = {};
+
+public:
+  IPAddress() = default;
+  IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) : bytes{a, b, c, d} {}
+  IPAddress(uint32_t address) { memcpy(bytes, &address, 4); }
+
+  operator uint32_t() const {
+    uint32_t address;
+    memcpy(&address, bytes, 4);
+    return address;
+  }
+
+  uint8_t operator[](int index) const { return bytes[index]; }
+  bool operator==(const IPAddress &other) const { return memcmp(bytes, other.bytes, 4) == 0; }
+
+  String toString() const {
+    char str[16];
+    snprintf(str, sizeof(str), "%i.%i.%i.%i", bytes[0], bytes[1], bytes[2], bytes[3]);
+    return str;
+  }
+};
+
+#endif //LEDS_TEST_IPADDRESS_H
@@ -0,0 +1,37 @@
+#ifndef LEDS_TEST_WIFI_H
+#define LEDS_TEST_WIFI_H
+
+#include "Arduino.h"
+#include "IPAddress.h"
+#include "WiFiUdp.h"
+
+#define WIFI_STA 1
+
+typedef enum {
+  ARDUINO_EVENT_WIFI_STA_CONNECTED, ARDUINO_EVENT_WIFI_STA_DISCONNECTED, ARDUINO_EVENT_WIFI_STA_GOT_IP,
+  ARDUINO_EVENT_WIFI_STA_LOST_IP
+} arduino_event_id_t;
+
+typedef enum {
+  WIFI_PS_NONE, WIFI_PS_MIN_MODEM, WIFI_PS_MAX_MODEM
+} wifi_ps_type_t;
+
+// Always connected to the loopback interface
+struct WiFiClass {
+  void mode(int) {}
+  void onEvent(void (*)(arduino_event_id_t)) {}
+  bool config(IPAddress, IPAddress, IPAddress) { return true; }
+  bool setHostname(const char *) { return true; }
+  bool setAutoReconnect(bool) { return true; }
+  int begin(const char *, const char *) { return 0; }
+  bool disconnect() { return true; }
+  bool setSleep(wifi_ps_type_t) { return true; }
+
+  IPAddress localIP() { return {127, 0, 0, 1}; }
+  IPAddress gatewayIP() { return {127, 0, 0, 1}; }
+  int8_t RSSI() { return -50; }
+};
+
+extern WiFiClass WiFi;
+
+#endif //LEDS_TEST_WIFI_H
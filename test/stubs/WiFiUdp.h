@@ -0,0 +1,26 @@
+#ifndef LEDS_TEST_WIFIUDP_H
+#define LEDS_TEST_WIFIUDP_H
+
+#include "Arduino.h"
+#include "IPAddress.h"
+
+// Never receives anything
+class WiFiUDP {
+public:
+  uint8_t begin(uint16_t) { return 1; }
+  void setTimeout(unsigned long) {}
+  void stop() {}
+
+  int parsePacket() { return 0; }
+  int available() { return 0; }
+  int read(uint8_t *, size_t) { return 0; }
+  IPAddress remoteIP() { return {}; }
+  uint16_t remotePort() { return 0; }
+
+  int beginPacket() { return 1; }
+  int beginPacket(IPAddress, uint16_t) { return 1; }
+  size_t write(const uint8_t *, size_t length) { return length; }
+  int endPacket() { return 1; }
+};
+
+#endif //LEDS_TEST_WIFIUDP_H
@@ -0,0 +1,14 @@
+#ifndef LEDS_TEST_ESP_HEAP_CAPS_H
+#define LEDS_TEST_ESP_HEAP_CAPS_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+// There's no heap to measure on a host, these are roughly what a controller has left after startup
+inline size_t heap_caps_get_free_size(uint32_t) { return 200000; }
+inline size_t heap_caps_get_minimum_free_size(uint32_t) { return 180000; }
+inline size_t heap_caps_get_largest_free_block(uint32_t) { return 110000; }
+
+#endif //LEDS_TEST_ESP_HEAP_CAPS_H
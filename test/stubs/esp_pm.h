@@ -0,0 +1,28 @@
+#ifndef LEDS_TEST_ESP_PM_H
+#define LEDS_TEST_ESP_PM_H
+
+#define CONFIG_PM_ENABLE 1
+
+#define ESP_OK 0
+
+typedef int esp_err_t;
+
+typedef enum {
+  ESP_PM_CPU_FREQ_MAX, ESP_PM_APB_FREQ_MAX, ESP_PM_NO_LIGHT_SLEEP
+} esp_pm_lock_type_t;
+
+typedef struct {
+  int max_freq_mhz;
+  int min_freq_mhz;
+  bool light_sleep_enable;
+} esp_pm_config_esp32_t;
+
+// Locks count how often they're held, see host.h
+typedef struct HostPmLock *esp_pm_lock_handle_t;
+
+esp_err_t esp_pm_configure(const void *config);
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int arg, const char *name, esp_pm_lock_handle_t *handle);
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle);
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle);
+
+#endif //LEDS_TEST_ESP_PM_H
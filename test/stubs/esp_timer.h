@@ -0,0 +1,8 @@
+#ifndef LEDS_TEST_ESP_TIMER_H
+#define LEDS_TEST_ESP_TIMER_H
+
+#include <cstdint>
+
+int64_t esp_timer_get_time();
+
+#endif //LEDS_TEST_ESP_TIMER_H
@@ -0,0 +1,27 @@
+#ifndef LEDS_TEST_HOST_H
+#define LEDS_TEST_HOST_H
+
+#include <cstdint>
+
+#include <esp_pm.h>
+
+// What the stubs saw the firmware do, so tests can check for side effects
+struct HostCounters {
+  int restarts = 0;
+  int commits = 0; // Of any EEPROMClass
+  int shows = 0;
+  int unlocked_shows = 0; // Shown while power management could slow the cpu down or enter light sleep
+  int64_t sleepable_us = 0; // Spent in delay() while light sleep was allowed
+};
+
+extern HostCounters host;
+
+// From now on time only passes in delay() and advanceClock(), so timing doesn't depend on the machine
+void useFakeClock();
+void advanceClock(int64_t us);
+
+// Number of locks of a type that are held
+int heldPowerLocks(esp_pm_lock_type_t type);
+bool isLightSleepAllowed();
+
+#endif //LEDS_TEST_HOST_H
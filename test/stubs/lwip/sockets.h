@@ -0,0 +1,10 @@
+#ifndef LEDS_TEST_LWIP_SOCKETS_H
+#define LEDS_TEST_LWIP_SOCKETS_H
+
+// lwip has the same socket API as the host
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+
+#endif //LEDS_TEST_LWIP_SOCKETS_H
@@ -0,0 +1,168 @@
+#include <chrono>
+#include <cstdarg>
+#include <thread>
+
+#include <Arduino.h>
+#include <EEPROM.h>
+#include <ESPmDNS.h>
+#include <FastLED.h>
+#include <WiFi.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+
+#include "host.h"
+
+HostCounters host;
+
+HardwareSerial Serial;
+EspClass ESP;
+CFastLED FastLED;
+EEPROMClass EEPROM;
+WiFiClass WiFi;
+MDNSResponder MDNS;
+
+static bool pm_configured = false, light_sleep_enabled = false;
+static int held_locks[3] = {};
+
+static const auto start_time = std::chrono::steady_clock::now();
+static bool fake_clock = false;
+static int64_t fake_us = 0;
+
+void useFakeClock() {
+  fake_us = esp_timer_get_time();
+  fake_clock = true;
+}
+
+void advanceClock(int64_t us) {
+  fake_us += us;
+}
+
+int64_t esp_timer_get_time() {
+  if (fake_clock)
+    return fake_us;
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+unsigned long millis() {
+  return (unsigned long) (esp_timer_get_time() / 1000);
+}
+
+unsigned long micros() {
+  return (unsigned long) esp_timer_get_time();
+}
+
+void delay(uint32_t ms) {
+  if (isLightSleepAllowed())
+    host.sleepable_us += ms * 1000;
+
+  if (fake_clock)
+    fake_us += ms * 1000;
+  else
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void yield() {}
+
+void pinMode(int, int) {}
+
+void digitalWrite(int, int) {}
+
+uint32_t esp_random() {
+  return (uint32_t) rand();
+}
+
+long random(long max) {
+  return rand() % max;
+}
+
+int HardwareSerial::printf(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vprintf(format, args);
+  va_end(args);
+  return length;
+}
+
+void EspClass::restart() {
+  ++host.restarts;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle() {
+  static thread_local int task;
+  return &task;
+}
+
+void CFastLED::show() {
+  ++host.shows;
+  if (pm_configured && (heldPowerLocks(ESP_PM_CPU_FREQ_MAX) == 0 || isLightSleepAllowed()))
+    ++host.unlocked_shows;
+}
+
+size_t EEPROMClass::readBytes(int address, void *value, size_t length) const {
+  if (address < 0 || address + length > data.size())
+    return 0;
+  memcpy(value, data.data() + address, length);
+  return length;
+}
+
+size_t EEPROMClass::writeBytes(int address, const void *value, size_t length) {
+  if (address < 0 || address + length > data.size())
+    return 0;
+  memcpy(data.data() + address, value, length);
+  return length;
+}
+
+String EEPROMClass::readString(int address) const {
+  String value;
+  for (int i = address; i >= 0 && i < (int) data.size() && data[i] != 0; ++i)
+    value += (char) data[i];
+  return value;
+}
+
+size_t EEPROMClass::writeString(int address, const String &value) {
+  return writeBytes(address, value.c_str(), value.length() + 1);
+}
+
+bool EEPROMClass::commit() {
+  ++host.commits;
+  flash = data;
+  return true;
+}
+
+struct HostPmLock {
+  esp_pm_lock_type_t type;
+  int count;
+};
+
+esp_err_t esp_pm_configure(const void *config) {
+  pm_configured = true;
+  light_sleep_enabled = ((const esp_pm_config_esp32_t *) config)->light_sleep_enable;
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_create(esp_pm_lock_type_t type, int, const char *, esp_pm_lock_handle_t *handle) {
+  *handle = new HostPmLock{type, 0};
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_acquire(esp_pm_lock_handle_t handle) {
+  ++handle->count;
+  ++held_locks[handle->type];
+  return ESP_OK;
+}
+
+esp_err_t esp_pm_lock_release(esp_pm_lock_handle_t handle) {
+  if (handle->count == 0) // Like ESP-IDF, which returns ESP_ERR_INVALID_STATE
+    return -1;
+  --handle->count;
+  --held_locks[handle->type];
+  return ESP_OK;
+}
+
+int heldPowerLocks(esp_pm_lock_type_t type) {
+  return held_locks[type];
+}
+
+bool isLightSleepAllowed() {
+  return light_sleep_enabled && held_locks[ESP_PM_NO_LIGHT_SLEEP] == 0;
+}
@@ -0,0 +1,228 @@
+#include <EEPROM.h>
+
+#include "bluetooth_server.h"
+
+#include "check.h"
+#include "host.h"
+
+static LedController *controller;
+static FrameScheduler scheduler(FRAME_POLICY);
+static LedServer *server;
+
+static uint32_t readInt(const uint8_t *data) {
+  return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+// Runs the loop for a number of ticks
+static void run(int ticks) {
+  for (int i = 0; i < ticks; ++i) {
+    controller->update_timed(millis(), scheduler.getTick());
+    scheduler.wait();
+  }
+}
+
+// A packet that's received over Wi-Fi: recorded, and then handled
+static void receive(uint8_t id, const std::vector<uint8_t> &packet) {
+  server->recordPacket(id, packet.data(), packet.size());
+  const uint8_t *data = packet.data();
+  if (id == 1)
+    server->handlePacket(data, millis());
+  else
+    server->handlePresetPacket(id, data);
+}
+
+static std::vector<uint8_t> trace(uint8_t command, unsigned int offset = 0) {
+  uint8_t request[] = {command, (uint8_t) (offset >> 8), (uint8_t) offset};
+  const uint8_t *packet = request;
+  std::vector<uint8_t> reply(1024);
+  unsigned int length = 0;
+  server->handleTracePacket(packet, reply.data(), length, reply.size(), millis());
+  reply.resize(length);
+  return reply;
+}
+
+// The checksums of a replay, without the render times. It's rendered a few ticks per loop iteration, which don't
+// change the state in between
+static std::vector<uint32_t> replay() {
+  CHECK(trace(3).empty());
+  CHECK(server->isReplaying());
+  String formula = controller->getFormula(0);
+  std::vector<uint8_t> reply(1024);
+  unsigned int length = 0, steps = 1;
+  for (; !server->continueReplay(reply.data(), length, reply.size(), millis()); ++steps) {
+    CHECK(server->isReplaying());
+    CHECK_EQUAL(0u, length);
+  }
+  reply.resize(length);
+  CHECK(!server->isReplaying());
+  CHECK(controller->getFormula(0) == formula);
+  CHECK(reply.size() >= 20);
+  CHECK(steps >= (readInt(reply.data()) + TRACE_REPLAY_TICKS - 1) / TRACE_REPLAY_TICKS);
+  std::vector<uint32_t> checksums = {readInt(reply.data()), readInt(reply.data() + 16)};
+  for (unsigned int offset = 20; offset + 12 <= reply.size(); offset += 12) {
+    checksums.push_back(readInt(reply.data() + offset));
+    checksums.push_back(readInt(reply.data() + offset + 8));
+  }
+  return checksums;
+}
+
+static std::vector<uint8_t> withString(std::vector<uint8_t> packet, const char *text) {
+  packet.insert(packet.end(), text, text + strlen(text) + 1);
+  return packet;
+}
+
+// The ids of the entries in a trace
+static std::vector<uint8_t> entryIds(const std::vector<uint8_t> &entries) {
+  std::vector<uint8_t> ids;
+  for (unsigned int offset = 0; offset + 7 <= entries.size();) {
+    ids.push_back(entries[offset + 6]);
+    offset += 7 + (entries[offset + 4] << 8 | entries[offset + 5]);
+  }
+  return ids;
+}
+
+// The whole trace, in as many parts as it takes
+static std::vector<uint8_t> download() {
+  std::vector<uint8_t> entries;
+  for (unsigned int size = 1; entries.size() < size;) {
+    std::vector<uint8_t> reply = trace(2, entries.size());
+    size = reply[0] << 8 | reply[1];
+    entries.insert(entries.end(), reply.begin() + 4, reply.end());
+  }
+  return entries;
+}
+
+// Writes a packet to the Bluetooth server in one chunk, and handles it
+static void writeBle(BluetoothServer &ble, std::vector<uint8_t> packet) {
+  packet.insert(packet.begin(), CHUNK_SINGLE);
+  BLEService::created->setValue(packet.data(), packet.size());
+  ble.onWrite(BLEService::created);
+  ble.tick(millis());
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  useFakeClock();
+  controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  server = new LedServer(controller, &scheduler);
+  scheduler.start();
+
+  CHECK(controller->setFormula(0, int_formula, "sin8(x * 4 + t)"));
+  CHECK(controller->setFormula(2, int_formula, "val(x) * 9 / 10 + (x = t % 60) * 255"));
+  controller->setBrightness(100);
+  controller->savePreset(2, "Live");
+  run(10);
+
+  // Recording what a client does: a fade, a new formula, a preset that's saved and selected, and a layout that's
+  // only in the trace, since applying it here would restart the controller
+  trace(0);
+  run(5);
+  receive(1, {2 | 4, 200, 0, 4});
+  run(15);
+  receive(1, withString({8, 0}, "x * 3 + t"));
+  run(10);
+  LedLayout layout;
+  layout.strip[0].reversed = !layout.strip[0].reversed;
+  std::vector<uint8_t> layoutPacket(64);
+  unsigned int layoutLength = 2;
+  layoutPacket[0] = 128;
+  layoutPacket[1] = 1;
+  layout.write(layoutPacket.data(), layoutLength);
+  layoutPacket.resize(layoutLength);
+  server->recordPacket(1, layoutPacket.data(), layoutPacket.size());
+  run(10);
+  receive(5, withString({3}, "Replayed"));
+  run(10);
+  receive(4, {2});
+  run(20);
+  trace(1);
+  std::vector<uint8_t> ids = entryIds(download());
+  CHECK((ids == std::vector<uint8_t>{1, 3, 1, 1, 1, 5, 4}));
+
+  // What the packets changed is saved as usual
+  run(POST_CHANGE_SAVE_DELAY / TICK_DURATION + 20);
+  int commits;
+  String formula = controller->getFormula(0);
+  int brightness = controller->getBrightness(), fade = controller->getFade();
+  controller->savePreset(3, "Other"); // The trace saves a preset in this slot too
+  run(1);
+  commits = host.commits;
+
+  // Replaying doesn't save anything, doesn't restart the controller, and doesn't change its state
+  std::vector<uint32_t> first = replay();
+  run(POST_CHANGE_SAVE_DELAY / TICK_DURATION + 20);
+  printf("Replayed %u ticks with %i packets applied, %i commits and %i restarts after it\n", first[0],
+         (int) (first.size() - 2) / 2, host.commits - commits, host.restarts);
+  CHECK_EQUAL(commits, host.commits);
+  CHECK_EQUAL(0, host.restarts);
+  CHECK(controller->getFormula(0) == formula);
+  CHECK_EQUAL(brightness, controller->getBrightness());
+  CHECK_EQUAL(fade, controller->getFade());
+  CHECK(controller->getPresetName(2) == "Live");
+  CHECK(controller->getPresetName(3) == "Other");
+  CHECK(controller->getLayout().strip[0].reversed != layout.strip[0].reversed);
+
+  // The trace starts with the state it was recorded in, so whatever the state is now, it gives the same frames
+  CHECK(controller->setFormula(0, int_formula, "255"));
+  CHECK(controller->setFormula(2, int_formula, "x * 2"));
+  controller->setBrightness(30);
+  controller->setFade(1);
+  controller->setPaletteMode(true);
+  run(30);
+  std::vector<uint32_t> second = replay();
+  CHECK(first == second);
+  CHECK(replay() == first);
+  CHECK(controller->isPaletteMode());
+  CHECK(controller->getFormula(2) == "x * 2");
+
+  // A full trace stops recording instead of dropping its first entries, which hold the state
+  trace(0);
+  std::vector<uint8_t> update = withString({1 << 3, 0}, "x * 4 + t % 7 + 1 + 2 + 3 + 4 + 5 + 6 + 7 + 8 + 9");
+  for (int i = 0; i < TRACE_SIZE / (int) update.size() + 10; ++i) {
+    receive(1, update);
+    run(1);
+  }
+  std::vector<uint8_t> reply = trace(2);
+  unsigned int size = reply[0] << 8 | reply[1];
+  ids = entryIds(download());
+  printf("Full trace: %u bytes, %i entries\n", size, (int) ids.size());
+  CHECK(size <= TRACE_SIZE && size > TRACE_SIZE - 7 - update.size());
+  CHECK(ids.size() >= 2 && ids[0] == 1 && ids[1] == 3);
+  receive(1, {2, 5});
+  CHECK_EQUAL(size, (unsigned int) (trace(2)[0] << 8 | trace(2)[1]));
+
+  // Over Bluetooth, reading the status in chunks isn't recorded as an update, but updates are
+  BluetoothServer ble(controller, &scheduler);
+  ble.setup();
+  writeBle(ble, {0, 11, 0});
+  writeBle(ble, {0, 0});
+  writeBle(ble, {0, 1});
+  writeBle(ble, {0, 1});
+  writeBle(ble, {2, 50});
+  writeBle(ble, {0, 11, 1});
+
+  BLEService::created->notified.clear();
+  writeBle(ble, {0, 11, 2, 0, 0});
+  std::vector<uint8_t> downloaded;
+  for (const std::vector<uint8_t> &chunk : BLEService::created->notified)
+    downloaded.insert(downloaded.end(), chunk.begin() + 1, chunk.end());
+  CHECK(downloaded.size() >= 4);
+  ids = entryIds(std::vector<uint8_t>(downloaded.begin() + 4, downloaded.end()));
+  CHECK((ids == std::vector<uint8_t>{1, 3, 1}));
+
+  // The results of a replay are sent once it's done, and packets that arrive while it runs wait for it, instead of
+  // being undone when it ends
+  BLEService::created->notified.clear();
+  writeBle(ble, {0, 11, 3});
+  writeBle(ble, {2, 70});
+  while (ble.isReplaying())
+    ble.tick(millis());
+  CHECK(!BLEService::created->notified.empty());
+  ble.tick(millis());
+  controller->update_timed(millis(), scheduler.getTick());
+  CHECK_EQUAL(70, controller->getBrightness());
+
+  return checkResult();
+}
@@ -0,0 +1,154 @@
+#include <EEPROM.h>
+
+#include "led_server.h"
+
+#include "check.h"
+
+// Bytes of the packet buffer of both servers
+#define BUFFER_SIZE 1024
+
+static FrameScheduler scheduler(FRAME_POLICY);
+
+static LedController *createController() {
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->update_timed(0, 0);
+  return controller;
+}
+
+// A formula of about length characters, which is written the same way as it's parsed
+static String longFormula(const char *term, int length) {
+  String formula = term;
+  while ((int) formula.length() + 3 + (int) strlen(term) <= length)
+    formula += String(" + ") + term;
+  return formula;
+}
+
+static Zone makeZone(int start, const String &hue) {
+  Zone zone;
+  zone.start = start;
+  zone.count = 10;
+  parseFormulaData(int_formula, hue.c_str(), zone.formulas[0]);
+  parseFormulaData(int_formula, "255", zone.formulas[1]);
+  parseFormulaData(int_formula, "x * 4", zone.formulas[2]);
+  zone.updateFlags();
+  return zone;
+}
+
+// Writes the changes since version 0 into a buffer with room for maxLength bytes, checks that nothing was written
+// after them, and applies them to target. Returns the flags of the packet
+static unsigned int transfer(LedServer &source, LedController *target, unsigned int maxLength) {
+  uint8_t buffer[BUFFER_SIZE + 64];
+  memset(buffer, 0xA5, sizeof(buffer));
+  unsigned int length = 0;
+  source.writeChanges(buffer, length, maxLength, 0);
+  CHECK(length <= maxLength);
+  for (unsigned int i = maxLength; i < sizeof(buffer); ++i)
+    CHECK_EQUAL(0xA5, buffer[i]);
+
+  unsigned int flags = buffer[4] & 0x7F;
+  if (buffer[4] & 128)
+    flags |= buffer[5] << 7;
+
+  LedServer server(target, &scheduler);
+  const uint8_t *packet = buffer + 4;
+  server.handlePacket(packet, 0);
+  CHECK(packet <= buffer + length);
+  target->update_timed(0, 0);
+  return flags;
+}
+
+int main() {
+  EEPROM.begin(CONFIG_SIZE);
+  LedController *source = createController();
+  LedServer server(source, &scheduler);
+
+  // Everything fits, and the other controller ends up with the same state
+  CHECK(source->setFormula(0, int_formula, "sin8(x * 4 + t)"));
+  CHECK(source->setVariable('a', int_formula, "t % 100"));
+  CHECK(source->setZones({makeZone(20, "x % 20 * 12")}));
+  source->setBrightness(77);
+  source->update_timed(1, 0);
+
+  LedController *copy = createController();
+  CHECK_EQUAL((1u << STATE_FIELDS) - 1, transfer(server, copy, BUFFER_SIZE));
+  CHECK_EQUAL(77, copy->getBrightness());
+  CHECK(source->getFormula(0) == copy->getFormula(0));
+  CHECK_EQUAL(1, copy->getVariables().size());
+  CHECK_EQUAL(1, copy->getZones().size());
+  CHECK(source->getZones()[0].formulas[0].toString() == copy->getZones()[0].formulas[0].toString());
+
+  // As much as still fits in the config doesn't fit all at once: the fields that don't fit are left out, and the rest
+  // still applies
+  for (int i = 0; i < 3; ++i)
+    CHECK(source->setFormula(i, int_formula, longFormula("x", 250).c_str()));
+  for (char name : {'a', 'b', 'c', 'd'})
+    CHECK(source->setVariable(name, int_formula, longFormula("t", 60).c_str()));
+  CHECK(source->setZones({makeZone(0, longFormula("x * 2", 250)), makeZone(20, longFormula("x * 3", 250))}));
+  source->setBrightness(99);
+  source->update_timed(2, 0);
+  CHECK_EQUAL(4, source->getVariables().size());
+  CHECK_EQUAL(2, source->getZones().size());
+
+  copy = createController();
+  unsigned int flags = transfer(server, copy, BUFFER_SIZE);
+  printf("Update with everything at its longest: flags %x of %x\n", flags, (1u << STATE_FIELDS) - 1);
+  CHECK(flags & (1 << field_brightness));
+  CHECK(flags & (1 << field_hue));
+  CHECK(!(flags & (1 << field_zones)));
+  CHECK_EQUAL(99, copy->getBrightness());
+  CHECK(source->getFormula(0) == copy->getFormula(0));
+  CHECK_EQUAL(0, copy->getZones().size());
+
+  // However small the buffer is
+  for (unsigned int maxLength : {900u, 500u, 100u, 20u, 6u})
+    transfer(server, createController(), maxLength);
+
+  // The status reply keeps every field in its place, so it can still be read
+  for (unsigned int maxLength : {(unsigned int) BUFFER_SIZE, 600u, 100u}) {
+    uint8_t buffer[BUFFER_SIZE + 64];
+    memset(buffer, 0xA5, sizeof(buffer));
+    unsigned int length = 0;
+    server.writePacket(buffer, length, maxLength);
+    CHECK(length <= maxLength);
+    for (unsigned int i = maxLength; i < sizeof(buffer); ++i)
+      CHECK_EQUAL(0xA5, buffer[i]);
+
+    const uint8_t *data = buffer;
+    data += 1 + *data; // Name
+    CHECK_EQUAL(source->getLedCount(), data[0] << 8 | data[1]);
+    CHECK_EQUAL(99, data[2]);
+    data += 5;
+    int formulas = 0;
+    for (int i = 0; i < 3; ++i) {
+      formulas += data[1] != 0;
+      data += 2 + data[1];
+    }
+    data += 1;
+    data += 1 + data[0] * 4; // Layout
+    data += 3;
+    int variables = *(data++);
+    for (int i = 0; i < variables; ++i)
+      data += 3 + data[2];
+    data += 7;
+    int zones = *(data++);
+    for (int i = 0; i < zones; ++i) {
+      data += 6;
+      for (int j = 0; j < 3; ++j)
+        data += 2 + data[1];
+    }
+    printf("Status in %u bytes: %i formulas, %i variables, %i zones\n", maxLength, formulas, variables, zones);
+    CHECK_EQUAL(length, (unsigned int) (data - buffer));
+  }
+
+  // An update packet with more zones than there can be is ignored before reading them
+  uint8_t zones[] = {128, 64, 200, 0, 0};
+  const uint8_t *packet = zones;
+  LedServer(copy, &scheduler).handlePacket(packet, 0);
+  CHECK(packet == zones + 3);
+  copy->update_timed(3, 0);
+  CHECK_EQUAL(0, copy->getZones().size());
+
+  return checkResult();
+}
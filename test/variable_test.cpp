@@ -0,0 +1,139 @@
+#include <EEPROM.h>
+
+#include "led_server.h"
+
+#include "check.h"
+#include "host.h"
+
+static unsigned long now = 0;
+
+static LedController *restart() {
+  EEPROM.begin(CONFIG_SIZE);
+  auto *controller = new LedController();
+  controller->loadConfig();
+  controller->init();
+  controller->update_timed(now, 0);
+  return controller;
+}
+
+static String parsed(const char *text) {
+  FormulaData data;
+  parseFormulaData(int_formula, text, data);
+  return data.text;
+}
+
+static Zone makeZone(const char *hue) {
+  Zone zone;
+  zone.start = 10;
+  zone.count = 10;
+  parseFormulaData(int_formula, hue, zone.formulas[0]);
+  parseFormulaData(int_formula, "255", zone.formulas[1]);
+  parseFormulaData(int_formula, "255", zone.formulas[2]);
+  zone.updateFlags();
+  return zone;
+}
+
+int main() {
+  LedController *controller = restart();
+  FrameScheduler scheduler(FRAME_POLICY);
+  LedServer server(controller, &scheduler);
+  String hue = controller->getFormula(0);
+
+  // A variable that isn't defined is a typo, so the formula is rejected like one that doesn't parse
+  CHECK(!controller->setFormula(0, int_formula, "p + x"));
+  CHECK(!controller->setVariable('q', int_formula, "p * 2"));
+  CHECK(!controller->setVariable('p', int_formula, "p + 1"));
+  CHECK(!controller->setZones({makeZone("p")}));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getFormula(0) == hue);
+  CHECK_EQUAL(0, controller->getVariables().size());
+  CHECK_EQUAL(0, controller->getZones().size());
+
+  // Once it's set it can be used right away, before it's applied, and by the variables after it
+  CHECK(controller->setVariable('p', int_formula, "t * 3 % 256"));
+  CHECK(controller->setVariable('q', int_formula, "p / 2"));
+  CHECK(controller->setFormula(0, int_formula, "p + x"));
+  CHECK(controller->setZones({makeZone("q")}));
+  CHECK(!controller->setFormula(1, int_formula, "r"));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getFormula(0) == parsed("p + x"));
+  CHECK_EQUAL(2, controller->getVariables().size());
+  CHECK_EQUAL(1, controller->getZones().size());
+  CHECK(controller->setFormula(2, int_formula, "255 - q"));
+
+  // An update packet has the formulas before the variables, but they're set after them
+  uint8_t packet[64];
+  unsigned int length = 0;
+  packet[length++] = 16 | 128;
+  packet[length++] = 8;
+  packet[length++] = int_formula;
+  for (char c : "sin8(w)")
+    packet[length++] = c;
+  packet[length++] = 1;
+  packet[length++] = 'w';
+  packet[length++] = int_formula;
+  for (char c : "t % 100")
+    packet[length++] = c;
+  const uint8_t *data = packet;
+  server.handlePacket(data, now);
+  CHECK(data == packet + length);
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getFormula(1) == parsed("sin8(w)"));
+  CHECK_EQUAL(3, controller->getVariables().size());
+
+  // And so is the config that's loaded on startup
+  controller->update_timed(now += POST_CHANGE_SAVE_DELAY + 10, 0);
+  controller = restart();
+  printf("After a restart: hue %s, sat %s, %i variables\n", controller->getFormula(0).c_str(),
+         controller->getFormula(1).c_str(), (int) controller->getVariables().size());
+  CHECK(controller->getFormula(0) == parsed("p + x"));
+  CHECK(controller->getFormula(1) == parsed("sin8(w)"));
+  CHECK(controller->getFormula(2) == parsed("255 - q"));
+  CHECK_EQUAL(3, controller->getVariables().size());
+  CHECK_EQUAL(1, controller->getZones().size());
+
+  // Variables are evaluated and saved in order, so one can't be removed while something uses it, or use one that's
+  // after it
+  CHECK(!controller->setVariable('p', int_formula, ""));
+  CHECK(!controller->setVariable('w', int_formula, ""));
+  CHECK(!controller->setVariable('p', int_formula, "q * 2"));
+  CHECK(!controller->setVariable('q', int_formula, "q + 1"));
+  CHECK(controller->setVariable('q', int_formula, "p / 3"));
+
+  // Something that's queued can use it too, which the render task checks
+  CHECK(controller->setVariable('r', int_formula, "t % 7"));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->setFormula(1, int_formula, "r"));
+  CHECK(controller->setVariable('r', int_formula, ""));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getFormula(1) == parsed("r"));
+  CHECK_EQUAL(4, controller->getVariables().size());
+
+  // And the other way around, a formula that's sent after the variable it uses was removed
+  CHECK(controller->setFormula(1, int_formula, "sin8(w)"));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->setVariable('r', int_formula, ""));
+  CHECK(controller->setFormula(2, int_formula, "r"));
+  controller->update_timed(now += 10, 0);
+  CHECK(controller->getFormula(1) == parsed("sin8(w)"));
+  CHECK(controller->getFormula(2) == parsed("255 - q"));
+  CHECK_EQUAL(3, controller->getVariables().size());
+
+  // A config that still has a formula that doesn't load, from before these checks, starts with a default one
+  controller->update_timed(now += POST_CHANGE_SAVE_DELAY + 10, 0);
+  String saved = parsed("p + x");
+  for (int addr = 0; addr < CONFIG_SIZE; ++addr) {
+    if (EEPROM.readString(addr) == saved) {
+      EEPROM.write(addr, 'z');
+      break;
+    }
+  }
+  EEPROM.commit();
+  controller = restart();
+  CHECK(controller->getFormula(0) == parsed("x+t"));
+  CHECK(controller->getFormula(1) == parsed("sin8(w)"));
+  CHECK_EQUAL(3, controller->getVariables().size());
+  controller->update_timed(now += 10, 1);
+
+  return checkResult();
+}
@@ -0,0 +1,63 @@
+#include <esp_timer.h>
+
+#include "led_controller.h"
+
+#include "check.h"
+
+#define LEDS 300
+#define FRAMES 400
+
+// Typical waves, written with the operators only the way they had to be before there were builtins, and with them
+static const char *waves[][2] = {
+        // A sine, approximated by a parabola on each half of a triangle wave
+        {"255 - |(x * 4 + t) % 256 - 128| * |(x * 4 + t) % 256 - 128| / 65", "sin8(x * 4 + t)"},
+        // A brightness that pulses 30 times a minute, t being in ms
+        {"255 - |t * 30 * 256 / 60000 % 256 - 128| * |t * 30 * 256 / 60000 % 256 - 128| / 65", "beat(t, 30)"},
+        // Two waves moving in opposite directions
+        {"(255 - |(x * 3 + t) % 256 - 128| * |(x * 3 + t) % 256 - 128| / 65 + 255 - |(x * 5 - t + 25600) % 256 - 128| * |(x * 5 - t + 25600) % 256 - 128| / 65) / 2",
+         "(sin8(x * 3 + t) + cos8(x * 5 - t)) / 2"},
+};
+
+// Renders a strip with the formula the way the controller does, in batches, and returns the microseconds per frame
+static double measure(const FormulaData &formula) {
+  int out[FORMULA_BATCH];
+  int64_t sum = 0;
+  int lowest = 255, highest = 0;
+
+  int64_t start = esp_timer_get_time();
+  for (int t = 0; t < FRAMES; ++t) {
+    for (int x = 0; x < LEDS; x += FORMULA_BATCH) {
+      int count = min(FORMULA_BATCH, LEDS - x);
+      formula.evalBatch(x, 1, count, t * 16, out);
+      for (int i = 0; i < count; ++i) {
+        lowest = min(lowest, out[i]);
+        highest = max(highest, out[i]);
+        sum += out[i];
+      }
+    }
+  }
+  int64_t elapsed = esp_timer_get_time() - start;
+
+  CHECK(lowest >= 0 && highest <= 255);
+  CHECK(sum > 0); // So the loop isn't optimized away
+  return (double) elapsed / FRAMES;
+}
+
+int main() {
+  double total[2] = {};
+  for (auto &wave : waves) {
+    double us[2];
+    for (int i = 0; i < 2; ++i) {
+      FormulaData formula;
+      CHECK(parseFormulaData(int_formula, wave[i], formula));
+      if (formula.form == nullptr)
+        return checkResult();
+      total[i] += us[i] = measure(formula);
+    }
+    printf("%s: %.1f us per frame with operators, %.1f us with builtins\n", wave[1], us[0], us[1]);
+  }
+
+  CHECK(total[1] < total[0]);
+
+  return checkResult();
+}